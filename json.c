@@ -1,9 +1,21 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "json.h"
 
 /*
@@ -22,11 +34,22 @@
  * pointer. We create new values on the heap and then save
  * their pointers in this array.
  *
- * JSON values that are arrays are json_value_t *. The last
- * entry is always a sentinel so we know where the end of
- * the array is (its value type is an int with value
- * 0xdeadbeef). Its name is also %NULL, but having the
- * integer sentinel value let's us be more sure.
+ * JSON values that are arrays are json nodes too, whose
+ * values are the elements in order. They have no names,
+ * and the length of the array is simply the node's
+ * number of values. Either kind of container can hold the
+ * other, and the top level of a document can be either.
+ *
+ * JSON_parse_tape() builds the other representation: no
+ * nodes or value pointers at all, just one array of small
+ * fixed-size entries laid out in document order, which is
+ * much kinder to the cache when walking the whole thing.
+ *
+ * Neither is built by the grammar itself. It only sends
+ * events (a key, a string, the start of an object...) to
+ * a json_handler_t, and the tree and the tape are each
+ * built by a handler of our own. JSON_parse_sax() hands
+ * the events to the caller's handler instead.
  */
 
 static void
@@ -45,51 +68,304 @@ Debug(char *fmt, ...)
 	return;
 }
 
+/*
+ * Built with -DJSON_STATS, a parse with a context counts what
+ * it does as it goes, for JSON_parser_stats(), and times its
+ * phases with the cheapest clock there is: the time-stamp
+ * counter on x86, the virtual counter on ARM, and otherwise
+ * the monotonic clock in nanoseconds. Without it all of this
+ * comes to nothing and there isn't even a json_stats_t in
+ * the context.
+ *
+ * Even the cheapest clock costs about as much as the work
+ * done for a small value, so stage one and the parse as a
+ * whole are timed throughout but the per-value phases only
+ * for one token in every STAT_SAMPLE, and their totals are
+ * scaled up when they are read.
+ */
+#ifdef JSON_STATS
+static inline unsigned long long
+stat_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	unsigned long long t;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#define STAT_SAMPLE 64
+
+# define STAT_ADD(st, f, n) ((st)->f += (n))
+# define STAT_MAX(st, f, n) ((st)->f < (n) ? (void)((st)->f = (n)) : (void)0)
+# define STAT_TIMER(t) unsigned long long t = stat_clock()
+# define STAT_SAMPLED(ctx, t) \
+	unsigned long long t = 0 == (ctx)->stats.nr_tokens % STAT_SAMPLE ? stat_clock() : 0
+# define STAT_TIME(st, p, t) \
+	((t) ? (void)((st)->cycles[(p)] += stat_clock() - (t)) : (void)0)
+/*
+ * For a phase that runs inside another (strings are stored
+ * by the tree builder's handlers), so the outer one is left
+ * with only its own time.
+ */
+# define STAT_TIME_IN(st, p, outer, t) \
+	do { \
+		if (t) \
+		{ \
+			unsigned long long d_ = stat_clock() - (t); \
+			(st)->cycles[(p)] += d_; \
+			(st)->cycles[(outer)] -= d_; \
+		} \
+	} while (0)
+#else
+# define STAT_ADD(st, f, n) ((void)0)
+# define STAT_MAX(st, f, n) ((void)0)
+# define STAT_TIMER(t)
+# define STAT_SAMPLED(ctx, t)
+# define STAT_TIME(st, p, t) ((void)0)
+# define STAT_TIME_IN(st, p, outer, t) ((void)0)
+#endif
+
 enum
 {
 	FALSE = 0,
 	TRUE = 1
 };
 
-enum
+/*
+ * The allocator hooks, or the C library's own if there
+ * are none.
+ */
+static void *
+mem_alloc(const json_allocator_t *mem, size_t size)
 {
-	VALUE_STRING = 0,
-	VALUE_NULL,
-	VALUE_BOOLEAN,
-	VALUE_NUMBER,
-	VALUE_FLOAT,
-	VALUE_DOUBLE,
-	VALUE_ARRAY,
-	VALUE_OBJECT
-};
+	return NULL != mem->alloc ? mem->alloc(mem->user, size) : malloc(size);
+}
 
-typedef union JSON_UValue json_uvalue_t;
-typedef struct JSON_Value json_value_t;
+static void *
+mem_realloc(const json_allocator_t *mem, void *p, size_t size)
+{
+	return NULL != mem->realloc ? mem->realloc(mem->user, p, size) : realloc(p, size);
+}
 
-typedef struct JSON_Node
+static void
+mem_free(const json_allocator_t *mem, void *p)
 {
-	char *name;
-	json_value_t **values;
-	int nr_values;
-} json_node_t;
-
-union JSON_UValue
-{
-	char *u_string;
-	json_uvalue_t *u_array;
-	int u_int;
-	char u_boolean;
-	float u_float;
-	double u_double;
-	json_node_t *u_object;
-};
+	if (NULL != mem->free)
+		mem->free(mem->user, p);
+	else
+		free(p);
+}
+
+static const json_allocator_t libc_mem;
+
+/*
+ * All memory belonging to a document comes from its arena.
+ * Chunks start small so tiny documents stay cheap and double
+ * in size as the document grows, capped so that a single
+ * huge document doesn't keep asking for ever larger blocks.
+ * Requests that don't fit in a chunk of the current size get
+ * a chunk of their own, linked in behind the head so that
+ * the free space in the head chunk is not wasted.
+ */
+#define ARENA_CHUNK_MIN (4096 - sizeof(json_chunk_t))
+#define ARENA_CHUNK_MAX ((1 << 20) - sizeof(json_chunk_t))
+#define ARENA_ALIGN sizeof(void *)
+#define ARENA_ROUND(s) (((s) + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1))
 
-struct JSON_Value
+static json_chunk_t *
+arena_new_chunk(json_arena_t *arena, size_t size)
 {
-	int type;
-	char *name;
-	json_uvalue_t value;
-};
+	json_chunk_t *c = mem_alloc(&arena->mem, sizeof(json_chunk_t) + size);
+
+	if (NULL == c)
+		return NULL;
+
+	arena->bytes += sizeof(json_chunk_t) + size;
+	++arena->nr_allocs;
+
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return c;
+}
+
+static void *
+arena_alloc(json_arena_t *arena, size_t size)
+{
+	json_chunk_t *c = arena->head;
+	void *p;
+
+	size = ARENA_ROUND(size);
+
+	if (NULL == c || c->size - c->used < size)
+	{
+		if (0 == arena->next_size)
+			arena->next_size = ARENA_CHUNK_MIN;
+
+		if (size > arena->next_size)
+		{
+			c = arena_new_chunk(arena, size);
+			if (NULL == c)
+				return NULL;
+
+			if (NULL == arena->head)
+			{
+				arena->head = c;
+			}
+			else
+			{
+				c->next = arena->head->next;
+				arena->head->next = c;
+			}
+
+			c->used = size;
+			return c->data;
+		}
+
+		c = arena_new_chunk(arena, arena->next_size);
+		if (NULL == c)
+			return NULL;
+
+		c->next = arena->head;
+		arena->head = c;
+
+		if (arena->next_size < ARENA_CHUNK_MAX)
+		{
+			arena->next_size = (arena->next_size + sizeof(json_chunk_t)) * 2 - sizeof(json_chunk_t);
+			if (arena->next_size > ARENA_CHUNK_MAX)
+				arena->next_size = ARENA_CHUNK_MAX;
+		}
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+
+	return p;
+}
+
+static void *
+arena_calloc(json_arena_t *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (NULL == p)
+		return NULL;
+
+	memset(p, 0, size);
+
+	return p;
+}
+
+/**
+ * Grow an allocation. If it was the last thing carved out
+ * of the head chunk and there is room behind it, it simply
+ * grows in place; otherwise it is copied into fresh space
+ * and the old space is left to be reclaimed with the arena.
+ */
+static void *
+arena_realloc(json_arena_t *arena, void *old, size_t old_size, size_t new_size)
+{
+	json_chunk_t *c = arena->head;
+	void *p;
+
+	if (NULL == old)
+		return arena_alloc(arena, new_size);
+
+	old_size = ARENA_ROUND(old_size);
+	new_size = ARENA_ROUND(new_size);
+
+	if (new_size <= old_size)
+		return old;
+
+	if (NULL != c
+	&& (char *)old + old_size == c->data + c->used
+	&& c->size - c->used >= new_size - old_size)
+	{
+		c->used += new_size - old_size;
+		return old;
+	}
+
+	p = arena_alloc(arena, new_size);
+	if (NULL == p)
+		return NULL;
+
+	memcpy(p, old, old_size);
+
+	return p;
+}
+
+static char *
+arena_strndup(json_arena_t *arena, const char *s, size_t len)
+{
+	char *p = arena_alloc(arena, len + 1);
+
+	if (NULL == p)
+		return NULL;
+
+	memcpy(p, s, len);
+	p[len] = 0;
+
+	return p;
+}
+
+static void
+arena_release(json_arena_t *arena)
+{
+	json_chunk_t *c = arena->head;
+	json_chunk_t *n;
+
+	while (NULL != c)
+	{
+		n = c->next;
+		mem_free(&arena->mem, c);
+		c = n;
+	}
+
+	arena->head = NULL;
+	arena->next_size = 0;
+	arena->bytes = 0;
+	arena->nr_allocs = 0;
+
+	return;
+}
+
+/*
+ * Empty the arena for reuse, holding on to the newest (and
+ * so the largest) chunk so that a run of small documents
+ * never goes back to malloc() at all.
+ */
+static void
+arena_rewind(json_arena_t *arena)
+{
+	json_chunk_t *c;
+	json_chunk_t *n;
+
+	if (NULL == arena->head)
+		return;
+
+	for (c = arena->head->next; NULL != c; c = n)
+	{
+		n = c->next;
+		mem_free(&arena->mem, c);
+	}
+
+	arena->head->next = NULL;
+	arena->head->used = 0;
+	arena->bytes = sizeof(json_chunk_t) + arena->head->size;
+	arena->nr_allocs = 1;
+
+	return;
+}
 
 #define CR	'\r'
 #define NL	'\n'
@@ -103,6 +379,9 @@ struct JSON_Value
 #define COMMA	','
 #define SPACE	' '
 
+#define COLON	':'
+#define MINUS	'-'
+
 #define IS_CRNL(p) ((p) == CR || (p) == NL)
 
 enum
@@ -114,604 +393,9200 @@ enum
 	TOK_RBRACK,
 	TOK_DQUOTE,
 	TOK_COMMA,
+	TOK_COLON,
 	TOK_CHARSEQ,
-	TOK_DIGIT
+	TOK_DIGIT,
+	TOK_EOF
 };
 
-static int
-lex(void)
+/*
+ * Stage one: rather than have lex() look at the input a
+ * byte at a time, we classify it 64 bytes at a go with
+ * whatever vector unit we have and keep a small queue of
+ * the offsets of the structural characters ({}[]:, and
+ * both quotes of each string) and of the first byte of each
+ * bare number or word. Whitespace and the insides of
+ * strings never reach the lexer at all.
+ *
+ * Which quotes are escaped and which bytes lie inside a
+ * string is worked out with bit arithmetic on the masks,
+ * carrying state from one block to the next, so runs of
+ * backslashes before a quote come out right without a loop.
+ */
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+#define SCAN_BLOCK 64
+#define SCAN_BATCH 4
+
+typedef struct JSON_Scanner
+{
+	const char *buf;
+	size_t len;
+	size_t pos;
+	uint64_t prev_escaped;
+	uint64_t prev_in_string;
+	uint64_t prev_scalar;
+	size_t idx[SCAN_BLOCK * SCAN_BATCH];
+	int nr_idx;
+	int cur_idx;
+#ifdef JSON_STATS
+	json_stats_t *stats;
+#endif
+} json_scanner_t;
+
+typedef struct JSON_Block_Masks
+{
+	uint64_t bslash;
+	uint64_t quote;
+	uint64_t space;
+	uint64_t op;
+} json_masks_t;
+
+#if defined(__AVX2__)
+
+#define EQ32(v,c) \
+	((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((v), _mm256_set1_epi8((c)))))
+
+static inline void
+classify_block(const unsigned char *p, json_masks_t *m)
 {
-#define IS_CNTRLSPACE(p) (IS_CRNL(p) || (p) == TAB)
-	while (IS_CNTRLSPACE(*ptr))
-		++ptr;
+	int i;
+	__m256i v;
+	__m256i lv;
+
+	memset(m, 0, sizeof(*m));
 
-	if (*ptr == SPACE && IS_CRNL(*(ptr-1)))
+	for (i = 0; i < SCAN_BLOCK; i += 32)
 	{
-		while (*ptr == SPACE)
-			++ptr;
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+	/*
+	 * OR-ing in 0x20 folds [ and ] onto { and }
+	 */
+		lv = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+		m->bslash |= EQ32(v, '\\') << i;
+		m->quote |= EQ32(v, '"') << i;
+		m->space |= (EQ32(v, ' ') | EQ32(v, '\t') | EQ32(v, '\n') | EQ32(v, '\r')) << i;
+		m->op |= (EQ32(lv, '{') | EQ32(lv, '}') | EQ32(v, ':') | EQ32(v, ',')) << i;
 	}
+}
+
+#elif defined(__SSE2__)
+
+#define EQ16(v,c) \
+	((uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8((v), _mm_set1_epi8((c)))))
 
-	switch(*ptr)
+static inline void
+classify_block(const unsigned char *p, json_masks_t *m)
+{
+	int i;
+	__m128i v;
+	__m128i lv;
+
+	memset(m, 0, sizeof(*m));
+
+	for (i = 0; i < SCAN_BLOCK; i += 16)
 	{
-		case DQUOTE:
-			++ptr;
-			return TOK_DQUOTE;
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		lv = _mm_or_si128(v, _mm_set1_epi8(0x20));
 
-		case LBRACE:
-			++ptr;
-			return TOK_LBRACE;
+		m->bslash |= EQ16(v, '\\') << i;
+		m->quote |= EQ16(v, '"') << i;
+		m->space |= (EQ16(v, ' ') | EQ16(v, '\t') | EQ16(v, '\n') | EQ16(v, '\r')) << i;
+		m->op |= (EQ16(lv, '{') | EQ16(lv, '}') | EQ16(v, ':') | EQ16(v, ',')) << i;
+	}
+}
 
-		case RBRACE:
-			++ptr;
-			return TOK_RBRACE;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
 
-		case LBRACK:
-			++ptr;
-			return TOK_LBRACK;
+/*
+ * NEON has no movemask, so weight each lane by its bit
+ * and add neighbouring lanes together until 64 bits remain.
+ */
+static inline uint64_t
+neon_mask64(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+	const uint8x16_t bit = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t s0 = vpaddq_u8(vandq_u8(a, bit), vandq_u8(b, bit));
+	uint8x16_t s1 = vpaddq_u8(vandq_u8(c, bit), vandq_u8(d, bit));
 
-		case RBRACK:
-			++ptr;
-			return TOK_RBRACK;
+	s0 = vpaddq_u8(s0, s1);
+	s0 = vpaddq_u8(s0, s0);
 
-		case SPACE:
-			++ptr;
-			return TOK_SPACE;
+	return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
 
-		default:
-			if (isdigit(*ptr))
-				return TOK_DIGIT;
+#define NEON_EQ(v,c) vceqq_u8((v), vdupq_n_u8((c)))
+#define NEON_MASK(expr) \
+({ \
+	uint8x16_t __r[4]; \
+	int __k; \
+	for (__k = 0; __k < 4; ++__k) \
+	{ \
+		uint8x16_t v = vv[__k]; \
+		uint8x16_t lv = lvv[__k]; \
+		(void)lv; \
+		__r[__k] = (expr); \
+	} \
+	neon_mask64(__r[0], __r[1], __r[2], __r[3]); \
+})
 
-			return TOK_CHARSEQ;
+static inline void
+classify_block(const unsigned char *p, json_masks_t *m)
+{
+	uint8x16_t vv[4];
+	uint8x16_t lvv[4];
+	int k;
+
+	for (k = 0; k < 4; ++k)
+	{
+		vv[k] = vld1q_u8(p + k * 16);
+		lvv[k] = vorrq_u8(vv[k], vdupq_n_u8(0x20));
+	}
+
+	m->bslash = NEON_MASK(NEON_EQ(v, '\\'));
+	m->quote = NEON_MASK(NEON_EQ(v, '"'));
+	m->space = NEON_MASK(vorrq_u8(vorrq_u8(NEON_EQ(v, ' '), NEON_EQ(v, '\t')),
+			vorrq_u8(NEON_EQ(v, '\n'), NEON_EQ(v, '\r'))));
+	m->op = NEON_MASK(vorrq_u8(vorrq_u8(NEON_EQ(lv, '{'), NEON_EQ(lv, '}')),
+			vorrq_u8(NEON_EQ(v, ':'), NEON_EQ(v, ','))));
+}
+
+#else
+
+enum
+{
+	CLASS_BSLASH = 1,
+	CLASS_QUOTE = 2,
+	CLASS_SPACE = 4,
+	CLASS_OP = 8
+};
+
+static const unsigned char byte_class[256] =
+{
+	['\\'] = CLASS_BSLASH,
+	['"'] = CLASS_QUOTE,
+	[' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE, ['\n'] = CLASS_SPACE, ['\r'] = CLASS_SPACE,
+	['{'] = CLASS_OP, ['}'] = CLASS_OP, ['['] = CLASS_OP, [']'] = CLASS_OP,
+	[':'] = CLASS_OP, [','] = CLASS_OP
+};
+
+static inline void
+classify_block(const unsigned char *p, json_masks_t *m)
+{
+	int i;
+	uint64_t bit;
+	unsigned char c;
+
+	memset(m, 0, sizeof(*m));
+
+	for (i = 0; i < SCAN_BLOCK; ++i)
+	{
+		c = byte_class[p[i]];
+		bit = (uint64_t)1 << i;
+
+		if (c & CLASS_BSLASH)
+			m->bslash |= bit;
+		else
+		if (c & CLASS_QUOTE)
+			m->quote |= bit;
+		else
+		if (c & CLASS_SPACE)
+			m->space |= bit;
+		else
+		if (c & CLASS_OP)
+			m->op |= bit;
+	}
+}
+
+#endif
+
+/*
+ * Bit i of the result is the XOR of bits 0..i of X: set
+ * for every byte from an opening quote up to (but not
+ * including) its closing quote.
+ */
+static inline uint64_t
+prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+
+	return x;
+}
+
+#define EVEN_BITS 0x5555555555555555ULL
+
+/*
+ * The bytes preceded by an odd number of backslashes.
+ * Adding the starts of the odd-positioned backslash runs to
+ * the runs carries out of each run at its end, which lets
+ * us tell odd-length runs from even ones whatever their
+ * length. A run left open at the end of the block carries
+ * into the next through PREV_ESCAPED.
+ */
+static inline uint64_t
+find_escaped(json_scanner_t *sc, uint64_t bslash)
+{
+	uint64_t follows;
+	uint64_t odd_starts;
+	uint64_t even_seqs;
+
+	bslash &= ~sc->prev_escaped;
+	follows = (bslash << 1) | sc->prev_escaped;
+	odd_starts = bslash & ~EVEN_BITS & ~follows;
+
+	sc->prev_escaped = __builtin_add_overflow(odd_starts, bslash, &even_seqs);
+
+	return (EVEN_BITS ^ (even_seqs << 1)) & follows;
+}
+
+static void
+scan_block(json_scanner_t *sc, const unsigned char *p, size_t base)
+{
+	json_masks_t m;
+	uint64_t escaped;
+	uint64_t quote;
+	uint64_t in_string;
+	uint64_t scalar;
+	uint64_t scalar_start;
+	uint64_t structural;
+
+	classify_block(p, &m);
+
+	escaped = find_escaped(sc, m.bslash);
+	quote = m.quote & ~escaped;
+
+	in_string = prefix_xor(quote) ^ sc->prev_in_string;
+	sc->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+/*
+ * Anything that isn't an operator or whitespace belongs to
+ * a scalar, and we only want the first byte of each one.
+ */
+	scalar = ~(m.op | m.space) & ~quote;
+	scalar_start = scalar & ~((scalar << 1) | sc->prev_scalar);
+	sc->prev_scalar = scalar >> 63;
+
+	structural = ((m.op | scalar_start) & ~in_string) | quote;
+
+	while (structural)
+	{
+		sc->idx[sc->nr_idx++] = base + __builtin_ctzll(structural);
+		structural &= structural - 1;
 	}
 }
 
-static int current = -1;
-static int lookahead = -1;
+static void
+scanner_init(json_scanner_t *sc, const char *buf, size_t len)
+{
+	memset(sc, 0, sizeof(*sc));
+	sc->buf = buf;
+	sc->len = len;
+}
 
+/*
+ * Refill the queue of offsets from the next few blocks.
+ * The final partial block is padded out with spaces.
+ */
 static void
-advance(void)
+scanner_fill(json_scanner_t *sc)
+{
+	unsigned char tail[SCAN_BLOCK];
+	int blocks = 0;
+#ifdef JSON_STATS
+	size_t from = sc->pos < sc->len ? sc->pos : sc->len;
+	STAT_TIMER(t);
+#endif
+
+	sc->nr_idx = 0;
+	sc->cur_idx = 0;
+
+	while (blocks < SCAN_BATCH && sc->pos < sc->len)
+	{
+		if (sc->len - sc->pos >= SCAN_BLOCK)
+		{
+			scan_block(sc, (const unsigned char *)sc->buf + sc->pos, sc->pos);
+		}
+		else
+		{
+			memset(tail, SPACE, SCAN_BLOCK);
+			memcpy(tail, sc->buf + sc->pos, sc->len - sc->pos);
+			scan_block(sc, tail, sc->pos);
+		}
+
+		sc->pos += SCAN_BLOCK;
+
+		if (sc->nr_idx > 0)
+			++blocks;
+	}
+
+#ifdef JSON_STATS
+	if (NULL != sc->stats)
+	{
+		STAT_ADD(sc->stats, bytes_scanned, (sc->pos < sc->len ? sc->pos : sc->len) - from);
+		STAT_TIME(sc->stats, JSON_PHASE_SCAN, t);
+	}
+#endif
+}
+
+/*
+ * Offset of the next structural byte, or the length
+ * of the input once there are none left.
+ */
+static inline size_t
+scanner_next(json_scanner_t *sc)
 {
-	current = lookahead;
-	lookahead = lex();
+	if (sc->cur_idx == sc->nr_idx)
+	{
+		scanner_fill(sc);
+		if (0 == sc->nr_idx)
+			return sc->len;
+	}
+
+	return sc->idx[sc->cur_idx++];
 }
 
-static int
-matches(int tok)
+static inline size_t
+scanner_peek(json_scanner_t *sc)
+{
+	if (sc->cur_idx == sc->nr_idx)
+	{
+		scanner_fill(sc);
+		if (0 == sc->nr_idx)
+			return sc->len;
+	}
+
+	return sc->idx[sc->cur_idx];
+}
+
+/*
+ * Everything a parse needs to remember lives here rather
+ * than in file-scope statics, so any number of parses can
+ * run at once as long as each has its own context.
+ */
+
+/*
+ * One frame for each container the parse is inside: what
+ * kind it is, and what the tree or tape builder needs back
+ * once it ends. The first DEPTH_INLINE frames are part of
+ * the context, so most documents never allocate any; past
+ * that they move to the heap, doubling as needed up to the
+ * context's maximum depth, and stay for its next parse.
+ */
+#define DEPTH_INLINE 32
+#define DEPTH_MAX_DEFAULT 1024
+
+typedef struct JSON_Frame
+{
+	int kind;
+	json_node_t *parent;
+	size_t tape_open;
+} json_frame_t;
+
+#define NEST_OBJECT	'{'
+#define NEST_ARRAY	'['
+
+#define IN_OBJECT(ctx) ((ctx)->depth > 0 && NEST_OBJECT == (ctx)->frames[(ctx)->depth-1].kind)
+
+struct JSON_Parser
+{
+	int flags;
+
+	const char *ptr;
+	const char *end;
+	json_scanner_t scanner;
+
+/*
+ * FINAL is clear while streaming: the end of the input we
+ * have is then only the end of a chunk, and a token that
+ * runs into it may carry on in the next. TOK is where
+ * the last token lexed started.
+ */
+	int final;
+	const char *tok;
+
+	int current;
+	int lookahead;
+
+/*
+ * Span of the last string found by parse_charseq(). It
+ * points straight into the caller's buffer, quotes
+ * excluded and escapes included; nothing is copied
+ * until the string is stored in the document.
+ */
+	const char *charseq;
+	size_t charseq_len;
+	int charseq_escaped;
+
+	json_node_t *node;
+	json_node_t *parent;
+	json_value_t *value;
+
+/*
+ * Where the grammar is: the frames of the containers we
+ * are inside, and whether the innermost (an object) is
+ * waiting for a key rather than a value. So when we
+ * encounter a DQUOTE we know whether this is going to be
+ * the key or the value.
+ */
+	json_frame_t *frames;
+	int nr_frames;
+	int max_depth;
+	int depth;
+	int want_key;
+	int done;
+
+/*
+ * With JSON_OPT_STRICT, what the last token was as far as
+ * commas and colons go. ERR and ERR_AT are why and where
+ * the parse went wrong, when it did.
+ */
+	int sep;
+	int err;
+	const char *err_at;
+
+/*
+ * Who the grammar's events go to, and what they get passed.
+ * SCALAR_ROOT is set for handlers that can take a document
+ * that is only a string, number, true, false or null.
+ */
+	const json_handler_t *handler;
+	void *user;
+	int scalar_root;
+
+/*
+ * The document or tape being built. Everything
+ * the tree parser allocates comes from the
+ * document's arena.
+ */
+	json_t *doc;
+	json_tape_t *tp;
+
+/*
+ * A names table shared by every document parsed with this
+ * context, if the caller has given us one.
+ */
+	json_intern_t *keys;
+
+/*
+ * Where the documents we build, and our own frames and
+ * carry buffer, get their memory.
+ */
+	json_allocator_t mem;
+
+/*
+ * Streaming only: a token cut off at the end of a chunk is
+ * kept here until the rest of it arrives.
+ */
+	char *carry;
+	size_t carry_len;
+	size_t carry_alloc;
+
+/*
+ * Newline-delimited input only: what's left of the buffer,
+ * and the document each record is parsed into in turn.
+ */
+	const char *many;
+	const char *many_end;
+	int many_flags;
+	json_t *many_doc;
+
+#ifdef JSON_STATS
+	json_stats_t stats;
+#endif
+
+	json_frame_t frames_inline[DEPTH_INLINE];
+};
+
+#define ARENA() (&ctx->doc->arena)
+
+static int
+lex(json_parser_t *ctx)
+{
+	size_t off = scanner_next(&ctx->scanner);
+
+/*
+ * The input needn't be NUL-terminated, so the end of it
+ * has to be a token of its own rather than a '\0' byte.
+ */
+	if (off >= ctx->scanner.len)
+	{
+		ctx->ptr = ctx->end;
+		return TOK_EOF;
+	}
+
+	ctx->ptr = ctx->scanner.buf + off;
+	ctx->tok = ctx->ptr;
+	STAT_ADD(&ctx->stats, nr_tokens, 1);
+
+	switch(*ctx->ptr)
+	{
+		case DQUOTE:
+			++ctx->ptr;
+			return TOK_DQUOTE;
+
+		case LBRACE:
+			++ctx->ptr;
+			return TOK_LBRACE;
+
+		case RBRACE:
+			++ctx->ptr;
+			return TOK_RBRACE;
+
+		case LBRACK:
+			++ctx->ptr;
+			return TOK_LBRACK;
+
+		case RBRACK:
+			++ctx->ptr;
+			return TOK_RBRACK;
+
+		case COMMA:
+			++ctx->ptr;
+			return TOK_COMMA;
+
+		case COLON:
+			++ctx->ptr;
+			return TOK_COLON;
+
+		case MINUS:
+			return TOK_DIGIT;
+
+		default:
+			if (isdigit((unsigned char)*ctx->ptr))
+				return TOK_DIGIT;
+
+			return TOK_CHARSEQ;
+	}
+}
+
+static void
+advance(json_parser_t *ctx)
+{
+	ctx->current = ctx->lookahead;
+	ctx->lookahead = lex(ctx);
+}
+
+static int
+matches(json_parser_t *ctx, int tok)
+{
+	return ctx->lookahead == tok;
+}
+
+#define BSLASH	'\\'
+
+/*
+ * What the parse routines return. PARSE_MORE only happens
+ * when streaming: the token runs off the end of the chunk
+ * and can't be finished until the next one arrives.
+ * PARSE_ABORT is the handler asking us to stop.
+ */
+enum
+{
+	PARSE_OK = 0,
+	PARSE_MORE,
+	PARSE_DONE,
+	PARSE_ABORT,
+	PARSE_ERROR
+};
+
+#define INCOMPLETE(ctx) ((ctx)->final ? PARSE_ERROR : PARSE_MORE)
+
+/*
+ * Note why the parse is going wrong, and where. Only the
+ * first reason counts: the rest follow from it.
+ */
+static int
+parse_fail(json_parser_t *ctx, int code, const char *at)
+{
+	if (JSON_ERR_NONE == ctx->err)
+	{
+		ctx->err = code;
+		ctx->err_at = at;
+	}
+
+	return PARSE_ERROR;
+}
+
+/*
+ * Whatever can end a bare word or number.
+ */
+#define IS_DELIM(c) \
+	((c) == COMMA || (c) == SPACE || IS_CRNL(c) || (c) == TAB \
+	|| (c) == RBRACE || (c) == RBRACK || (c) == LBRACE || (c) == LBRACK \
+	|| (c) == COLON || (c) == DQUOTE)
+
+static int
+parse_charseq(json_parser_t *ctx)
+{
+	const char *s = ctx->ptr;
+	const char *q;
+	size_t off;
+
+/*
+ * Stage one already knows which quote closes the string,
+ * escaped ones never make it into the queue.
+ */
+	off = scanner_peek(&ctx->scanner);
+	if (off >= ctx->scanner.len)
+		return ctx->final ? parse_fail(ctx, JSON_ERR_EOF, ctx->end) : PARSE_MORE;
+
+	q = ctx->scanner.buf + off;
+	assert(*q == DQUOTE);
+
+	ctx->charseq = s;
+	ctx->charseq_len = q - s;
+	ctx->charseq_escaped = NULL != memchr(s, BSLASH, ctx->charseq_len);
+
+	advance(ctx);
+
+	return PARSE_OK;
+}
+
+static int
+hex_value(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+static int
+parse_hex4(const char *s, const char *e)
+{
+	int i;
+	int h;
+	int cp = 0;
+
+	if (e - s < 4)
+		return -1;
+
+	for (i = 0; i < 4; ++i)
+	{
+		h = hex_value(s[i]);
+		if (h < 0)
+			return -1;
+
+		cp = (cp << 4) | h;
+	}
+
+	return cp;
+}
+
+static char *
+put_utf8(char *d, unsigned int cp)
+{
+	if (cp < 0x80)
+	{
+		*d++ = cp;
+	}
+	else
+	if (cp < 0x800)
+	{
+		*d++ = 0xc0 | (cp >> 6);
+		*d++ = 0x80 | (cp & 0x3f);
+	}
+	else
+	if (cp < 0x10000)
+	{
+		*d++ = 0xe0 | (cp >> 12);
+		*d++ = 0x80 | ((cp >> 6) & 0x3f);
+		*d++ = 0x80 | (cp & 0x3f);
+	}
+	else
+	{
+		*d++ = 0xf0 | (cp >> 18);
+		*d++ = 0x80 | ((cp >> 12) & 0x3f);
+		*d++ = 0x80 | ((cp >> 6) & 0x3f);
+		*d++ = 0x80 | (cp & 0x3f);
+	}
+
+	return d;
+}
+
+/**
+ * Decode the escape sequences in SRC into DST, which must
+ * have room for LEN bytes; no escape sequence decodes to
+ * more bytes than it occupies. Unknown or broken escapes
+ * are copied through as they are. Returns the decoded length.
+ */
+static size_t
+unescape(char *dst, const char *src, size_t len)
+{
+	const char *e = src + len;
+	const char *b;
+	char *d = dst;
+	int cp;
+	int lo;
+
+	while (src < e)
+	{
+		b = memchr(src, BSLASH, e - src);
+		if (NULL == b)
+			b = e;
+
+/*
+ * DST may be SRC itself, decoding in place: what is
+ * written never gets ahead of what has been read.
+ */
+		if (d != src)
+			memmove(d, src, b - src);
+		d += b - src;
+		src = b;
+
+		if (src >= e - 1)
+			break;
+
+		switch(src[1])
+		{
+			case '"': *d++ = '"'; src += 2; break;
+			case '\\': *d++ = '\\'; src += 2; break;
+			case '/': *d++ = '/'; src += 2; break;
+			case 'b': *d++ = '\b'; src += 2; break;
+			case 'f': *d++ = '\f'; src += 2; break;
+			case 'n': *d++ = '\n'; src += 2; break;
+			case 'r': *d++ = '\r'; src += 2; break;
+			case 't': *d++ = '\t'; src += 2; break;
+
+			case 'u':
+
+				cp = parse_hex4(src + 2, e);
+				if (cp < 0)
+					goto verbatim;
+
+				src += 6;
+
+				if (cp >= 0xd800 && cp < 0xdc00
+				&& e - src >= 6 && src[0] == BSLASH && src[1] == 'u'
+				&& (lo = parse_hex4(src + 2, e)) >= 0xdc00 && lo < 0xe000)
+				{
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+					src += 6;
+				}
+
+				d = put_utf8(d, cp);
+				break;
+
+			default:
+			verbatim:
+				*d++ = *src++;
+				break;
+		}
+	}
+
+	if (src < e)
+		*d++ = *src;
+
+	return d - dst;
+}
+
+/*
+ * How much of the input unescape() takes at a time from the
+ * backslash at S: an escape, a surrogate pair, or only the
+ * backslash if what follows isn't an escape.
+ */
+#define ESCAPE_MAX 12
+
+static size_t
+escape_length(const char *s, const char *e)
+{
+	int cp;
+	int lo;
+
+	if (e - s < 2)
+		return 1;
+
+	switch(s[1])
+	{
+		case '"': case '\\': case '/':
+		case 'b': case 'f': case 'n': case 'r': case 't':
+			return 2;
+
+		case 'u':
+			cp = parse_hex4(s + 2, e);
+			if (cp < 0)
+				return 1;
+
+			if (cp >= 0xd800 && cp < 0xdc00
+			&& e - s >= ESCAPE_MAX && s[6] == BSLASH && s[7] == 'u'
+			&& (lo = parse_hex4(s + 8, e)) >= 0xdc00 && lo < 0xe000)
+				return ESCAPE_MAX;
+
+			return 6;
+	}
+
+	return 1;
+}
+
+/*
+ * With JSON_OPT_STRICT nothing inside a string is taken on
+ * trust either. Most of any string is plain printable
+ * ASCII, so that is skipped a vector at a time and only
+ * escapes, control characters and multibyte sequences are
+ * looked at one by one.
+ */
+#define IS_PLAIN(c) ((unsigned char)(c) >= 0x20 && (unsigned char)(c) < 0x80 && (c) != BSLASH)
+
+#if defined(__AVX2__)
+
+static size_t
+plain_scan(const char *s, size_t len)
+{
+	const __m256i bslash = _mm256_set1_epi8(BSLASH);
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	size_t i = 0;
+	__m256i v;
+	unsigned int m;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+	/*
+	 * The top bit of V itself marks the bytes past ASCII.
+	 */
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(v, _mm256_cmpeq_epi8(v, bslash)),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v)));
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+
+	while (i < len && IS_PLAIN(s[i]))
+		++i;
+
+	return i;
+}
+
+#elif defined(__SSE2__)
+
+static size_t
+plain_scan(const char *s, size_t len)
+{
+	const __m128i bslash = _mm_set1_epi8(BSLASH);
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	size_t i = 0;
+	__m128i v;
+	unsigned int m;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(v, _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v)));
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+
+	while (i < len && IS_PLAIN(s[i]))
+		++i;
+
+	return i;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static size_t
+plain_scan(const char *s, size_t len)
+{
+	size_t i = 0;
+	uint8x16_t v;
+	uint8x16_t m;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = vld1q_u8((const uint8_t *)(s + i));
+		m = vorrq_u8(vorrq_u8(NEON_EQ(v, BSLASH), vcleq_u8(v, vdupq_n_u8(0x1f))),
+			vcgeq_u8(v, vdupq_n_u8(0x80)));
+
+		if (vmaxvq_u8(m))
+			break;
+	}
+
+	while (i < len && IS_PLAIN(s[i]))
+		++i;
+
+	return i;
+}
+
+#else
+
+static size_t
+plain_scan(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && IS_PLAIN(s[i]))
+		++i;
+
+	return i;
+}
+
+#endif
+
+/*
+ * Length of the UTF-8 sequence at S, or 0 if it runs past
+ * E or is not one RFC 3629 allows: overlong forms, UTF-16
+ * surrogates and anything past U+10FFFF are all refused.
+ */
+static int
+utf8_length(const unsigned char *s, const unsigned char *e)
+{
+	unsigned int lo = 0x80;
+	unsigned int hi = 0xbf;
+	int n;
+	int i;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+	{
+		n = 2;
+	}
+	else
+	if (s[0] >= 0xe0 && s[0] <= 0xef)
+	{
+		n = 3;
+		if (0xe0 == s[0])
+			lo = 0xa0;
+		else
+		if (0xed == s[0])
+			hi = 0x9f;
+	}
+	else
+	if (s[0] >= 0xf0 && s[0] <= 0xf4)
+	{
+		n = 4;
+		if (0xf0 == s[0])
+			lo = 0x90;
+		else
+		if (0xf4 == s[0])
+			hi = 0x8f;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if (e - s < n || s[1] < lo || s[1] > hi)
+		return 0;
+
+	for (i = 2; i < n; ++i)
+	{
+		if (0x80 != (s[i] & 0xc0))
+			return 0;
+	}
+
+	return n;
+}
+
+static int
+check_string(json_parser_t *ctx, const char *s, size_t len)
+{
+	const char *e = s + len;
+	int n;
+
+	for (;;)
+	{
+		s += plain_scan(s, e - s);
+		if (s == e)
+			return PARSE_OK;
+
+		if (BSLASH == *s)
+		{
+			if (e - s < 2)
+				return parse_fail(ctx, JSON_ERR_STRING, s);
+
+			switch(s[1])
+			{
+				case '"': case '\\': case '/':
+				case 'b': case 'f': case 'n': case 'r': case 't':
+					s += 2;
+					continue;
+
+				case 'u':
+					if (parse_hex4(s + 2, e) < 0)
+						return parse_fail(ctx, JSON_ERR_STRING, s);
+
+					s += 6;
+					continue;
+
+				default:
+					return parse_fail(ctx, JSON_ERR_STRING, s);
+			}
+		}
+
+		if ((unsigned char)*s < 0x20)
+			return parse_fail(ctx, JSON_ERR_STRING, s);
+
+		n = utf8_length((const unsigned char *)s, (const unsigned char *)e);
+		if (0 == n)
+			return parse_fail(ctx, JSON_ERR_UTF8, s);
+
+		s += n;
+	}
+}
+
+/*
+ * FNV-1a, for member names. Never 0, which means "not hashed yet".
+ */
+static unsigned int
+hash_name(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h ? h : 1;
+}
+
+/**
+ * Turn the span of a string in the input into what we store
+ * in the document. With JSON_OPT_ZERO_COPY that's the span
+ * itself, escapes and all, and *FLAGP records whether it
+ * still needs decoding. With JSON_OPT_IN_PLACE it is decoded
+ * where it lies and terminated over the closing quote, or
+ * short of it; the lexer is past both by now. Otherwise it
+ * is decoded into a NUL-terminated copy in the arena.
+ */
+static char *
+store_string(json_parser_t *ctx, const char *s, size_t len, int escaped, size_t *lenp, int *flagp, int flag)
+{
+	char *p;
+
+	if (ctx->flags & JSON_OPT_IN_PLACE)
+	{
+		p = (char *)s;
+		if (escaped)
+			len = unescape(p, s, len);
+
+		p[len] = 0;
+		*lenp = len;
+
+		return p;
+	}
+
+	if (ctx->flags & JSON_OPT_ZERO_COPY)
+	{
+		*lenp = len;
+		if (escaped)
+			*flagp |= flag;
+
+		return (char *)s;
+	}
+
+	p = arena_alloc(ARENA(), len + 1);
+	if (NULL == p)
+		return NULL;
+
+	if (escaped)
+		len = unescape(p, s, len);
+	else
+		memcpy(p, s, len);
+
+	p[len] = 0;
+	*lenp = len;
+
+	return p;
+}
+
+/*
+ * Interned names. The table is open-addressed and keeps
+ * each name's hash alongside it, so a name that's already
+ * there costs a probe and no allocation. A document's own
+ * table is carved out of the document's arena; a shared one
+ * has an arena of its own that lives until JSON_intern_free().
+ */
+typedef struct JSON_Intern_Entry
+{
+	const char *s;
+	size_t len;
+	unsigned int hash;
+} json_intern_entry_t;
+
+struct JSON_Intern
+{
+	json_arena_t *arena;
+	json_arena_t own;
+	json_intern_entry_t *slots;
+	size_t size;
+	size_t nr;
+};
+
+#define INTERN_SIZE_MIN 64
+
+static json_intern_t *
+intern_new(json_arena_t *arena)
+{
+	json_intern_t *t = arena_calloc(arena, sizeof(json_intern_t));
+
+	if (NULL == t)
+		return NULL;
+
+	t->arena = arena;
+
+	return t;
+}
+
+static int
+intern_grow(json_intern_t *t)
+{
+	json_intern_entry_t *slots;
+	size_t size = t->size ? t->size * 2 : INTERN_SIZE_MIN;
+	size_t i;
+	size_t slot;
+
+	slots = arena_calloc(t->arena, size * sizeof(json_intern_entry_t));
+	if (NULL == slots)
+		return -1;
+
+	for (i = 0; i < t->size; ++i)
+	{
+		if (NULL == t->slots[i].s)
+			continue;
+
+		for (slot = t->slots[i].hash & (size - 1); slots[slot].s; slot = (slot + 1) & (size - 1))
+			;
+
+		slots[slot] = t->slots[i];
+	}
+
+	t->slots = slots;
+	t->size = size;
+
+	return 0;
+}
+
+/*
+ * The stored copy of the LEN bytes at S, whose hash is H,
+ * adding it if it isn't there yet.
+ */
+static const char *
+intern(json_intern_t *t, const char *s, size_t len, unsigned int h)
+{
+	json_intern_entry_t *e;
+	size_t slot;
+	char *p;
+
+	if (2 * (t->nr + 1) > t->size && intern_grow(t) < 0)
+		return NULL;
+
+	for (slot = h & (t->size - 1); t->slots[slot].s; slot = (slot + 1) & (t->size - 1))
+	{
+		e = &t->slots[slot];
+
+		if (e->hash == h && e->len == len && !memcmp(e->s, s, len))
+			return e->s;
+	}
+
+	p = arena_strndup(t->arena, s, len);
+	if (NULL == p)
+		return NULL;
+
+	e = &t->slots[slot];
+	e->s = p;
+	e->len = len;
+	e->hash = h;
+	++t->nr;
+
+	return p;
+}
+
+/**
+ * A table of names that can be shared by any number of
+ * documents, one parse at a time. It must outlive all of
+ * the documents whose names are in it.
+ */
+json_intern_t *
+JSON_intern_new(void)
+{
+	json_intern_t *t = malloc(sizeof(json_intern_t));
+
+	if (NULL == t)
+		return NULL;
+
+	memset(t, 0, sizeof(*t));
+	t->arena = &t->own;
+
+	return t;
+}
+
+void
+JSON_intern_free(json_intern_t *tab)
+{
+	assert(tab);
+	assert(tab->arena == &tab->own);
+
+	arena_release(&tab->own);
+	free(tab);
+
+	return;
+}
+
+/**
+ * The copy of the LEN bytes at S in TAB, so that a name can be
+ * compared with those in a document by pointer alone. S is
+ * added to the table if it isn't there yet.
+ */
+const char *
+JSON_intern(json_intern_t *tab, const char *s, size_t len)
+{
+	assert(tab);
+	assert(s);
+
+	return intern(tab, s, len, hash_name(s, len));
+}
+
+/*
+ * Decode if need be and look the name up in the document's
+ * table. Interned names are always decoded and terminated.
+ */
+static int
+intern_name(json_parser_t *ctx, json_value_t *v, const char *s, size_t len, int escaped)
+{
+	char tmp[256];
+	char *d = tmp;
+	unsigned int h;
+
+	if (escaped)
+	{
+		if (len > sizeof(tmp))
+		{
+			d = mem_alloc(&ctx->mem, len);
+			if (NULL == d)
+				return -1;
+		}
+
+		len = unescape(d, s, len);
+		s = d;
+	}
+
+	h = hash_name(s, len);
+	v->name = (char *)intern(ctx->doc->keys, s, len, h);
+	v->name_len = len;
+	v->name_hash = h;
+
+	if (d != tmp)
+		mem_free(&ctx->mem, d);
+
+	return NULL == v->name ? -1 : 0;
+}
+
+static int
+set_string(json_parser_t *ctx, json_value_t *v, const char *s, size_t len, int escaped)
+{
+	STAT_SAMPLED(ctx, t);
+
+	v->value.u_string = store_string(ctx, s, len, escaped,
+		&v->len, &v->flags, JSON_F_STRING_ESCAPED);
+	v->type = VALUE_STRING;
+
+	STAT_TIME_IN(&ctx->stats, JSON_PHASE_STRING, JSON_PHASE_BUILD, t);
+
+	return NULL == v->value.u_string ? -1 : 0;
+}
+
+static int
+set_name(json_parser_t *ctx, json_value_t *v, const char *s, size_t len, int escaped)
+{
+	int r = 0;
+	STAT_SAMPLED(ctx, t);
+
+	if (NULL != ctx->doc->keys)
+		r = intern_name(ctx, v, s, len, escaped);
+	else
+	{
+		v->name = store_string(ctx, s, len, escaped,
+			&v->name_len, &v->flags, JSON_F_NAME_ESCAPED);
+
+		if (NULL == v->name)
+			r = -1;
+		else
+		if (!(v->flags & JSON_F_NAME_ESCAPED))
+			v->name_hash = hash_name(v->name, v->name_len);
+	}
+
+	STAT_TIME_IN(&ctx->stats, JSON_PHASE_STRING, JSON_PHASE_BUILD, t);
+
+	return r;
+}
+
+/*
+ * true, false and null. Leaves the span in charseq.
+ */
+static int
+parse_string_nodquotes(json_parser_t *ctx)
+{
+	const char *s = ctx->ptr;
+
+	while (ctx->ptr < ctx->end && !IS_DELIM(*ctx->ptr))
+		++ctx->ptr;
+
+	if (ctx->ptr == ctx->end && !ctx->final)
+		return PARSE_MORE;
+
+	ctx->charseq = s;
+	ctx->charseq_len = ctx->ptr - s;
+	ctx->charseq_escaped = 0;
+
+	return PARSE_OK;
+}
+
+#define CHARSEQ_IS(lit) \
+	(ctx->charseq_len == sizeof(lit) - 1 && !memcmp(ctx->charseq, (lit), sizeof(lit) - 1))
+
+/*
+ * Powers of ten that are exact as doubles.
+ */
+static const double pow10_exact[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define POW10_EXACT_MAX 22
+#define MANTISSA_EXACT_MAX (1ULL << 53)
+
+/*
+ * Accumulate the digits at *PP onto *M, noting in *OVERFLOW
+ * if they don't all fit; with no M they are only counted.
+ * Returns the number of digits.
+ */
+static int
+parse_digits(const char **pp, const char *e, unsigned long long *m, int *overflow)
+{
+	const char *p = *pp;
+	unsigned int d;
+
+	if (NULL == m)
+	{
+		while (p < e && isdigit((unsigned char)*p))
+			++p;
+	}
+	else
+	while (p < e && (d = (unsigned char)*p - '0') < 10)
+	{
+		if (*m > (ULLONG_MAX - d) / 10)
+			*overflow = 1;
+		else
+			*m = *m * 10 + d;
+
+		++p;
+	}
+
+	d = p - *pp;
+	*pp = p;
+
+	return d;
+}
+
+/*
+ * JSON's numbers are the C locale's whatever LC_NUMERIC the
+ * program has set, so strtod() and snprintf() are only ever
+ * called with this thread switched over to it. The switch is
+ * uselocale()'s, for this thread alone, and if the C locale
+ * can't be had we carry on in the program's.
+ */
+static pthread_once_t c_numeric_once = PTHREAD_ONCE_INIT;
+static locale_t c_numeric;
+
+static void
+c_numeric_init(void)
+{
+	c_numeric = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+static locale_t
+numeric_begin(void)
+{
+	pthread_once(&c_numeric_once, c_numeric_init);
+
+	return (locale_t)0 != c_numeric ? uselocale(c_numeric) : (locale_t)0;
+}
+
+static void
+numeric_end(locale_t old)
+{
+	if ((locale_t)0 != old)
+		uselocale(old);
+}
+
+static double
+c_strtod(const char *s)
+{
+	locale_t old = numeric_begin();
+	double d = strtod(s, NULL);
+
+	numeric_end(old);
+
+	return d;
+}
+
+/*
+ * No double needs more than 768 significant digits to be
+ * rounded right, as long as it is known whether there were
+ * any others that weren't 0.
+ */
+#define NUM_DIGITS_MAX 780
+
+/*
+ * The valid number of LEN bytes at S written out again at D,
+ * terminated, in at most NUM_DIGITS_MAX + 16 bytes: the first
+ * NUM_DIGITS_MAX significant digits, then a 1 if any of those
+ * dropped wasn't 0, and an exponent that makes up for the
+ * point and for what was dropped. It reads as the same double.
+ */
+static char *
+number_shorten(char *d, const char *s, size_t len)
+{
+	const char *e = s + len;
+	char *q = d;
+	long long exp10 = 0;
+	long long x = 0;
+	size_t kept = 0;
+	int point = 0;
+	int sticky = 0;
+	int seen = 0;
+
+	if (MINUS == *s)
+		*q++ = *s++;
+
+	for (; s < e && (isdigit((unsigned char)*s) || ('.' == *s && !point)); ++s)
+	{
+		if ('.' == *s)
+		{
+			point = 1;
+			continue;
+		}
+
+		if (!seen && '0' == *s)
+		{
+			exp10 -= point;
+			continue;
+		}
+
+		seen = 1;
+
+		if (kept < NUM_DIGITS_MAX)
+		{
+			*q++ = *s;
+			++kept;
+			exp10 -= point;
+		}
+		else
+		{
+			sticky |= '0' != *s;
+			exp10 += !point;
+		}
+	}
+
+	if (!seen)
+	{
+		strcpy(q, "0");
+		return d;
+	}
+
+	if (sticky)
+	{
+		*q++ = '1';
+		--exp10;
+	}
+
+	if (s < e && ('e' == *s || 'E' == *s))
+	{
+		int neg = MINUS == *++s;
+
+		if ('+' == *s || MINUS == *s)
+			++s;
+
+		for (; s < e && isdigit((unsigned char)*s); ++s)
+		{
+			if (x < 1000000000000000LL)
+				x = x * 10 + (*s - '0');
+		}
+
+		exp10 += neg ? -x : x;
+	}
+
+/*
+ * Far enough either way to be infinite or 0 whatever
+ * the digits are.
+ */
+	if (exp10 > 999999)
+		exp10 = 999999;
+	else
+	if (exp10 < -999999)
+		exp10 = -999999;
+
+	sprintf(q, "e%lld", exp10);
+
+	return d;
+}
+
+/*
+ * The slow but always right way, for whatever the fast path
+ * can't do exactly. The LEN bytes at S have been checked to
+ * be a valid number; unless they run right up to E they are
+ * followed by a delimiter and strtod() can read them in place.
+ * Otherwise they are copied out, shortened if they have to be,
+ * so that however long a number the input holds nothing is
+ * allocated for it.
+ */
+static double
+slow_double(const char *s, size_t len, const char *e)
+{
+	char tmp[NUM_DIGITS_MAX + 16];
+
+	if (s + len < e)
+		return c_strtod(s);
+
+	if (len >= sizeof(tmp))
+		return c_strtod(number_shorten(tmp, s, len));
+
+	memcpy(tmp, s, len);
+	tmp[len] = 0;
+
+	return c_strtod(tmp);
+}
+
+/*
+ * Numbers are read straight out of the input. Integers are
+ * exact up to 64 bits. A double whose digits fit in 53 bits
+ * and whose exponent is small enough for the power of ten
+ * to be exact is one correctly rounded multiply or divide;
+ * anything else goes to strtod().
+ *
+ * Without CONVERT only the syntax is checked and NUM gets
+ * JSON_F_NUMBER_RAW and the type the text calls for. *ENDP
+ * is left where we stopped, even if it went wrong, so the
+ * caller can tell a bad number from one cut off at E.
+ */
+static int
+read_number(const char *s, const char *e, int convert, json_number_t *num, const char **endp)
+{
+	const char *p = s;
+	unsigned long long m = 0;
+	unsigned long long x = 0;
+	unsigned long long *mp = convert ? &m : NULL;
+	unsigned long long *xp = convert ? &x : NULL;
+	int overflow = 0;
+	int exp_overflow = 0;
+	int is_double = 0;
+	int neg = 0;
+	int exp_neg = 0;
+	long exp10 = 0;
+	int n;
+
+	if (p < e && *p == MINUS)
+	{
+		neg = 1;
+		++p;
+	}
+
+	if (0 == parse_digits(&p, e, mp, &overflow))
+		goto fail;
+
+	if (p < e && '.' == *p)
+	{
+		is_double = 1;
+		++p;
+
+		if (0 == (n = parse_digits(&p, e, mp, &overflow)))
+			goto fail;
+
+	/*
+	 * Only right if nothing overflowed, but
+	 * then strtod() will be doing it anyway.
+	 */
+		exp10 = -(long)n;
+	}
+
+	if (p < e && ('e' == *p || 'E' == *p))
+	{
+		is_double = 1;
+		++p;
+
+		if (p < e && ('-' == *p || '+' == *p))
+			exp_neg = '-' == *p++;
+
+		if (0 == parse_digits(&p, e, xp, &exp_overflow))
+			goto fail;
+
+		if (exp_overflow || x > 100000)
+			x = 100000;
+
+		exp10 += exp_neg ? -(long)x : (long)x;
+	}
+
+	*endp = p;
+	num->flags = 0;
+
+	if (!convert)
+	{
+		num->type = is_double ? VALUE_DOUBLE : VALUE_NUMBER;
+		num->flags = JSON_F_NUMBER_RAW;
+
+		return 0;
+	}
+
+	if (!is_double && !overflow)
+	{
+		num->type = VALUE_NUMBER;
+
+		if (neg && m <= (unsigned long long)LLONG_MAX + 1)
+		{
+			num->u.i = m == (unsigned long long)LLONG_MAX + 1 ? LLONG_MIN : -(long long)m;
+			return 0;
+		}
+
+		if (!neg)
+		{
+			if (m <= LLONG_MAX)
+				num->u.i = m;
+			else
+			{
+				num->u.u = m;
+				num->flags = JSON_F_UNSIGNED;
+			}
+
+			return 0;
+		}
+	}
+
+	num->type = VALUE_DOUBLE;
+
+	if (!overflow && m <= MANTISSA_EXACT_MAX
+	&& exp10 >= -POW10_EXACT_MAX && exp10 <= POW10_EXACT_MAX)
+	{
+		double d = (double)m;
+
+		d = exp10 < 0 ? d / pow10_exact[-exp10] : d * pow10_exact[exp10];
+		num->u.d = neg ? -d : d;
+
+		return 0;
+	}
+
+	num->u.d = slow_double(s, p - s, e);
+
+	return 0;
+
+fail:
+	*endp = p;
+	return -1;
+}
+
+/*
+ * Leaves the span of the number in charseq as well.
+ * With JSON_OPT_LAZY_NUMBERS that is all there is.
+ */
+static int
+parse_number(json_parser_t *ctx, json_number_t *num)
+{
+	const char *p;
+	int r;
+	STAT_SAMPLED(ctx, t);
+
+	r = read_number(ctx->ptr, ctx->end, !(ctx->flags & JSON_OPT_LAZY_NUMBERS), num, &p);
+	STAT_TIME(&ctx->stats, JSON_PHASE_NUMBER, t);
+
+	if (p == ctx->end && !ctx->final)
+		return PARSE_MORE;
+
+	if (r < 0 || (p < ctx->end && !IS_DELIM(*p)))
+		return parse_fail(ctx, JSON_ERR_NUMBER, p);
+
+/*
+ * read_number() will take 007 as 7; strictly, it isn't JSON.
+ */
+	if (ctx->flags & JSON_OPT_STRICT)
+	{
+		const char *d = ctx->ptr + (MINUS == *ctx->ptr);
+
+		if ('0' == d[0] && d + 1 < p && isdigit((unsigned char)d[1]))
+			return parse_fail(ctx, JSON_ERR_NUMBER, d);
+	}
+
+	ctx->charseq = ctx->ptr;
+	ctx->charseq_len = p - ctx->ptr;
+	ctx->charseq_escaped = 0;
+	ctx->ptr = p;
+
+	return PARSE_OK;
+}
+
+/*
+ * Containers double their capacity when they fill up,
+ * so N elements cost O(N) copying all told.
+ */
+#define CAPACITY_MIN 4
+#define GROW_CAPACITY(c) ((c) < CAPACITY_MIN ? CAPACITY_MIN : (c) * 2)
+
+/**
+ * Create a new JSON node. The only times we need to create
+ * a node is for the root node and then for when a json value
+ * is itself another json object or array, e.g.,:
+ *
+ * "item" : { ... }
+ *
+ * An array's node holds its elements in order, with no names.
+ */
+static json_node_t *
+document_node(json_t *json)
+{
+	json_node_t *n = arena_calloc(&json->arena, sizeof(json_node_t));
+
+	if (NULL == n)
+		return NULL;
+
+	++json->nr_nodes;
+
+	return n;
+}
+
+static json_node_t *
+new_node(json_parser_t *ctx)
+{
+	return document_node(ctx->doc);
+}
+
+static json_value_t *
+new_value(json_parser_t *ctx)
+{
+	return arena_calloc(ARENA(), sizeof(json_value_t));
+}
+
+#define NVALS(n) ((n)->nr_values)
+#define NALLOC(n) ((n)->nr_alloc)
+#define VALUES(n) ((n)->values)
+#define VALUE(n,i) ((n)->values[(i)])
+#define LAST_VALUE(n) VALUE(n, NVALS(n)-1)
+#define FIRST_VALUE(n) VALUE(n,0)
+
+#define VALUE_CAST(v, t) (*(t *)&(v)->value)
+
+static int
+node_reserve(json_arena_t *arena, json_node_t *n, int nr)
+{
+	json_value_t **v;
+
+	if (nr <= NALLOC(n))
+		return 0;
+
+	v = arena_realloc(arena, VALUES(n),
+		NALLOC(n) * sizeof(json_value_t *),
+		nr * sizeof(json_value_t *));
+
+	if (NULL == v)
+		return -1;
+
+	VALUES(n) = v;
+	NALLOC(n) = nr;
+
+	return 0;
+}
+
+/**
+ * Make room for at least NR values in NODE so that adding
+ * them doesn't need to grow the value array again.
+ */
+int
+JSON_node_reserve(json_t *json, json_node_t *node, int nr)
+{
+	assert(json);
+	assert(node);
+
+	return node_reserve(&json->arena, node, nr);
+}
+
+/**
+ * Add a new pointer to json_value_t to the array of value pointers
+ * in the parent node (holds a json_value_t ** array).
+ */
+static int
+add_value(json_parser_t *ctx, json_node_t *parent, json_value_t *value)
+{
+	assert(parent);
+	assert(value);
+
+	if (NVALS(parent) == NALLOC(parent))
+	{
+		STAT_ADD(&ctx->stats, nr_reallocs, NALLOC(parent) > 0);
+
+		if (node_reserve(ARENA(), parent, GROW_CAPACITY(NALLOC(parent))) < 0)
+			return -1;
+	}
+
+	VALUE(parent, NVALS(parent)) = value;
+	++NVALS(parent);
+
+	return 0;
+}
+
+/*
+ * The document itself comes from MEM too, and its arena
+ * keeps a copy of MEM for everything after.
+ */
+static json_t *
+JSON_new(const json_allocator_t *mem)
+{
+	json_t *jn = mem_alloc(mem, sizeof(json_t));
+
+	if (NULL == jn)
+		return NULL;
+
+	memset(jn, 0, sizeof(*jn));
+	jn->arena.mem = *mem;
+
+	return jn;
+}
+
+/*
+ * Member lookup. Objects of up to INDEX_LINEAR_MAX members
+ * are simply scanned; anything wider gets a hash index the
+ * first time it is searched, or as soon as it is parsed if
+ * it has at least INDEX_EAGER_MIN members. The index lives
+ * in the document's arena like everything else.
+ */
+#define INDEX_LINEAR_MAX 8
+#define INDEX_EAGER_MIN 64
+
+/*
+ * Names left escaped by zero-copy parsing are hashed
+ * once they have been decoded.
+ */
+static unsigned int
+value_name_hash(json_t *json, json_value_t *v)
+{
+	const char *name;
+	size_t len;
+
+	if (0 == v->name_hash)
+	{
+		name = JSON_name(json, v, &len);
+		assert(name);
+
+		v->name_hash = hash_name(name, len);
+	}
+
+	return v->name_hash;
+}
+
+#define SAME_NAME(v, h, k, l) \
+	((v)->name_len == (l) \
+	&& ((v)->name == (k) || ((v)->name_hash == (h) && !memcmp((v)->name, (k), (l)))))
+
+/*
+ * Add the I'th value of N. With duplicate names the first
+ * one is the one that is found, so a value put in before
+ * one already indexed takes its slot.
+ */
+static void
+index_insert(json_t *json, json_node_t *n, int i)
+{
+	json_value_t *v = VALUE(n, i);
+	unsigned int h = value_name_hash(json, v);
+	unsigned int mask = n->index_size - 1;
+	unsigned int slot;
+
+	for (slot = h & mask; n->index[slot]; slot = (slot + 1) & mask)
+	{
+		if (SAME_NAME(VALUE(n, n->index[slot] - 1), h, v->name, v->name_len))
+		{
+			if (n->index[slot] > i + 1)
+				n->index[slot] = i + 1;
+
+			return;
+		}
+	}
+
+	n->index[slot] = i + 1;
+}
+
+/*
+ * Bring the index of N up to date with its values, building
+ * it afresh if there is none yet or it would be over half full.
+ */
+static int
+node_index(json_t *json, json_node_t *n)
+{
+	int size;
+	int i;
+
+	if (n->nr_indexed == NVALS(n) && NULL != n->index)
+		return 0;
+
+	if (NULL == n->index || NVALS(n) * 2 > n->index_size)
+	{
+		for (size = CAPACITY_MIN; size < NVALS(n) * 2; size *= 2)
+			;
+
+		n->index = arena_calloc(&json->arena, size * sizeof(int));
+		if (NULL == n->index)
+			return -1;
+
+		n->index_size = size;
+		n->nr_indexed = 0;
+	}
+
+	for (i = n->nr_indexed; i < NVALS(n); ++i)
+		index_insert(json, n, i);
+
+	n->nr_indexed = NVALS(n);
+
+	return 0;
+}
+
+/*
+ * The position in NODE of the member called KEY, whose hash
+ * H may already be known or is 0 if it isn't; -1 if there
+ * is no such member.
+ */
+static int
+node_find(json_t *json, json_node_t *node, const char *key, size_t len, unsigned int h)
+{
+	json_value_t *v;
+	const char *name;
+	unsigned int mask;
+	unsigned int slot;
+	size_t n;
+	int i;
+
+/*
+ * An array: its elements have no names to look up.
+ */
+	if (NVALS(node) > 0 && NULL == FIRST_VALUE(node)->name)
+		return -1;
+
+	if (NVALS(node) <= INDEX_LINEAR_MAX || node_index(json, node) < 0)
+	{
+		for (i = 0; i < NVALS(node); ++i)
+		{
+			v = VALUE(node, i);
+			name = JSON_name(json, v, &n);
+
+			if (n == len && NULL != name && !memcmp(name, key, len))
+				return i;
+		}
+
+		return -1;
+	}
+
+	if (0 == h)
+		h = hash_name(key, len);
+
+	mask = node->index_size - 1;
+
+	for (slot = h & mask; node->index[slot]; slot = (slot + 1) & mask)
+	{
+		v = VALUE(node, node->index[slot] - 1);
+
+		if (SAME_NAME(v, h, key, len))
+			return node->index[slot] - 1;
+	}
+
+	return -1;
+}
+
+/*
+ * JSON_get(), likewise.
+ */
+static json_value_t *
+node_get(json_t *json, json_node_t *node, const char *key, size_t len, unsigned int h)
+{
+	int i = node_find(json, node, key, len, h);
+
+	return i < 0 ? NULL : VALUE(node, i);
+}
+
+/**
+ * Find the member of NODE called KEY, which is LEN bytes long
+ * and has no escape sequences in it. Returns %NULL if there is
+ * no such member. Wide objects are indexed on first use, so
+ * the first lookup costs a pass over the members and the rest
+ * are a hash probe; this needs JSON, the document NODE is in.
+ */
+json_value_t *
+JSON_get(json_t *json, json_node_t *node, const char *key, size_t len)
+{
+	assert(json);
+	assert(node);
+	assert(key);
+
+	return node_get(json, node, key, len, 0);
+}
+
+/**
+ * The number of elements in the array V.
+ */
+int
+JSON_array_length(json_value_t *v)
+{
+	assert(v);
+	assert(VALUE_ARRAY == v->type);
+
+	return NVALS(v->value.u_array);
+}
+
+/**
+ * Element I of the array V, or %NULL if it hasn't that many.
+ */
+json_value_t *
+JSON_array_get(json_value_t *v, int i)
+{
+	assert(v);
+	assert(VALUE_ARRAY == v->type);
+
+	if (i < 0 || i >= NVALS(v->value.u_array))
+		return NULL;
+
+	return VALUE(v->value.u_array, i);
+}
+
+/**
+ * Fill in ST with what JSON is costing now, the json_t
+ * itself included. Cheap enough to call on every document:
+ * it is only a walk of the arena's chunks.
+ */
+void
+JSON_mem_stats(json_t *json, json_mem_stats_t *st)
+{
+	json_chunk_t *c;
+
+	assert(json);
+	assert(st);
+
+	st->bytes = sizeof(json_t) + json->arena.bytes;
+	st->nr_allocs = 1 + json->arena.nr_allocs;
+	st->used = sizeof(json_t);
+
+	for (c = json->arena.head; NULL != c; c = c->next)
+		st->used += c->used;
+
+	return;
+}
+
+/**
+ * Every node, value, name and string in the document lives
+ * in the document's arena, so tearing it down is one free
+ * per arena chunk and no walk of the tree at all.
+ */
+void
+JSON_free(json_t *json)
+{
+	json_allocator_t mem;
+
+	assert(json);
+
+	mem = json->arena.mem;
+	arena_release(&json->arena);
+
+	if (NULL != json->map)
+		munmap(json->map, json->map_len);
+
+	if (NULL != json->buf)
+		free(json->buf);
+
+	mem_free(&mem, json);
+
+	return;
+}
+
+/*
+ * Building the tree. These are the handler the grammar
+ * below drives for JSON_parse() and friends; USER is the
+ * parser context itself. Nothing is added to the document
+ * until the whole token has been seen.
+ */
+
+/*
+ * Where the next value goes: the member whose name we have
+ * just seen, or a fresh element if we are in an array.
+ */
+static json_value_t *
+tree_slot(json_parser_t *ctx)
+{
+	if (!IN_OBJECT(ctx))
+		ctx->value = new_value(ctx);
+
+	return ctx->value;
+}
+
+/*
+ * The handlers give up with -1 whenever the arena does,
+ * which ends the parse and frees the document.
+ */
+static int
+tree_commit(json_parser_t *ctx)
+{
+	return add_value(ctx, ctx->parent, ctx->value);
+}
+
+/*
+ * Objects and arrays alike are a node of their own, hung
+ * off the value that holds them. The top-level container
+ * is the root node, which is already there.
+ */
+static int
+tree_begin(json_parser_t *ctx, int type)
+{
+	json_value_t *v;
+
+	if (0 == ctx->depth)
+	{
+		ctx->doc->type = type;
+		return 0;
+	}
+
+	v = tree_slot(ctx);
+	if (NULL == v)
+		return -1;
+
+	ctx->node = new_node(ctx);
+	if (NULL == ctx->node)
+		return -1;
+
+	if (VALUE_ARRAY == type)
+		v->value.u_array = ctx->node;
+	else
+		v->value.u_object = ctx->node;
+
+	v->type = type;
+
+	if (tree_commit(ctx) < 0)
+		return -1;
+
+/*
+ * The values we will be parsing after this will belong
+ * to the newly-created node. So keep the parent in the
+ * node's frame and then the new node becomes the parent.
+ */
+	ctx->frames[ctx->depth].parent = ctx->parent;
+	ctx->parent = ctx->node;
+
+	return 0;
+}
+
+static void
+tree_end(json_parser_t *ctx)
+{
+	if (ctx->depth > 1)
+		ctx->parent = ctx->frames[ctx->depth-1].parent;
+}
+
+static int
+tree_object_begin(void *user)
+{
+	return tree_begin(user, VALUE_OBJECT);
+}
+
+static int
+tree_object_end(void *user)
+{
+	json_parser_t *ctx = user;
+
+	if (NVALS(ctx->parent) >= INDEX_EAGER_MIN
+	&& node_index(ctx->doc, ctx->parent) < 0)
+		return -1;
+
+	tree_end(ctx);
+
+	return 0;
+}
+
+static int
+tree_array_begin(void *user)
+{
+	return tree_begin(user, VALUE_ARRAY);
+}
+
+static int
+tree_array_end(void *user)
+{
+	tree_end(user);
+	return 0;
+}
+
+static int
+tree_key(void *user, const char *s, size_t len, int escaped)
+{
+	json_parser_t *ctx = user;
+
+	ctx->value = new_value(ctx);
+	if (NULL == ctx->value || set_name(ctx, ctx->value, s, len, escaped) < 0)
+		return -1;
+
+	Debug("Got name %.*s\n", (int)ctx->value->name_len, ctx->value->name);
+
+	return 0;
+}
+
+static int
+tree_string(void *user, const char *s, size_t len, int escaped)
+{
+	json_parser_t *ctx = user;
+	json_value_t *v = tree_slot(ctx);
+
+	if (NULL == v || set_string(ctx, v, s, len, escaped) < 0)
+		return -1;
+
+	Debug("Got value %.*s\n", (int)v->len, VALUE_CAST(v, char *));
+
+	return tree_commit(ctx);
+}
+
+static int
+tree_number(void *user, const char *s, size_t len, const json_number_t *num)
+{
+	json_parser_t *ctx = user;
+	json_value_t *v = tree_slot(ctx);
+
+	if (NULL == v)
+		return -1;
+
+	v->type = num->type;
+	v->flags |= num->flags;
+
+	if (num->flags & JSON_F_NUMBER_RAW)
+	{
+	/*
+	 * In place, the text can't be terminated: the byte
+	 * after it is the next token. It stays a view.
+	 */
+		if (ctx->flags & JSON_OPT_IN_PLACE)
+		{
+			v->value.u_string = (char *)s;
+			v->len = len;
+		}
+		else
+		{
+			v->value.u_string = store_string(ctx, s, len, 0, &v->len, &v->flags, 0);
+			if (NULL == v->value.u_string)
+				return -1;
+		}
+	}
+	else
+	if (VALUE_DOUBLE == num->type)
+		v->value.u_double = num->u.d;
+	else
+		v->value.u_ulong = num->u.u;
+
+	Debug("Got value %.*s\n", (int)len, s);
+
+	return tree_commit(ctx);
+}
+
+static int
+tree_bool(void *user, int b)
+{
+	json_parser_t *ctx = user;
+	json_value_t *v = tree_slot(ctx);
+
+	if (NULL == v)
+		return -1;
+
+	v->value.u_boolean = b ? TRUE : FALSE;
+	v->type = VALUE_BOOLEAN;
+
+	return tree_commit(ctx);
+}
+
+static int
+tree_null(void *user)
+{
+	json_parser_t *ctx = user;
+	json_value_t *v = tree_slot(ctx);
+
+	if (NULL == v)
+		return -1;
+
+	v->value.u_string = NULL;
+	v->type = VALUE_NULL;
+
+	return tree_commit(ctx);
+}
+
+static const json_handler_t tree_handler =
+{
+	.on_object_begin = tree_object_begin,
+	.on_object_end = tree_object_end,
+	.on_array_begin = tree_array_begin,
+	.on_array_end = tree_array_end,
+	.on_key = tree_key,
+	.on_string = tree_string,
+	.on_number = tree_number,
+	.on_bool = tree_bool,
+	.on_null = tree_null
+};
+
+/*
+ * The grammar. Each token is checked against where we are
+ * and handed on as an event to CTX->HANDLER; the tree and
+ * tape builders are handlers like any other. Commas and
+ * colons are taken as read, as they always have been: an
+ * object simply alternates between keys and values.
+ */
+/*
+ * Call the handler's EV if it has one. Anything
+ * other than 0 back from it stops the parse.
+ */
+#define EMIT_CALL(ev, ...) \
+	(NULL == ctx->handler->ev || 0 == ctx->handler->ev(ctx->user, ##__VA_ARGS__) \
+	? PARSE_OK : PARSE_ABORT)
+
+/*
+ * The time spent in the handler is the document being
+ * built, or whatever it is the caller's handler does.
+ */
+#ifdef JSON_STATS
+# define EMIT(ev, ...) \
+	({ \
+		STAT_SAMPLED(ctx, t_); \
+		int r_ = EMIT_CALL(ev, ##__VA_ARGS__); \
+		STAT_TIME(&ctx->stats, JSON_PHASE_BUILD, t_); \
+		r_; \
+	})
+#else
+# define EMIT(ev, ...) EMIT_CALL(ev, ##__VA_ARGS__)
+#endif
+
+/*
+ * A value is complete: an object wants its next key, and
+ * the end of the outermost container ends the document.
+ */
+static void
+value_done(json_parser_t *ctx)
+{
+	if (0 == ctx->depth)
+		ctx->done = 1;
+	else
+		ctx->want_key = IN_OBJECT(ctx);
+}
+
+/*
+ * Make room for the frames of twice as many levels,
+ * or as many as we're allowed if that's fewer.
+ */
+static int
+frames_grow(json_parser_t *ctx)
+{
+	json_frame_t *f;
+	int nr = ctx->nr_frames * 2;
+
+	if (nr > ctx->max_depth)
+		nr = ctx->max_depth;
+
+	if (ctx->frames == ctx->frames_inline)
+	{
+		f = mem_alloc(&ctx->mem, nr * sizeof(json_frame_t));
+		if (NULL == f)
+			return -1;
+
+		memcpy(f, ctx->frames, ctx->nr_frames * sizeof(json_frame_t));
+	}
+	else
+	{
+		f = mem_realloc(&ctx->mem, ctx->frames, nr * sizeof(json_frame_t));
+		if (NULL == f)
+			return -1;
+	}
+
+	ctx->frames = f;
+	ctx->nr_frames = nr;
+
+	return 0;
+}
+
+static int
+open_container(json_parser_t *ctx, int kind)
+{
+	int r;
+
+	if (ctx->want_key)
+		return PARSE_ERROR;
+
+	if (ctx->depth >= ctx->max_depth)
+		return parse_fail(ctx, JSON_ERR_DEPTH, ctx->tok);
+
+	if (ctx->depth == ctx->nr_frames)
+	{
+		if (frames_grow(ctx) < 0)
+			return PARSE_ERROR;
+
+		STAT_ADD(&ctx->stats, nr_reallocs, 1);
+	}
+
+	r = NEST_OBJECT == kind ? EMIT(on_object_begin) : EMIT(on_array_begin);
+	if (PARSE_OK != r)
+		return r;
+
+	ctx->frames[ctx->depth++].kind = kind;
+	ctx->want_key = NEST_OBJECT == kind;
+
+	STAT_ADD(&ctx->stats, nr_nodes, 1);
+	STAT_MAX(&ctx->stats, max_depth, ctx->depth);
+
+	return PARSE_OK;
+}
+
+static int
+close_container(json_parser_t *ctx, int kind)
+{
+	int r;
+
+	if (0 == ctx->depth || kind != ctx->frames[ctx->depth-1].kind)
+		return PARSE_ERROR;
+
+/*
+ * A name with no value after it.
+ */
+	if (NEST_OBJECT == kind && !ctx->want_key)
+		return PARSE_ERROR;
+
+	r = NEST_OBJECT == kind ? EMIT(on_object_end) : EMIT(on_array_end);
+	if (PARSE_OK != r)
+		return r;
+
+	--ctx->depth;
+	value_done(ctx);
+
+	return PARSE_OK;
+}
+
+/*
+ * Act on the token in LOOKAHEAD. No event is sent until the
+ * whole token has been seen, so on PARSE_MORE the same token
+ * can simply be tried again once the rest of it is here.
+ */
+static int
+parse_token(json_parser_t *ctx)
+{
+	json_number_t num;
+	int r;
+
+	switch(ctx->lookahead)
+	{
+		case TOK_LBRACE:
+
+			return open_container(ctx, NEST_OBJECT);
+
+		case TOK_LBRACK:
+
+			return open_container(ctx, NEST_ARRAY);
+
+		case TOK_RBRACE:
+
+			return close_container(ctx, NEST_OBJECT);
+
+		case TOK_RBRACK:
+
+			return close_container(ctx, NEST_ARRAY);
+
+		case TOK_COMMA:
+		case TOK_COLON:
+
+			if (0 == ctx->depth)
+				return PARSE_ERROR;
+
+			return PARSE_OK;
+
+	/*
+	 * RFC 8259 lets a document be a lone scalar, but the
+	 * tree and the tape are built from a root container,
+	 * so they don't take one; anything else does.
+	 */
+		case TOK_DQUOTE:
+
+			if (0 == ctx->depth && !ctx->scalar_root)
+				return PARSE_ERROR;
+
+			if (PARSE_OK != (r = parse_charseq(ctx)))
+				return r;
+
+			STAT_ADD(&ctx->stats, nr_strings, 1);
+			STAT_ADD(&ctx->stats, nr_escaped, ctx->charseq_escaped);
+
+			if (ctx->flags & JSON_OPT_STRICT)
+			{
+				STAT_SAMPLED(ctx, t);
+
+				r = check_string(ctx, ctx->charseq, ctx->charseq_len);
+				STAT_TIME(&ctx->stats, JSON_PHASE_STRING, t);
+
+				if (PARSE_OK != r)
+					return r;
+			}
+
+			if (ctx->want_key)
+			{
+				r = EMIT(on_key, ctx->charseq, ctx->charseq_len, ctx->charseq_escaped);
+				ctx->want_key = 0;
+
+				return r;
+			}
+
+			r = EMIT(on_string, ctx->charseq, ctx->charseq_len, ctx->charseq_escaped);
+
+			break;
+
+		case TOK_DIGIT:
+
+			if ((0 == ctx->depth && !ctx->scalar_root) || ctx->want_key)
+				return PARSE_ERROR;
+
+			if (PARSE_OK != (r = parse_number(ctx, &num)))
+				return r;
+
+			STAT_ADD(&ctx->stats, nr_numbers, 1);
+
+			r = EMIT(on_number, ctx->charseq, ctx->charseq_len, &num);
+
+			break;
+
+		case TOK_CHARSEQ:
+	/*
+	 * If we are about to parse a value and we didn't find a DQUOTE,
+	 * then it must be null, or true/false.
+	 */
+			if ((0 == ctx->depth && !ctx->scalar_root) || ctx->want_key)
+				return PARSE_ERROR;
+
+			if (PARSE_OK != (r = parse_string_nodquotes(ctx)))
+				return r;
+
+			if (CHARSEQ_IS("true"))
+				r = EMIT(on_bool, TRUE);
+			else
+			if (CHARSEQ_IS("false"))
+				r = EMIT(on_bool, FALSE);
+			else
+			if (CHARSEQ_IS("null"))
+				r = EMIT(on_null);
+			else
+				return PARSE_ERROR;
+
+			break;
+
+		default:
+
+			return PARSE_ERROR;
+	}
+
+	if (PARSE_OK == r)
+		value_done(ctx);
+
+	return r;
+}
+
+/*
+ * With JSON_OPT_STRICT, what each token leaves behind as
+ * far as separators go: an opening bracket, a key, a comma
+ * or colon, or the end of a value. A comma may only follow
+ * a value and a colon a key; a value (or key) may only
+ * follow a bracket, a comma or a colon; and a closing
+ * bracket can't follow a comma, so there are no trailing
+ * commas.
+ */
+enum
+{
+	SEP_OPEN = 0,
+	SEP_KEY,
+	SEP_NEXT,
+	SEP_VALUE
+};
+
+static int
+sep_allows(json_parser_t *ctx, int tok)
+{
+	switch(tok)
+	{
+		case TOK_COMMA:
+			return SEP_VALUE == ctx->sep;
+
+		case TOK_COLON:
+			return SEP_KEY == ctx->sep;
+
+		case TOK_RBRACE:
+		case TOK_RBRACK:
+			return SEP_OPEN == ctx->sep || SEP_VALUE == ctx->sep;
+
+		default:
+			return SEP_OPEN == ctx->sep || SEP_NEXT == ctx->sep;
+	}
+}
+
+static int
+sep_after(int tok, int key)
+{
+	switch(tok)
+	{
+		case TOK_LBRACE:
+		case TOK_LBRACK:
+			return SEP_OPEN;
+
+		case TOK_COMMA:
+		case TOK_COLON:
+			return SEP_NEXT;
+
+		case TOK_DQUOTE:
+			return key ? SEP_KEY : SEP_VALUE;
+
+		default:
+			return SEP_VALUE;
+	}
+}
+
+static int
+parse_step(json_parser_t *ctx)
+{
+	int tok = ctx->lookahead;
+	int key = ctx->want_key;
+	int r;
+
+	if (!(ctx->flags & JSON_OPT_STRICT))
+		return parse_token(ctx);
+
+	if (!sep_allows(ctx, tok))
+		return parse_fail(ctx, JSON_ERR_SYNTAX, ctx->tok);
+
+	r = parse_token(ctx);
+	if (PARSE_OK == r)
+		ctx->sep = sep_after(tok, key);
+
+	return r;
+}
+
+/*
+ * Feed the parser tokens until the input runs out (PARSE_OK),
+ * the document is complete (PARSE_DONE), a token is cut off
+ * at the end of a chunk (PARSE_MORE), the handler has had
+ * enough (PARSE_ABORT), or it goes wrong.
+ */
+static int
+parse_run(json_parser_t *ctx)
+{
+	int r;
+	STAT_TIMER(t);
+
+	for (;;)
+	{
+		advance(ctx);
+
+		if (matches(ctx, TOK_EOF))
+		{
+			r = PARSE_OK;
+			break;
+		}
+
+		r = parse_step(ctx);
+		if (PARSE_OK != r)
+			break;
+
+		if (ctx->done)
+		{
+			r = PARSE_DONE;
+			break;
+		}
+	}
+
+	STAT_ADD(&ctx->stats, cycles_total, stat_clock() - t);
+
+	return r;
+}
+
+/*
+ * R as parse_run() gave it, but if the document is done,
+ * nothing but whitespace may come after it.
+ */
+static int
+parse_rest_of(json_parser_t *ctx, int r)
+{
+	if (PARSE_DONE != r)
+		return r;
+
+	advance(ctx);
+	if (!matches(ctx, TOK_EOF))
+		return parse_fail(ctx, JSON_ERR_TRAILING, ctx->tok);
+
+	return PARSE_DONE;
+}
+
+/*
+ * As parse_run(), for a whole input that should be one
+ * document: with JSON_OPT_STRICT, nothing but whitespace
+ * may come after it.
+ */
+static int
+parse_whole(json_parser_t *ctx)
+{
+	int r = parse_run(ctx);
+
+	if (ctx->flags & JSON_OPT_STRICT)
+		return parse_rest_of(ctx, r);
+
+	return r;
+}
+
+/*
+ * Contexts that live on the stack of the JSON_parse*()
+ * wrappers own nothing, so start them off empty. Whatever
+ * they pick up on the way (deep frames, say) is handed back
+ * with parser_release() once they are done with.
+ */
+static void
+parser_init(json_parser_t *ctx)
+{
+	ctx->carry = NULL;
+	ctx->carry_alloc = 0;
+	ctx->doc = NULL;
+	ctx->keys = NULL;
+	ctx->many_doc = NULL;
+	ctx->frames = ctx->frames_inline;
+	ctx->nr_frames = DEPTH_INLINE;
+	ctx->max_depth = DEPTH_MAX_DEFAULT;
+	memset(&ctx->mem, 0, sizeof(ctx->mem));
+}
+
+static void
+parser_release(json_parser_t *ctx)
+{
+	if (ctx->frames != ctx->frames_inline)
+		mem_free(&ctx->mem, ctx->frames);
+
+	if (NULL != ctx->carry)
+		mem_free(&ctx->mem, ctx->carry);
+}
+
+json_parser_t *
+JSON_parser_new(void)
+{
+	json_parser_t *ctx = malloc(sizeof(json_parser_t));
+
+	if (NULL == ctx)
+		return NULL;
+
+	memset(ctx, 0, sizeof(*ctx));
+	parser_init(ctx);
+
+	return ctx;
+}
+
+void
+JSON_parser_free(json_parser_t *ctx)
+{
+	assert(ctx);
+
+	if (NULL != ctx->doc)
+		JSON_free(ctx->doc);
+
+	if (NULL != ctx->many_doc)
+		JSON_free(ctx->many_doc);
+
+	parser_release(ctx);
+	free(ctx);
+
+	return;
+}
+
+/**
+ * Intern the names of every document CTX goes on to parse in
+ * TAB, whether or not JSON_OPT_INTERN is given, so that equal
+ * names in different documents are the same pointer too. A
+ * %NULL TAB goes back to per-document tables.
+ */
+void
+JSON_parser_set_intern(json_parser_t *ctx, json_intern_t *tab)
+{
+	assert(ctx);
+	ctx->keys = tab;
+}
+
+/**
+ * Refuse documents nested more than DEPTH containers deep,
+ * from the next parse on. 0 or less goes back to the default.
+ * However deep the limit, nesting costs CTX one small frame
+ * per level and never any C stack.
+ */
+void
+JSON_parser_set_max_depth(json_parser_t *ctx, int depth)
+{
+	assert(ctx);
+	ctx->max_depth = depth > 0 ? depth : DEPTH_MAX_DEFAULT;
+}
+
+/**
+ * Take the memory for every document or tape CTX goes on to
+ * parse, and for CTX's own frames and buffers, from MEM,
+ * which is copied; %NULL goes back to malloc(). Documents and
+ * tapes already made keep the allocator they were made with,
+ * and are freed through it. Not to be called while a stream
+ * is under way.
+ */
+void
+JSON_parser_set_allocator(json_parser_t *ctx, const json_allocator_t *mem)
+{
+	assert(ctx);
+
+	parser_release(ctx);
+	ctx->frames = ctx->frames_inline;
+	ctx->nr_frames = DEPTH_INLINE;
+	ctx->carry = NULL;
+	ctx->carry_alloc = 0;
+	ctx->carry_len = 0;
+
+	if (NULL != mem)
+		ctx->mem = *mem;
+	else
+		memset(&ctx->mem, 0, sizeof(ctx->mem));
+}
+
+/**
+ * Copy what the last parse with CTX counted into ST. A parse
+ * is everything from its JSON_parse_ctx(), JSON_parse_sax_ctx(),
+ * JSON_parse_tape_ctx() or JSON_stream_begin() on, or one
+ * record of JSON_parse_many(). Returns -1, with ST zeroed,
+ * if json.c was built without JSON_STATS.
+ */
+int
+JSON_parser_stats(json_parser_t *ctx, json_stats_t *st)
+{
+	assert(ctx);
+	assert(st);
+
+#ifdef JSON_STATS
+	int i;
+
+	*st = ctx->stats;
+	for (i = JSON_PHASE_STRING; i < JSON_NR_PHASES; ++i)
+		st->cycles[i] *= STAT_SAMPLE;
+
+	return 0;
+#else
+	memset(st, 0, sizeof(*st));
+
+	return -1;
+#endif
+}
+
+/*
+ * Point the lexer at a new stretch of input,
+ * leaving the parse itself where it is.
+ */
+static void
+parser_input(json_parser_t *ctx, const char *buf, size_t len, int final)
+{
+	ctx->ptr = buf;
+	ctx->end = buf + len;
+	ctx->final = final;
+	ctx->tok = buf;
+	scanner_init(&ctx->scanner, buf, len);
+#ifdef JSON_STATS
+	ctx->scanner.stats = &ctx->stats;
+#endif
+}
+
+static void
+parser_reset(json_parser_t *ctx, const char *buf, size_t len, int flags)
+{
+	ctx->flags = flags;
+	parser_input(ctx, buf, len, 1);
+
+	ctx->current = -1;
+	ctx->lookahead = -1;
+	ctx->node = NULL;
+	ctx->parent = NULL;
+	ctx->value = NULL;
+	ctx->depth = 0;
+	ctx->want_key = 0;
+	ctx->done = 0;
+	ctx->sep = SEP_OPEN;
+	ctx->err = JSON_ERR_NONE;
+	ctx->err_at = NULL;
+	ctx->handler = &tree_handler;
+	ctx->user = ctx;
+	ctx->scalar_root = 0;
+	ctx->doc = NULL;
+	ctx->tp = NULL;
+	ctx->carry_len = 0;
+#ifdef JSON_STATS
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+}
+
+static char root_name[] = "root";
+
+/*
+ * Make JN, new or emptied, the document being
+ * built, with an empty root node.
+ */
+static int
+document_init(json_parser_t *ctx, json_t *jn, int nr_hint)
+{
+	ctx->doc = jn;
+	jn->type = VALUE_OBJECT;
+	jn->flags = ctx->flags;
+	jn->nr_nodes = 0;
+	jn->keys = NULL;
+	jn->root = new_node(ctx);
+	if (NULL == jn->root)
+		return -1;
+
+	if (NULL != ctx->keys)
+		jn->keys = ctx->keys;
+	else
+	if (ctx->flags & JSON_OPT_INTERN)
+	{
+		jn->keys = intern_new(ARENA());
+		if (NULL == jn->keys)
+			return -1;
+	}
+
+	jn->root->name = root_name;
+	if (nr_hint > 0)
+		node_reserve(ARENA(), jn->root, nr_hint);
+
+	ctx->parent = jn->root;
+
+	return 0;
+}
+
+/*
+ * A new document from CTX's allocator, or %NULL if
+ * that won't give us one.
+ */
+static json_t *
+new_document(json_parser_t *ctx, int nr_hint)
+{
+	json_t *jn = JSON_new(&ctx->mem);
+
+	if (NULL == jn)
+		return NULL;
+
+	if (document_init(ctx, jn, nr_hint) < 0)
+	{
+		JSON_free(jn);
+		ctx->doc = NULL;
+
+		return NULL;
+	}
+
+	return jn;
+}
+
+static json_t *
+parse_tree(json_parser_t *ctx, const char *buf, size_t len, int flags, int nr_hint)
+{
+	json_t *jn;
+	int r;
+
+	assert(buf);
+	parser_reset(ctx, buf, len, flags);
+
+	jn = new_document(ctx, nr_hint);
+	if (NULL == jn)
+		return NULL;
+
+	r = parse_whole(ctx);
+	ctx->doc = NULL;
+
+	if (PARSE_DONE != r)
+	{
+		JSON_free(jn);
+		return NULL;
+	}
+
+	return jn;
+}
+
+/**
+ * Parse exactly LEN bytes at BUF into a new document using
+ * the state in CTX, which must not be in use by any other
+ * thread for the duration. BUF needn't be NUL-terminated, and
+ * is only ever read unless JSON_OPT_IN_PLACE is given. FLAGS
+ * is a mask of JSON_OPT_* options. With JSON_OPT_ZERO_COPY
+ * the names and string values of the document are views into
+ * BUF, which must then outlive the document; read them
+ * through JSON_name() and JSON_string(). With JSON_OPT_IN_PLACE
+ * they are decoded and NUL-terminated inside BUF, which must
+ * be writable and also outlive the document.
+ */
+json_t *
+JSON_parse_ctx(json_parser_t *ctx, const char *buf, size_t len, int flags)
+{
+	assert(ctx);
+	return parse_tree(ctx, buf, len, flags, 0);
+}
+
+/**
+ * As JSON_parse_ctx(), with a context of our own on the stack.
+ */
+json_t *
+JSON_parse_n(const char *buf, size_t len)
+{
+	json_parser_t ctx;
+	json_t *jn;
+
+	parser_init(&ctx);
+	jn = parse_tree(&ctx, buf, len, 0, 0);
+	parser_release(&ctx);
+
+	return jn;
+}
+
+/**
+ * As JSON_parse_n(), on a NUL-terminated string.
+ */
+json_t *
+JSON_parse_opt(char *json_data, int flags)
+{
+	return JSON_parse_hint(json_data, flags, 0);
+}
+
+/**
+ * As JSON_parse_opt(), but with a guess at how many
+ * members the top-level object has. Wide objects (ID to
+ * record maps, say) then get their value array sized
+ * up front rather than grown as they are parsed.
+ */
+json_t *
+JSON_parse_hint(char *json_data, int flags, int nr_hint)
+{
+	json_parser_t ctx;
+	json_t *jn;
+
+	assert(json_data);
+	parser_init(&ctx);
+	jn = parse_tree(&ctx, json_data, strlen(json_data), flags, nr_hint);
+	parser_release(&ctx);
+
+	return jn;
+}
+
+json_t *
+JSON_parse(char *json_data)
+{
+	return JSON_parse_opt(json_data, 0);
+}
+
+/**
+ * Parse the LEN bytes at BUF with JSON_OPT_IN_PLACE, handing
+ * BUF over to the document: it must have come from malloc()
+ * and is freed by JSON_free(), or straight away if the parse
+ * fails. Every name and string is then a C string inside BUF
+ * and the document allocates none of its own.
+ */
+json_t *
+JSON_parse_in_place(char *buf, size_t len, int flags)
+{
+	json_parser_t ctx;
+	json_t *jn;
+
+	assert(buf);
+	parser_init(&ctx);
+	jn = parse_tree(&ctx, buf, len, flags | JSON_OPT_IN_PLACE, 0);
+	parser_release(&ctx);
+
+	if (NULL == jn)
+	{
+		free(buf);
+		return NULL;
+	}
+
+	jn->buf = buf;
+
+	return jn;
+}
+
+/**
+ * Parse the file at PATH without reading it into memory
+ * first: it is mapped read-only and parsed in place. With
+ * JSON_OPT_ZERO_COPY the document's strings point into the
+ * mapping, which then stays until JSON_free(); otherwise it
+ * is unmapped as soon as the parse is done. JSON_OPT_IN_PLACE
+ * maps it copy-on-write instead, so that strings can be
+ * decoded in the mapping without touching the file, and
+ * keeps it as zero-copy does. Returns %NULL with errno set
+ * if the file can't be opened or mapped.
+ */
+json_t *
+JSON_parse_file(const char *path, int flags)
+{
+	json_parser_t ctx;
+	struct stat st;
+	json_t *jn;
+	void *map;
+	int fd;
+
+	assert(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0)
+		goto fail;
+
+	if (0 == st.st_size)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	map = mmap(NULL, st.st_size,
+		(flags & JSON_OPT_IN_PLACE) ? PROT_READ | PROT_WRITE : PROT_READ,
+		MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == map)
+		goto fail;
+
+	close(fd);
+
+/*
+ * We only ever go through the file front to back, so let
+ * the kernel read ahead aggressively and drop pages behind us.
+ */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	parser_init(&ctx);
+	jn = parse_tree(&ctx, map, st.st_size, flags, 0);
+	parser_release(&ctx);
+
+	if (NULL != jn && (flags & (JSON_OPT_ZERO_COPY | JSON_OPT_IN_PLACE)))
+	{
+		jn->map = map;
+		jn->map_len = st.st_size;
+	}
+	else
+	{
+		munmap(map, st.st_size);
+	}
+
+	return jn;
+
+fail:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Newline-delimited JSON: one document per line, with blank
+ * lines skipped. Every record is parsed into the same
+ * document, its arena rewound rather than freed, so once the
+ * first few records have sized it a record costs no malloc()
+ * at all. Lines are found with memchr(), which the C library
+ * already does a vector at a time.
+ */
+#define IS_BLANK(c) ((c) == SPACE || (c) == TAB || IS_CRNL(c))
+
+/**
+ * Start going through the LEN bytes at BUF a line at a time
+ * with JSON_parse_many(). FLAGS are the JSON_OPT_* options
+ * for every record; with JSON_OPT_ZERO_COPY, BUF must outlive
+ * the documents. BUF is only read, so JSON_OPT_IN_PLACE is
+ * ignored.
+ */
+void
+JSON_many_begin(json_parser_t *ctx, const char *buf, size_t len, int flags)
+{
+	assert(ctx);
+	assert(buf);
+
+	ctx->many = buf;
+	ctx->many_end = buf + len;
+	ctx->many_flags = flags & ~JSON_OPT_IN_PLACE;
+}
+
+/**
+ * Parse the next record. On JSON_MANY_OK, *DOCP is the
+ * document, which belongs to CTX and is only good until the
+ * next call, unless it is taken over with JSON_many_keep().
+ * JSON_MANY_ERROR means the record was not JSON, or there
+ * was more than blanks after it on its line; the next call
+ * goes on with the line after it. JSON_MANY_DONE means
+ * there are no more records.
+ */
+int
+JSON_parse_many(json_parser_t *ctx, json_t **docp)
+{
+	const char *s;
+	const char *e;
+	json_t *jn;
+	int r;
+
+	assert(ctx);
+	assert(docp);
+
+	*docp = NULL;
+
+	for (;;)
+	{
+		while (ctx->many < ctx->many_end && IS_BLANK(*ctx->many))
+			++ctx->many;
+
+		if (ctx->many >= ctx->many_end)
+			return JSON_MANY_DONE;
+
+		s = ctx->many;
+		e = memchr(s, NL, ctx->many_end - s);
+
+		if (NULL == e)
+			e = ctx->many_end;
+
+		ctx->many = e;
+
+		if (s < e)
+			break;
+	}
+
+	parser_reset(ctx, s, e - s, ctx->many_flags);
+
+	jn = ctx->many_doc;
+	if (NULL == jn)
+	{
+		ctx->many_doc = new_document(ctx, 0);
+		if (NULL == ctx->many_doc)
+			return JSON_MANY_ERROR;
+	}
+	else
+	{
+		arena_rewind(&jn->arena);
+		if (document_init(ctx, jn, 0) < 0)
+		{
+			ctx->doc = NULL;
+			return JSON_MANY_ERROR;
+		}
+	}
+
+/*
+ * A line is one record, strict or not, so
+ * the rest of it must be blank.
+ */
+	r = parse_rest_of(ctx, parse_run(ctx));
+
+	ctx->doc = NULL;
+
+	if (PARSE_DONE != r)
+		return JSON_MANY_ERROR;
+
+	*docp = ctx->many_doc;
+
+	return JSON_MANY_OK;
+}
+
+/**
+ * Take over the document JSON_parse_many() last returned, to
+ * be freed with JSON_free() when done with; it is no longer
+ * reused, so it can be handed to another thread. The next
+ * record gets a new document of its own.
+ */
+json_t *
+JSON_many_keep(json_parser_t *ctx)
+{
+	json_t *jn;
+
+	assert(ctx);
+
+	jn = ctx->many_doc;
+	ctx->many_doc = NULL;
+
+	return jn;
+}
+
+/*
+ * Parallel parsing of one big document. The top-level
+ * object or array is cut into runs of whole members (or
+ * elements) at commas one level down, each run is parsed on
+ * a thread of its own into a document of its own, and the
+ * runs' members are then moved into the first document,
+ * their arena chunks with them. Finding the commas is itself split over the threads:
+ * each first works out what its stretch of the input does
+ * to the nesting depth, both if it starts outside a string
+ * and if it starts inside one, which is all it takes to
+ * find out afterwards, in order, where every stretch really
+ * starts. Anything we can't split, or that doesn't parse
+ * when split, is parsed the ordinary way instead, so that
+ * we agree with JSON_parse_n() about every document.
+ */
+#ifndef PARALLEL_MIN_LEN
+# define PARALLEL_MIN_LEN (1 << 20)
+#endif
+
+typedef struct JSON_Split
+{
+	const char *buf;
+	size_t start;
+	size_t end;
+	size_t last;
+	int kind;
+	int flags;
+
+/*
+ * Filled in by the first pass: whether an odd number of
+ * quotes in the stretch flips the string state over, and
+ * the depth change each way. IN_STRING and DEPTH are then
+ * where the stretch really starts.
+ */
+	int flip;
+	long delta[2];
+	int in_string;
+	long depth;
+
+/*
+ * From the second pass: the first comma one level down, and
+ * whether the top-level object closed before LAST.
+ */
+	size_t comma;
+	int early;
+
+/*
+ * The members from COMMA up to the next stretch's COMMA.
+ */
+	size_t from;
+	size_t to;
+	json_t *doc;
+} json_split_t;
+
+#define NO_COMMA ((size_t)-1)
+
+/*
+ * Escaped or not is decided by the run of backslashes
+ * before a byte alone, so a stretch can work out its own.
+ */
+static uint64_t
+split_escaped(json_split_t *sp)
+{
+	size_t i = sp->start;
+	size_t n = 0;
+
+	while (i > 0 && '\\' == sp->buf[i-1])
+	{
+		--i;
+		++n;
+	}
+
+	return n & 1;
+}
+
+static void
+split_scan(json_split_t *sp, int pass)
+{
+	const unsigned char *buf = (const unsigned char *)sp->buf;
+	unsigned char tail[SCAN_BLOCK];
+	const unsigned char *p;
+	json_scanner_t sc;
+	json_masks_t m;
+	uint64_t escaped;
+	uint64_t quote;
+	uint64_t in_string;
+	uint64_t op;
+	size_t pos;
+	size_t off;
+	long depth = sp->depth;
+	int bit;
+	int c;
+
+	sc.prev_escaped = split_escaped(sp);
+	sc.prev_in_string = pass && sp->in_string ? ~0ULL : 0;
+
+	for (pos = sp->start; pos < sp->end; pos += SCAN_BLOCK)
+	{
+		if (sp->end - pos >= SCAN_BLOCK)
+		{
+			p = buf + pos;
+		}
+		else
+		{
+			memset(tail, SPACE, SCAN_BLOCK);
+			memcpy(tail, buf + pos, sp->end - pos);
+			p = tail;
+		}
+
+		classify_block(p, &m);
+
+		escaped = find_escaped(&sc, m.bslash);
+		quote = m.quote & ~escaped;
+
+		in_string = prefix_xor(quote) ^ sc.prev_in_string;
+		sc.prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+		op = m.op;
+		if (pass)
+			op &= ~in_string;
+
+		while (op)
+		{
+			bit = __builtin_ctzll(op);
+			op &= op - 1;
+
+			c = p[bit];
+			if (COLON == c)
+				continue;
+
+			if (!pass)
+			{
+				if (COMMA != c)
+					sp->delta[(in_string >> bit) & 1] += LBRACE == c || LBRACK == c ? 1 : -1;
+
+				continue;
+			}
+
+			off = pos + bit;
+
+			if (COMMA == c)
+			{
+				if (1 == depth && NO_COMMA == sp->comma)
+					sp->comma = off;
+			}
+			else
+			if (LBRACE == c || LBRACK == c)
+			{
+				++depth;
+			}
+			else
+			if (--depth <= 0 && off != sp->last)
+			{
+				sp->early = 1;
+			}
+		}
+	}
+
+	if (!pass)
+		sp->flip = sc.prev_in_string & 1;
+}
+
+static void *
+split_first_pass(void *arg)
+{
+	split_scan(arg, 0);
+	return NULL;
+}
+
+static void *
+split_second_pass(void *arg)
+{
+	split_scan(arg, 1);
+	return NULL;
+}
+
+/*
+ * Parse the members between FROM and TO as though we were
+ * already inside the top-level container.
+ */
+static void *
+split_parse(void *arg)
+{
+	json_split_t *sp = arg;
+	json_parser_t *ctx = malloc(sizeof(json_parser_t));
+	json_t *jn;
+	int r;
+
+	sp->doc = NULL;
+	if (NULL == ctx)
+		return NULL;
+
+	parser_init(ctx);
+	parser_reset(ctx, sp->buf + sp->from, sp->to - sp->from, sp->flags);
+
+	jn = new_document(ctx, 0);
+	if (NULL == jn)
+		goto out;
+
+	jn->type = NEST_ARRAY == sp->kind ? VALUE_ARRAY : VALUE_OBJECT;
+	ctx->frames[0].kind = sp->kind;
+	ctx->depth = 1;
+	ctx->want_key = IN_OBJECT(ctx);
+
+	r = parse_run(ctx);
+	ctx->doc = NULL;
+
+	if (PARSE_OK == r && 1 == ctx->depth && ctx->want_key == IN_OBJECT(ctx))
+		sp->doc = jn;
+	else
+		JSON_free(jn);
+
+out:
+	parser_release(ctx);
+	free(ctx);
+
+	return NULL;
+}
+
+/*
+ * Run FN on each of the NR things, SIZE bytes apiece, at
+ * ARGS, the first on this thread. If a thread can't be had,
+ * we do its share here.
+ */
+static void
+thread_run(void *args, size_t size, int nr, void *(*fn)(void *))
+{
+	pthread_t tid[nr];
+	int started[nr];
+	int i;
+
+	for (i = 1; i < nr; ++i)
+	{
+		started[i] = 0 == pthread_create(&tid[i], NULL, fn, (char *)args + i * size);
+		if (!started[i])
+			fn((char *)args + i * size);
+	}
+
+	fn(args);
+
+	for (i = 1; i < nr; ++i)
+	{
+		if (started[i])
+			pthread_join(tid[i], NULL);
+	}
+}
+
+/*
+ * Move the members, and the arena, of every other split's
+ * document into the first one's.
+ */
+static json_t *
+split_stitch(json_split_t *sp, int nr)
+{
+	json_t *jn = sp[0].doc;
+	json_node_t *root = jn->root;
+	json_node_t *r;
+	json_chunk_t *c;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < nr; ++i)
+		total += NVALS(sp[i].doc->root);
+
+	if (node_reserve(&jn->arena, root, total) < 0)
+		return NULL;
+
+	for (i = 1; i < nr; ++i)
+	{
+		r = sp[i].doc->root;
+
+		memcpy(&VALUE(root, NVALS(root)), VALUES(r), NVALS(r) * sizeof(json_value_t *));
+		NVALS(root) += NVALS(r);
+
+	/*
+	 * Its root node goes on being counted in its own
+	 * document's total until we get here.
+	 */
+		jn->nr_nodes += sp[i].doc->nr_nodes - 1;
+
+		c = sp[i].doc->arena.head;
+		if (NULL != c)
+		{
+			while (NULL != c->next)
+				c = c->next;
+
+			c->next = jn->arena.head->next;
+			jn->arena.head->next = sp[i].doc->arena.head;
+		}
+
+		jn->arena.bytes += sp[i].doc->arena.bytes;
+		jn->arena.nr_allocs += sp[i].doc->arena.nr_allocs;
+
+		mem_free(&sp[i].doc->arena.mem, sp[i].doc);
+		sp[i].doc = NULL;
+	}
+
+	if (VALUE_OBJECT == jn->type && NVALS(root) >= INDEX_EAGER_MIN)
+		node_index(jn, root);
+
+	return jn;
+}
+
+/*
+ * Find where to cut the top-level container between FIRST
+ * and LAST, its brackets. Returns the number of runs of
+ * members.
+ */
+static int
+split_input(json_split_t *sp, int nr, const char *buf, size_t first, size_t last, int flags)
+{
+	size_t size;
+	size_t from;
+	int in_string = 0;
+	long depth = 0;
+	int n;
+	int i;
+
+	size = (last + nr) / nr;
+	size = (size + SCAN_BLOCK - 1) & ~(size_t)(SCAN_BLOCK - 1);
+
+	for (i = 0; i < nr; ++i)
+	{
+		memset(&sp[i], 0, sizeof(sp[i]));
+		sp[i].buf = buf;
+		sp[i].start = i * size < last + 1 ? i * size : last + 1;
+		sp[i].end = (i + 1) * size < last + 1 ? (i + 1) * size : last + 1;
+		sp[i].last = last;
+		sp[i].kind = buf[first];
+		sp[i].flags = flags;
+		sp[i].comma = NO_COMMA;
+	}
+
+	thread_run(sp, sizeof(*sp), nr, split_first_pass);
+
+	for (i = 0; i < nr; ++i)
+	{
+		sp[i].in_string = in_string;
+		sp[i].depth = depth;
+
+		depth += sp[i].delta[in_string];
+		in_string ^= sp[i].flip;
+	}
+
+	if (0 != depth || in_string)
+		return 0;
+
+	thread_run(sp, sizeof(*sp), nr, split_second_pass);
+
+/*
+ * The first comma in each stretch starts a new run,
+ * and stretches with none join the one before.
+ */
+	from = first + 1;
+	n = 0;
+
+	for (i = 0; i < nr; ++i)
+	{
+		if (sp[i].early)
+			return 0;
+
+	/*
+	 * The first run starts at the brace anyway.
+	 */
+		if (0 == i || NO_COMMA == sp[i].comma)
+			continue;
+
+		sp[n].from = from;
+		sp[n].to = sp[i].comma;
+		from = sp[i].comma + 1;
+		++n;
+	}
+
+	sp[n].from = from;
+	sp[n].to = last;
+
+	return n + 1;
+}
+
+/**
+ * As JSON_parse_n(), but on up to NR_THREADS threads (one
+ * per online CPU if 0 or less) for a document big enough
+ * to be worth it. The members of the top-level object, or
+ * the elements of the top-level array, are parsed in
+ * parallel and the result is the same document JSON_parse_n()
+ * would make, except that JSON_OPT_INTERN is ignored: names
+ * are not interned across threads. BUF is only read, so
+ * JSON_OPT_IN_PLACE is ignored as well. A document too small to
+ * split, or parsed with JSON_OPT_STRICT, is parsed on this
+ * thread. Needs linking with -pthread.
+ */
+json_t *
+JSON_parse_parallel(const char *buf, size_t len, int flags, int nr_threads)
+{
+	json_parser_t ctx;
+	json_split_t *sp;
+	json_t *jn = NULL;
+	size_t first = 0;
+	size_t last = len;
+	int nr;
+	int i;
+
+	assert(buf);
+	flags &= ~JSON_OPT_IN_PLACE;
+
+	if (nr_threads <= 0)
+		nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ((size_t)nr_threads > len / PARALLEL_MIN_LEN)
+		nr_threads = (int)(len / PARALLEL_MIN_LEN);
+
+	while (first < len && IS_BLANK(buf[first]))
+		++first;
+
+	while (last > first && IS_BLANK(buf[last-1]))
+		--last;
+
+	if (nr_threads < 2 || last - first < 2)
+		goto serial;
+
+	if (!(LBRACE == buf[first] && RBRACE == buf[last-1])
+	&& !(LBRACK == buf[first] && RBRACK == buf[last-1]))
+		goto serial;
+
+/*
+ * A piece can't tell what separator came before it.
+ */
+	if (flags & JSON_OPT_STRICT)
+		goto serial;
+
+	--last;
+
+	sp = calloc(nr_threads, sizeof(json_split_t));
+	if (NULL == sp)
+		goto serial;
+
+	nr = split_input(sp, nr_threads, buf, first, last, flags & ~JSON_OPT_INTERN);
+	if (nr < 2)
+	{
+		free(sp);
+		goto serial;
+	}
+
+	thread_run(sp, sizeof(*sp), nr, split_parse);
+
+	for (i = 0; i < nr; ++i)
+	{
+		if (NULL == sp[i].doc)
+			break;
+	}
+
+	if (i == nr)
+		jn = split_stitch(sp, nr);
+
+	for (i = 0; i < nr; ++i)
+	{
+		if (NULL != sp[i].doc && sp[i].doc != jn)
+			JSON_free(sp[i].doc);
+	}
+
+	free(sp);
+
+	if (NULL != jn)
+		return jn;
+
+serial:
+	parser_init(&ctx);
+	jn = parse_tree(&ctx, buf, len, flags, 0);
+	parser_release(&ctx);
+
+	return jn;
+}
+
+/*
+ * Parsing a batch of independent documents. Each worker
+ * starts with an even share of the batch as a range of
+ * indices in one word, LO in the top half and HI in the
+ * bottom, and takes documents from the bottom of it. Once
+ * its own range is empty it steals the top half of someone
+ * else's, so a worker stuck on one huge document has the
+ * rest of its share taken off it rather than holding up the
+ * small ones behind it. Taking and stealing are both one
+ * compare-and-swap on the range. Every worker parses with a
+ * context of its own, and every document has its own arena,
+ * so the workers share no memory but the ranges.
+ */
+#define RANGE(lo,hi) (((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define RANGE_LO(r) ((uint32_t)((r) >> 32))
+#define RANGE_HI(r) ((uint32_t)(r))
+
+typedef struct JSON_Batch
+{
+	const char **bufs;
+	const size_t *lens;
+	json_t **out;
+	int flags;
+	int nr_workers;
+	struct JSON_Batch_Worker *w;
+} json_batch_t;
+
+/*
+ * A cache line each, not to have one worker's
+ * range bounce about between the others' cores.
+ */
+typedef struct JSON_Batch_Worker
+{
+	uint64_t range;
+	json_batch_t *batch;
+	int id;
+	int nr_parsed;
+} __attribute__((aligned(64))) json_batch_worker_t;
+
+static int
+batch_take(json_batch_worker_t *w, uint32_t *i)
+{
+	uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+	while (RANGE_LO(r) < RANGE_HI(r))
+	{
+		if (__atomic_compare_exchange_n(&w->range, &r, RANGE(RANGE_LO(r) + 1, RANGE_HI(r)),
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			*i = RANGE_LO(r);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Only W itself ever fills its range, and only once it is
+ * empty, so whatever W finds it can simply store.
+ */
+static int
+batch_steal(json_batch_worker_t *w)
+{
+	json_batch_t *b = w->batch;
+	json_batch_worker_t *v;
+	uint64_t r;
+	uint32_t lo;
+	uint32_t hi;
+	uint32_t k;
+	int i;
+
+	for (i = 1; i < b->nr_workers; ++i)
+	{
+		v = &b->w[(w->id + i) % b->nr_workers];
+		r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+
+		while ((lo = RANGE_LO(r)) < (hi = RANGE_HI(r)))
+		{
+			k = (hi - lo + 1) / 2;
+
+			if (__atomic_compare_exchange_n(&v->range, &r, RANGE(lo, hi - k),
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				__atomic_store_n(&w->range, RANGE(hi - k, hi), __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static void *
+batch_work(void *arg)
+{
+	json_batch_worker_t *w = arg;
+	json_batch_t *b = w->batch;
+	json_parser_t ctx;
+	uint32_t i;
+
+	parser_init(&ctx);
+
+	for (;;)
+	{
+		if (batch_take(w, &i) < 0)
+		{
+			if (batch_steal(w) < 0)
+				break;
+
+			continue;
+		}
+
+		b->out[i] = parse_tree(&ctx, b->bufs[i], b->lens[i], b->flags, 0);
+		if (NULL != b->out[i])
+			++w->nr_parsed;
+	}
+
+	parser_release(&ctx);
+
+	return NULL;
+}
+
+/**
+ * Parse each of the N documents, LENS[i] bytes at BUFS[i],
+ * into OUT[i] as JSON_parse_ctx() would, on up to NR_THREADS
+ * threads (one per online CPU if 0 or less). OUT[i] is %NULL
+ * for a document that doesn't parse. Returns how many did,
+ * or -1 if we run out of memory before starting. The buffers
+ * are only read, so JSON_OPT_IN_PLACE is ignored. Needs
+ * linking with -pthread.
+ */
+int
+JSON_batch_parse(const char **bufs, const size_t *lens, int n, json_t **out, int flags, int nr_threads)
+{
+	json_batch_worker_t *w;
+	json_batch_t b;
+	int nr_parsed = 0;
+	int i;
+
+	assert(bufs);
+	assert(lens);
+	assert(out);
+
+	if (n <= 0)
+		return 0;
+
+	if (nr_threads <= 0)
+		nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nr_threads > n)
+		nr_threads = n;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	if (0 != posix_memalign((void **)&w, sizeof(json_batch_worker_t), nr_threads * sizeof(*w)))
+		return -1;
+
+	b.bufs = bufs;
+	b.lens = lens;
+	b.out = out;
+	b.flags = flags & ~JSON_OPT_IN_PLACE;
+	b.nr_workers = nr_threads;
+	b.w = w;
+
+	for (i = 0; i < nr_threads; ++i)
+	{
+		w[i].range = RANGE((int64_t)n * i / nr_threads, (int64_t)n * (i + 1) / nr_threads);
+		w[i].batch = &b;
+		w[i].id = i;
+		w[i].nr_parsed = 0;
+	}
+
+	thread_run(w, sizeof(*w), nr_threads, batch_work);
+
+	for (i = 0; i < nr_threads; ++i)
+		nr_parsed += w[i].nr_parsed;
+
+	free(w);
+
+	return nr_parsed;
+}
+
+/**
+ * Parse the LEN bytes at BUF without building anything at
+ * all: each key and value is handed to the callbacks in H
+ * as it is seen, along with USER. Callbacks that H leaves
+ * %NULL are skipped, and any callback can stop the parse
+ * by returning non-zero. Strings are passed as views into
+ * BUF with their escape sequences still in them, flagged
+ * by ESCAPED; JSON_unescape() decodes them on request.
+ * Nothing is allocated. The document may be a lone scalar,
+ * and only whitespace may follow it. Returns JSON_SAX_OK
+ * once the whole document has been seen, JSON_SAX_ABORTED
+ * if a callback stopped it, or JSON_SAX_ERROR if BUF is
+ * not JSON.
+ */
+int
+JSON_parse_sax_ctx(json_parser_t *ctx, const char *buf, size_t len, const json_handler_t *h, void *user)
+{
+	assert(ctx);
+	assert(buf);
+	assert(h);
+
+	parser_reset(ctx, buf, len, 0);
+
+	ctx->handler = h;
+	ctx->user = user;
+	ctx->scalar_root = 1;
+
+	switch(parse_rest_of(ctx, parse_run(ctx)))
+	{
+		case PARSE_DONE:
+			return JSON_SAX_OK;
+
+		case PARSE_ABORT:
+			return JSON_SAX_ABORTED;
+
+		default:
+			return JSON_SAX_ERROR;
+	}
+}
+
+/**
+ * As JSON_parse_sax_ctx(), with a context of our own on the stack.
+ */
+int
+JSON_parse_sax(const char *buf, size_t len, const json_handler_t *h, void *user)
+{
+	json_parser_t ctx;
+	int r;
+
+	parser_init(&ctx);
+	r = JSON_parse_sax_ctx(&ctx, buf, len, h, user);
+	parser_release(&ctx);
+
+	return r;
+}
+
+/**
+ * Check that the LEN bytes at BUF are one JSON document and
+ * nothing more, by the rules of JSON_OPT_STRICT; as RFC 8259
+ * has it, that may be a lone string, number, true, false or
+ * null as well as an object or array. This is the
+ * SAX parse with no callbacks, and has the frames for the
+ * default maximum depth on the stack, so nothing is built
+ * and nothing allocated, whatever BUF holds. Returns 0 if
+ * BUF is valid. Otherwise returns -1 and, if ERR is given,
+ * fills it in with a JSON_ERR_* code and the offset in BUF
+ * of where it went wrong.
+ */
+int
+JSON_validate(const char *buf, size_t len, json_error_t *err)
+{
+	static const json_handler_t null_handler;
+	json_frame_t frames[DEPTH_MAX_DEFAULT];
+	json_parser_t ctx;
+	int r;
+
+	assert(buf);
+
+	parser_init(&ctx);
+	ctx.frames = frames;
+	ctx.nr_frames = DEPTH_MAX_DEFAULT;
+
+	parser_reset(&ctx, buf, len, JSON_OPT_STRICT);
+	ctx.handler = &null_handler;
+	ctx.scalar_root = 1;
+
+	r = parse_whole(&ctx);
+
+	if (PARSE_OK == r)
+		parse_fail(&ctx, JSON_ERR_EOF, buf + len);
+	else
+	if (PARSE_DONE != r)
+		parse_fail(&ctx, JSON_ERR_SYNTAX, ctx.tok);
+
+	if (NULL != err)
+	{
+		err->code = ctx.err;
+		err->offset = JSON_ERR_NONE == ctx.err ? len : (size_t)(ctx.err_at - buf);
+	}
+
+	return JSON_ERR_NONE == ctx.err ? 0 : -1;
+}
+
+/**
+ * Decode the escape sequences in the LEN bytes at SRC into
+ * DST, which needs room for LEN bytes; the result is never
+ * longer. Returns the decoded length. DST is not terminated.
+ */
+size_t
+JSON_unescape(char *dst, const char *src, size_t len)
+{
+	assert(dst);
+	assert(src);
+
+	return unescape(dst, src, len);
+}
+
+/*
+ * On-demand lookup. Rather than parse the document we walk
+ * stage one's structural index directly: a subtree we don't
+ * want is stepped over by counting brackets, which is all
+ * it takes because nothing inside a string is a structural.
+ * Stage one only runs as far ahead as we have got, so the
+ * cost is in how far into the document the path leads.
+ */
+#define AT(sc, off) ((sc)->buf[(off)])
+
+/*
+ * OFF is the start of a value; leave SC just past its end.
+ * Returns the offset of its last structural, or -1.
+ */
+static long
+skip_value(json_scanner_t *sc, size_t off)
+{
+	int depth = 1;
+
+	switch(AT(sc, off))
+	{
+		case DQUOTE:
+
+			off = scanner_next(sc);
+			return off < sc->len ? (long)off : -1;
+
+		case LBRACE:
+		case LBRACK:
+
+			while (depth > 0)
+			{
+				off = scanner_next(sc);
+				if (off >= sc->len)
+					return -1;
+
+				switch(AT(sc, off))
+				{
+					case LBRACE:
+					case LBRACK:
+						++depth;
+						break;
+
+					case RBRACE:
+					case RBRACK:
+						--depth;
+						break;
+				}
+			}
+
+			return off;
+
+		case RBRACE:
+		case RBRACK:
+		case COMMA:
+		case COLON:
+
+			return -1;
+
+		default:
+
+			return off;
+	}
+}
+
+/*
+ * Compare a name straight out of the input with KEY. One
+ * with escapes in is decoded a piece at a time into TMP,
+ * never splitting an escape, and compared as it goes.
+ */
+static int
+name_is(const char *s, size_t len, const char *key, size_t klen)
+{
+	char tmp[256];
+	size_t n;
+	size_t m;
+
+	if (NULL == memchr(s, BSLASH, len))
+		return len == klen && !memcmp(s, key, klen);
+
+	if (klen > len)
+		return 0;
+
+	while (len > 0)
+	{
+		for (n = 0; n < len && n + ESCAPE_MAX <= sizeof(tmp); )
+			n += BSLASH == s[n] ? escape_length(s + n, s + len) : 1;
+
+		m = unescape(tmp, s, n);
+		if (m > klen || memcmp(tmp, key, m))
+			return 0;
+
+		key += m;
+		klen -= m;
+		s += n;
+		len -= n;
+	}
+
+	return 0 == klen;
+}
+
+/*
+ * From the object at *OFF to the value of its member KEY.
+ * Commas and colons are optional, as they are to the parser.
+ */
+static int
+find_member(json_scanner_t *sc, size_t *off, const char *key, size_t klen)
+{
+	size_t k;
+	size_t q;
+	size_t v;
+
+	if (LBRACE != AT(sc, *off))
+		return JSON_FIND_MISSING;
+
+	for (;;)
+	{
+		k = scanner_next(sc);
+		if (k >= sc->len)
+			return JSON_FIND_ERROR;
+
+		if (COMMA == AT(sc, k))
+			continue;
+
+		if (RBRACE == AT(sc, k))
+			return JSON_FIND_MISSING;
+
+		if (DQUOTE != AT(sc, k))
+			return JSON_FIND_ERROR;
+
+		q = scanner_next(sc);
+		v = scanner_next(sc);
+
+		if (v < sc->len && COLON == AT(sc, v))
+			v = scanner_next(sc);
+
+		if (q >= sc->len || v >= sc->len)
+			return JSON_FIND_ERROR;
+
+		if (name_is(sc->buf + k + 1, q - k - 1, key, klen))
+		{
+			*off = v;
+			return JSON_FIND_OK;
+		}
+
+		if (skip_value(sc, v) < 0)
+			return JSON_FIND_ERROR;
+	}
+}
+
+/*
+ * From the array at *OFF to its element NR.
+ */
+static int
+find_element(json_scanner_t *sc, size_t *off, size_t nr)
+{
+	size_t v;
+
+	if (LBRACK != AT(sc, *off))
+		return JSON_FIND_MISSING;
+
+	for (;;)
+	{
+		v = scanner_next(sc);
+		if (v >= sc->len)
+			return JSON_FIND_ERROR;
+
+		if (COMMA == AT(sc, v))
+			continue;
+
+		if (RBRACK == AT(sc, v))
+			return JSON_FIND_MISSING;
+
+		if (0 == nr--)
+		{
+			*off = v;
+			return JSON_FIND_OK;
+		}
+
+		if (skip_value(sc, v) < 0)
+			return JSON_FIND_ERROR;
+	}
+}
+
+/*
+ * Fill in ITEM from the value at OFF.
+ */
+static int
+found_item(json_scanner_t *sc, size_t off, json_item_t *item)
+{
+	const char *s = sc->buf + off;
+	const char *e = sc->buf + sc->len;
+	const char *p;
+	long end;
+
+	memset(item, 0, sizeof(*item));
+
+	switch(*s)
+	{
+		case DQUOTE:
+
+			if ((end = skip_value(sc, off)) < 0)
+				return JSON_FIND_ERROR;
+
+			item->type = VALUE_STRING;
+			item->s = s + 1;
+			item->len = end - off - 1;
+
+			if (NULL != memchr(item->s, BSLASH, item->len))
+				item->flags = JSON_F_STRING_ESCAPED;
+
+			return JSON_FIND_OK;
+
+		case LBRACE:
+		case LBRACK:
+
+			if ((end = skip_value(sc, off)) < 0)
+				return JSON_FIND_ERROR;
+
+			item->type = LBRACE == *s ? VALUE_OBJECT : VALUE_ARRAY;
+			item->s = s;
+			item->len = end - off + 1;
+
+			return JSON_FIND_OK;
+	}
+
+	for (p = s; p < e && !IS_DELIM(*p); ++p)
+		;
+
+	item->s = s;
+	item->len = p - s;
+
+	if (MINUS == *s || isdigit((unsigned char)*s))
+	{
+		if (read_number(s, p, 1, &item->num, &p) < 0 || p != s + item->len)
+			return JSON_FIND_ERROR;
+
+		item->type = item->num.type;
+		item->flags = item->num.flags;
+	}
+	else
+	if (4 == item->len && !memcmp(s, "true", 4))
+	{
+		item->type = VALUE_BOOLEAN;
+		item->b = TRUE;
+	}
+	else
+	if (5 == item->len && !memcmp(s, "false", 5))
+	{
+		item->type = VALUE_BOOLEAN;
+		item->b = FALSE;
+	}
+	else
+	if (4 == item->len && !memcmp(s, "null", 4))
+	{
+		item->type = VALUE_NULL;
+	}
+	else
+	{
+		return JSON_FIND_ERROR;
+	}
+
+	return JSON_FIND_OK;
+}
+
+/**
+ * Find the value at PATH in the LEN bytes of JSON at BUF
+ * without parsing any more of it than getting there takes.
+ * PATH is a run of member names, each after a '.' (optional
+ * for the first), and array indexes in brackets, as in
+ * "data.items[3].price"; an empty PATH is the whole of BUF.
+ * Member names in PATH can't themselves hold '.' or '['.
+ *
+ * The value is described in ITEM. Strings are views into
+ * BUF between the quotes, with JSON_F_STRING_ESCAPED if they
+ * need JSON_unescape(). Objects and arrays are their whole
+ * span, brackets included, so that they can be searched in
+ * turn or handed to JSON_parse_n(). Nothing is allocated.
+ * Returns JSON_FIND_OK, JSON_FIND_MISSING if there is no such
+ * value, or JSON_FIND_ERROR if BUF or PATH are malformed.
+ */
+int
+JSON_ondemand_find(const char *buf, size_t len, const char *path, json_item_t *item)
+{
+	json_scanner_t sc;
+	const char *key;
+	size_t off;
+	size_t nr;
+	char *end;
+	int r;
+
+	assert(buf);
+	assert(path);
+	assert(item);
+
+	scanner_init(&sc, buf, len);
+
+	off = scanner_next(&sc);
+	if (off >= len)
+		return JSON_FIND_ERROR;
+
+	while (*path)
+	{
+		if (LBRACK == *path)
+		{
+			if (!isdigit((unsigned char)path[1]))
+				return JSON_FIND_ERROR;
+
+			nr = strtoul(path + 1, &end, 10);
+			if (RBRACK != *end)
+				return JSON_FIND_ERROR;
+
+			path = end + 1;
+			r = find_element(&sc, &off, nr);
+		}
+		else
+		{
+			if ('.' == *path)
+				++path;
+
+			for (key = path; *path && '.' != *path && LBRACK != *path; ++path)
+				;
+
+			r = find_member(&sc, &off, key, path - key);
+		}
+
+		if (JSON_FIND_OK != r)
+			return r;
+	}
+
+	return found_item(&sc, off, item);
+}
+
+/*
+ * Compiled queries. A query is a JSON Pointer (RFC 6901),
+ * decoded and cut into steps once, with each step's hash
+ * worked out up front, plus one addition: a step of "*"
+ * matches every member or element. A set of queries is run
+ * over a document in a single walk, each level of which
+ * carries the mask of queries still on the path to it, so
+ * a subtree that no query wants is never looked at and one
+ * that several want is only walked once. In a tree, levels
+ * without a wildcard are hash lookups; in raw input they
+ * are a pass over stage one's index, as JSON_ondemand_find()
+ * does.
+ */
+#define QUERY_STEPS_MAX 32
+
+typedef struct JSON_Query_Step
+{
+	const char *key;
+	size_t len;
+	unsigned int hash;
+	long index;
+	int wild;
+} json_query_step_t;
+
+struct JSON_Query
+{
+	int nr_steps;
+	json_query_step_t steps[];
+};
+
+/*
+ * One level of the walk: the container, the queries whose
+ * next step applies to its members or elements, and where
+ * we are in it. With lookups, TODO is the queries whose
+ * step we have yet to look up. In raw input, WHOLE is the
+ * queries that match the container itself, which can only
+ * be handed back once we know where it ends.
+ */
+typedef struct JSON_Query_Frame
+{
+	json_node_t *node;
+	int type;
+	int enumerate;
+	int next;
+	uint64_t alive;
+	uint64_t todo;
+	size_t start;
+	uint64_t whole;
+} json_query_frame_t;
+
+struct JSON_Query_Iter
+{
+	const json_query_t *queries[JSON_QUERY_MAX];
+	int nr_queries;
+	uint64_t all;
+	uint64_t wild[QUERY_STEPS_MAX];
+	uint64_t last[QUERY_STEPS_MAX];
+
+	json_t *json;
+	json_scanner_t scanner;
+	int error;
+
+	json_query_frame_t frames[QUERY_STEPS_MAX];
+	int depth;
+
+	uint64_t pending;
+	json_value_t *value;
+	json_item_t item;
+};
+
+#define QUERY_STEP(it, q, d) (&(it)->queries[(q)]->steps[(d)])
+#define QUERY_BIT(q) (1ULL << (q))
+
+/*
+ * An array index is 0 or digits with no leading 0.
+ */
+static long
+query_index(const char *s, size_t len)
+{
+	long i = 0;
+	size_t n;
+
+	if (0 == len || len > 18 || ('0' == s[0] && len > 1))
+		return -1;
+
+	for (n = 0; n < len; ++n)
+	{
+		if (!isdigit((unsigned char)s[n]))
+			return -1;
+
+		i = i * 10 + (s[n] - '0');
+	}
+
+	return i;
+}
+
+/*
+ * POINTER as steps, up to MAX of them, in memory from MEM.
+ * "" is no steps at all.
+ */
+static json_query_t *
+pointer_parse(const json_allocator_t *mem, const char *pointer, int max)
+{
+	json_query_step_t *st;
+	json_query_t *q;
+	const char *p;
+	char *d;
+	int nr = 0;
+
+	if (0 != *pointer && '/' != *pointer)
+		return NULL;
+
+	for (p = pointer; *p; ++p)
+		nr += '/' == *p;
+
+	if (nr > max)
+		return NULL;
+
+	q = mem_alloc(mem, sizeof(json_query_t) + nr * sizeof(json_query_step_t) + strlen(pointer) + 1);
+	if (NULL == q)
+		return NULL;
+
+	q->nr_steps = nr;
+	d = (char *)&q->steps[nr];
+
+	for (p = pointer, st = q->steps; *p; ++st)
+	{
+		st->key = d;
+		st->wild = '*' == p[1] && ('/' == p[2] || 0 == p[2]);
+
+		for (++p; *p && '/' != *p; ++p)
+		{
+			if ('~' != *p)
+			{
+				*d++ = *p;
+				continue;
+			}
+
+			if ('0' != p[1] && '1' != p[1])
+				goto fail;
+
+			*d++ = '0' == *++p ? '~' : '/';
+		}
+
+		st->len = d - st->key;
+		st->hash = hash_name(st->key, st->len);
+		st->index = query_index(st->key, st->len);
+		*d++ = 0;
+	}
+
+	return q;
+
+fail:
+	mem_free(mem, q);
+	return NULL;
+}
+
+/**
+ * Compile POINTER, a JSON Pointer such as "/data/items/0/price"
+ * in which "~0" stands for '~' and "~1" for '/', into a query
+ * for JSON_query_iter_new(). A step of "*" matches every member
+ * of an object and every element of an array. Returns %NULL if
+ * POINTER is not a pointer, has more than 32 steps or is ""
+ * (the whole document, which is already to hand).
+ */
+json_query_t *
+JSON_query_compile(const char *pointer)
+{
+	assert(pointer);
+
+	if ('/' != *pointer)
+		return NULL;
+
+	return pointer_parse(&libc_mem, pointer, QUERY_STEPS_MAX);
+}
+
+void
+JSON_query_free(json_query_t *q)
+{
+	free(q);
+}
+
+/**
+ * An iterator that runs the NR queries at QUERIES together,
+ * up to JSON_QUERY_MAX of them, over one document after
+ * another. The queries must outlive it. Returns %NULL if
+ * there are too many or we run out of memory.
+ */
+json_query_iter_t *
+JSON_query_iter_new(json_query_t *const *queries, int nr)
+{
+	json_query_iter_t *it;
+	int i;
+	int d;
+
+	assert(queries || 0 == nr);
+
+	if (nr < 0 || nr > JSON_QUERY_MAX)
+		return NULL;
+
+	it = calloc(1, sizeof(json_query_iter_t));
+	if (NULL == it)
+		return NULL;
+
+	it->nr_queries = nr;
+
+	for (i = 0; i < nr; ++i)
+	{
+		assert(queries[i]);
+		it->queries[i] = queries[i];
+
+		if (0 == queries[i]->nr_steps)
+			continue;
+
+		it->all |= QUERY_BIT(i);
+		it->last[queries[i]->nr_steps - 1] |= QUERY_BIT(i);
+
+		for (d = 0; d < queries[i]->nr_steps; ++d)
+		{
+			if (queries[i]->steps[d].wild)
+				it->wild[d] |= QUERY_BIT(i);
+		}
+	}
+
+	return it;
+}
+
+void
+JSON_query_iter_free(json_query_iter_t *it)
+{
+	free(it);
+}
+
+/*
+ * Go into a container with the queries in ALIVE, which
+ * all have a step for its members or elements.
+ */
+static void
+query_push(json_query_iter_t *it, json_node_t *node, int type, uint64_t alive)
+{
+	json_query_frame_t *f = &it->frames[it->depth];
+
+	f->node = node;
+	f->type = type;
+	f->enumerate = 0 != (alive & it->wild[it->depth]);
+	f->next = 0;
+	f->alive = alive;
+	f->todo = alive;
+	f->start = 0;
+	f->whole = 0;
+
+	++it->depth;
+}
+
+/**
+ * Start IT over the parsed document JSON.
+ */
+void
+JSON_query_start(json_query_iter_t *it, json_t *json)
+{
+	assert(it);
+	assert(json);
+
+	it->json = json;
+	it->error = 0;
+	it->depth = 0;
+	it->pending = 0;
+
+	if (0 != it->all)
+		query_push(it, json->root, json->type, it->all);
+}
+
+/**
+ * Start IT over the LEN bytes of JSON at BUF, which is walked
+ * as it is, as by JSON_ondemand_find(), and must outlive the
+ * walk. Matches come back in the order they end in BUF, so
+ * an object or array comes after any matches inside it.
+ */
+void
+JSON_query_start_raw(json_query_iter_t *it, const char *buf, size_t len)
+{
+	size_t off;
+
+	assert(it);
+	assert(buf);
+
+	it->json = NULL;
+	it->error = 0;
+	it->depth = 0;
+	it->pending = 0;
+	scanner_init(&it->scanner, buf, len);
+
+	off = scanner_next(&it->scanner);
+	if (off >= len)
+	{
+		it->error = 1;
+		return;
+	}
+
+	if (0 == it->all)
+		return;
+
+	if (LBRACE == AT(&it->scanner, off))
+		query_push(it, NULL, VALUE_OBJECT, it->all);
+	else
+	if (LBRACK == AT(&it->scanner, off))
+		query_push(it, NULL, VALUE_ARRAY, it->all);
+	else
+		return;
+
+	it->frames[0].start = off;
+}
+
+/*
+ * Which of the queries in F are after the member or element
+ * V, the I'th of F's container.
+ */
+static uint64_t
+query_match_value(json_query_iter_t *it, json_query_frame_t *f, json_value_t *v, int i)
+{
+	const json_query_step_t *st;
+	int d = it->depth - 1;
+	uint64_t m = f->alive & it->wild[d];
+	uint64_t rest = f->alive & ~m;
+	unsigned int h = 0;
+	int q;
+
+	if (VALUE_OBJECT == f->type && 0 != rest)
+		h = value_name_hash(it->json, v);
+
+	while (rest)
+	{
+		q = __builtin_ctzll(rest);
+		rest &= rest - 1;
+		st = QUERY_STEP(it, q, d);
+
+		if (VALUE_ARRAY == f->type
+		? st->index == i
+		: SAME_NAME(v, h, st->key, st->len))
+			m |= QUERY_BIT(q);
+	}
+
+	return m;
+}
+
+/*
+ * The next member or element of F that some query is after,
+ * looked up by the step of the first query in F's TODO. The
+ * same lookup does for every other query with the same step,
+ * whose bits come back in *MASK.
+ */
+static json_value_t *
+query_lookup(json_query_iter_t *it, json_query_frame_t *f, uint64_t *mask)
+{
+	const json_query_step_t *st;
+	const json_query_step_t *o;
+	json_value_t *v = NULL;
+	int d = it->depth - 1;
+	uint64_t rest;
+	int q;
+
+	while (NULL == v && 0 != f->todo)
+	{
+		q = __builtin_ctzll(f->todo);
+		st = QUERY_STEP(it, q, d);
+		*mask = 0;
+
+		for (rest = f->todo; rest; rest &= rest - 1)
+		{
+			q = __builtin_ctzll(rest);
+			o = QUERY_STEP(it, q, d);
+
+			if (o->len == st->len && !memcmp(o->key, st->key, st->len))
+				*mask |= QUERY_BIT(q);
+		}
+
+		f->todo &= ~*mask;
+
+		if (VALUE_ARRAY == f->type)
+		{
+			if (st->index >= 0 && st->index < NVALS(f->node))
+				v = VALUE(f->node, st->index);
+		}
+		else
+		{
+			v = node_get(it->json, f->node, st->key, st->len, st->hash);
+		}
+	}
+
+	return v;
+}
+
+static int
+query_next_tree(json_query_iter_t *it)
+{
+	json_query_frame_t *f;
+	json_value_t *v;
+	uint64_t mask;
+	uint64_t going;
+	int d;
+
+	while (it->depth > 0)
+	{
+		f = &it->frames[it->depth - 1];
+		d = it->depth - 1;
+
+		if (f->enumerate)
+		{
+			if (f->next >= NVALS(f->node))
+			{
+				--it->depth;
+				continue;
+			}
+
+			v = VALUE(f->node, f->next);
+			mask = query_match_value(it, f, v, f->next);
+			++f->next;
+		}
+		else
+		{
+			v = query_lookup(it, f, &mask);
+			if (NULL == v)
+			{
+				--it->depth;
+				continue;
+			}
+		}
+
+		if (0 == mask)
+			continue;
+
+		going = mask & ~it->last[d];
+
+		if (0 != going && VALUE_OBJECT == v->type)
+			query_push(it, v->value.u_object, VALUE_OBJECT, going);
+		else
+		if (0 != going && VALUE_ARRAY == v->type)
+			query_push(it, v->value.u_array, VALUE_ARRAY, going);
+
+		if (0 != (mask & it->last[d]))
+		{
+			it->pending = mask & it->last[d];
+			it->value = v;
+
+			return JSON_QUERY_MATCH;
+		}
+	}
+
+	return JSON_QUERY_DONE;
+}
+
+/*
+ * Which of the queries in F are after the member called NAME
+ * (a span of the input, which may hold escapes) or the I'th
+ * element.
+ */
+static uint64_t
+query_match_raw(json_query_iter_t *it, json_query_frame_t *f, const char *name, size_t len, int i)
+{
+	const json_query_step_t *st;
+	int d = it->depth - 1;
+	uint64_t m = f->alive & it->wild[d];
+	uint64_t rest;
+	int q;
+
+	for (rest = f->alive & ~m; rest; rest &= rest - 1)
+	{
+		q = __builtin_ctzll(rest);
+		st = QUERY_STEP(it, q, d);
+
+		if (VALUE_ARRAY == f->type
+		? st->index == i
+		: name_is(name, len, st->key, st->len))
+			m |= QUERY_BIT(q);
+	}
+
+	return m;
+}
+
+static int
+query_next_raw(json_query_iter_t *it)
+{
+	json_scanner_t *sc = &it->scanner;
+	json_query_frame_t *f;
+	uint64_t mask;
+	uint64_t going;
+	size_t k;
+	size_t q;
+	size_t v;
+	int type;
+	int d;
+
+	while (it->depth > 0)
+	{
+		f = &it->frames[it->depth - 1];
+		d = it->depth - 1;
+
+		k = scanner_next(sc);
+		if (k >= sc->len)
+			return JSON_QUERY_ERROR;
+
+		if (COMMA == AT(sc, k))
+			continue;
+
+	/*
+	 * The end of a container, which may be a match itself.
+	 */
+		if ((VALUE_OBJECT == f->type ? RBRACE : RBRACK) == AT(sc, k))
+		{
+			--it->depth;
+
+			if (0 == f->whole)
+				continue;
+
+			memset(&it->item, 0, sizeof(it->item));
+			it->item.type = f->type;
+			it->item.s = sc->buf + f->start;
+			it->item.len = k - f->start + 1;
+			it->pending = f->whole;
+
+			return JSON_QUERY_MATCH;
+		}
+
+		if (VALUE_OBJECT == f->type)
+		{
+			if (DQUOTE != AT(sc, k))
+				return JSON_QUERY_ERROR;
+
+			q = scanner_next(sc);
+			v = scanner_next(sc);
+
+			if (v < sc->len && COLON == AT(sc, v))
+				v = scanner_next(sc);
+
+			if (q >= sc->len || v >= sc->len)
+				return JSON_QUERY_ERROR;
+
+			mask = query_match_raw(it, f, sc->buf + k + 1, q - k - 1, 0);
+		}
+		else
+		{
+			v = k;
+			mask = query_match_raw(it, f, NULL, 0, f->next++);
+		}
+
+		if (0 == mask)
+		{
+			if (skip_value(sc, v) < 0)
+				return JSON_QUERY_ERROR;
+
+			continue;
+		}
+
+		going = mask & ~it->last[d];
+		type = LBRACE == AT(sc, v) ? VALUE_OBJECT : LBRACK == AT(sc, v) ? VALUE_ARRAY : -1;
+
+		if (0 != going && type >= 0)
+		{
+			query_push(it, NULL, type, going);
+			it->frames[it->depth - 1].start = v;
+			it->frames[it->depth - 1].whole = mask & it->last[d];
+
+			continue;
+		}
+
+		if (JSON_FIND_OK != found_item(sc, v, &it->item))
+			return JSON_QUERY_ERROR;
+
+		if (0 != (mask & it->last[d]))
+		{
+			it->pending = mask & it->last[d];
+
+			return JSON_QUERY_MATCH;
+		}
+	}
+
+	return JSON_QUERY_DONE;
+}
+
+/**
+ * Fill in M with the next match: QUERY is which of the
+ * iterator's queries it is for and, over a parsed document,
+ * VALUE is the value matched, or over raw input ITEM is, as
+ * from JSON_ondemand_find(). A value that several queries
+ * match comes back once for each. Returns JSON_QUERY_MATCH,
+ * JSON_QUERY_DONE once there are no more, or JSON_QUERY_ERROR
+ * if the raw input turns out to be malformed, after which
+ * there are no more either.
+ */
+int
+JSON_query_next(json_query_iter_t *it, json_match_t *m)
+{
+	int r;
+
+	assert(it);
+	assert(m);
+
+	if (it->error)
+	{
+		it->error = 0;
+		return JSON_QUERY_ERROR;
+	}
+
+	if (0 == it->pending)
+	{
+		r = NULL != it->json ? query_next_tree(it) : query_next_raw(it);
+
+		if (JSON_QUERY_ERROR == r)
+			it->depth = 0;
+
+		if (JSON_QUERY_MATCH != r)
+			return r;
+	}
+
+	m->query = __builtin_ctzll(it->pending);
+	it->pending &= it->pending - 1;
+
+	if (NULL != it->json)
+	{
+		m->value = it->value;
+		memset(&m->item, 0, sizeof(m->item));
+	}
+	else
+	{
+		m->value = NULL;
+		m->item = it->item;
+	}
+
+	return JSON_QUERY_MATCH;
+}
+
+/*
+ * Schema-driven decoding of flat objects of a known shape.
+ * The fields' names are measured and hashed once, up front.
+ * Decoding then walks the text directly: each key is first
+ * tried against the field that should come next, which in
+ * practice is nearly always right and costs one memcmp(),
+ * and only otherwise looked up by hash. Values go straight
+ * into the caller's struct. Anything the fast path doesn't
+ * expect (an unknown, missing or repeated key, a value of
+ * the wrong type, an escaped key, a nested value, a string
+ * too long for its array) makes it give up, and the
+ * document is parsed the ordinary way.
+ */
+#define SCHEMA_FIELDS_MAX 64
+
+typedef struct JSON_Schema_Field
+{
+	const char *name;
+	size_t name_len;
+	unsigned int hash;
+	int type;
+	size_t offset;
+	size_t size;
+} json_schema_field_t;
+
+struct JSON_Schema
+{
+	int nr_fields;
+	uint64_t all;
+	json_schema_field_t fields[];
+};
+
+/**
+ * Compile the NR fields at FIELDS into a schema for
+ * JSON_parse_schema(). Returns %NULL if there are too many
+ * fields, two with the same name, or a type or size that
+ * can't be decoded into.
+ */
+json_schema_t *
+JSON_schema_new(const json_field_t *fields, int nr)
+{
+	json_schema_t *sc;
+	json_schema_field_t *f;
+	size_t need;
+	int i;
+	int j;
+
+	assert(fields || 0 == nr);
+
+	if (nr < 0 || nr > SCHEMA_FIELDS_MAX)
+		return NULL;
+
+	sc = malloc(sizeof(json_schema_t) + nr * sizeof(json_schema_field_t));
+	if (NULL == sc)
+		return NULL;
+
+	sc->nr_fields = nr;
+	sc->all = nr == SCHEMA_FIELDS_MAX ? ~0ULL : (1ULL << nr) - 1;
+
+	for (i = 0; i < nr; ++i)
+	{
+		f = &sc->fields[i];
+		f->name = fields[i].name;
+		f->name_len = strlen(f->name);
+		f->hash = hash_name(f->name, f->name_len);
+		f->type = fields[i].type;
+		f->offset = fields[i].offset;
+		f->size = fields[i].size;
+
+		switch(f->type)
+		{
+			case VALUE_STRING:
+				need = 1;
+				break;
+
+			case VALUE_NUMBER:
+				need = f->size == sizeof(long long) ? f->size : 0;
+				break;
+
+			case VALUE_DOUBLE:
+				need = f->size == sizeof(double) ? f->size : 0;
+				break;
+
+			case VALUE_BOOLEAN:
+				need = f->size == sizeof(int) ? f->size : 0;
+				break;
+
+			default:
+				need = 0;
+				break;
+		}
+
+		if (0 == need || f->size < need)
+			goto fail;
+
+		for (j = 0; j < i; ++j)
+		{
+			if (sc->fields[j].name_len == f->name_len
+			&& !memcmp(sc->fields[j].name, f->name, f->name_len))
+				goto fail;
+		}
+	}
+
+	return sc;
+
+fail:
+	free(sc);
+	return NULL;
+}
+
+void
+JSON_schema_free(json_schema_t *sc)
+{
+	free(sc);
+}
+
+#define SKIP_BLANKS(s, e) \
+do { \
+	while ((s) < (e) && IS_BLANK(*(s))) \
+		++(s); \
+} while (0)
+
+/*
+ * The closing quote of the string whose contents begin at S:
+ * the first quote not preceded by an odd run of backslashes.
+ */
+static const char *
+schema_string_end(const char *s, const char *e, int *escaped)
+{
+	const char *start = s;
+	const char *q;
+	const char *b;
+
+	for (;;)
+	{
+		q = memchr(s, DQUOTE, e - s);
+		if (NULL == q)
+			return NULL;
+
+		for (b = q; b > start && BSLASH == b[-1]; --b)
+			;
+
+		if (0 == ((q - b) & 1))
+		{
+			*escaped = NULL != memchr(start, BSLASH, q - start);
+			return q;
+		}
+
+		s = q + 1;
+	}
+}
+
+static const char *
+schema_value(const json_schema_field_t *f, const char *s, const char *e, char *rec)
+{
+	json_number_t num;
+	const char *q;
+	int escaped;
+
+	switch(f->type)
+	{
+		case VALUE_STRING:
+
+			if (s >= e || DQUOTE != *s)
+				return NULL;
+
+			q = schema_string_end(++s, e, &escaped);
+			if (NULL == q || (size_t)(q - s) >= f->size)
+				return NULL;
+
+			if (escaped)
+			{
+				rec[f->offset + unescape(rec + f->offset, s, q - s)] = 0;
+			}
+			else
+			{
+				memcpy(rec + f->offset, s, q - s);
+				rec[f->offset + (q - s)] = 0;
+			}
+
+			return q + 1;
+
+		case VALUE_NUMBER:
+		case VALUE_DOUBLE:
+
+			if (read_number(s, e, 1, &num, &q) < 0)
+				return NULL;
+
+			if (VALUE_NUMBER == f->type)
+			{
+				if (VALUE_NUMBER != num.type || (num.flags & JSON_F_UNSIGNED))
+					return NULL;
+
+				*(long long *)(rec + f->offset) = num.u.i;
+			}
+			else
+			{
+				if (VALUE_DOUBLE == num.type)
+					*(double *)(rec + f->offset) = num.u.d;
+				else
+				if (num.flags & JSON_F_UNSIGNED)
+					*(double *)(rec + f->offset) = (double)num.u.u;
+				else
+					*(double *)(rec + f->offset) = (double)num.u.i;
+			}
+
+			return q;
+
+		case VALUE_BOOLEAN:
+
+			if (e - s >= 4 && !memcmp(s, "true", 4))
+			{
+				*(int *)(rec + f->offset) = TRUE;
+				return s + 4;
+			}
+
+			if (e - s >= 5 && !memcmp(s, "false", 5))
+			{
+				*(int *)(rec + f->offset) = FALSE;
+				return s + 5;
+			}
+
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * The fast path: 0 if the LEN bytes at S are exactly an
+ * object with the schema's fields and REC is filled in.
+ */
+static int
+schema_match(const json_schema_t *sc, const char *s, size_t len, char *rec)
+{
+	const json_schema_field_t *f;
+	const char *e = s + len;
+	const char *q;
+	uint64_t seen = 0;
+	unsigned int h;
+	int escaped;
+	int next = 0;
+	int i;
+
+	SKIP_BLANKS(s, e);
+	if (s >= e || LBRACE != *s)
+		return -1;
+
+	++s;
+	SKIP_BLANKS(s, e);
+
+	if (s < e && RBRACE == *s && 0 == sc->nr_fields)
+	{
+		++s;
+		goto end;
+	}
+
+	for (;;)
+	{
+		if (s >= e || DQUOTE != *s)
+			return -1;
+
+		q = schema_string_end(++s, e, &escaped);
+		if (NULL == q || escaped)
+			return -1;
+
+		f = NULL;
+
+		if (next < sc->nr_fields
+		&& sc->fields[next].name_len == (size_t)(q - s)
+		&& !memcmp(sc->fields[next].name, s, q - s))
+		{
+			f = &sc->fields[next];
+		}
+		else
+		{
+			h = hash_name(s, q - s);
+
+			for (i = 0; i < sc->nr_fields; ++i)
+			{
+				if (sc->fields[i].hash == h
+				&& sc->fields[i].name_len == (size_t)(q - s)
+				&& !memcmp(sc->fields[i].name, s, q - s))
+				{
+					f = &sc->fields[i];
+					break;
+				}
+			}
+		}
+
+		if (NULL == f)
+			return -1;
+
+		i = f - sc->fields;
+		if (seen & (1ULL << i))
+			return -1;
+
+		seen |= 1ULL << i;
+		next = i + 1;
+
+		s = q + 1;
+		SKIP_BLANKS(s, e);
+		if (s >= e || COLON != *s)
+			return -1;
+
+		++s;
+		SKIP_BLANKS(s, e);
+
+		s = schema_value(f, s, e, rec);
+		if (NULL == s)
+			return -1;
+
+		SKIP_BLANKS(s, e);
+		if (s >= e)
+			return -1;
+
+		if (RBRACE == *s)
+		{
+			++s;
+			break;
+		}
+
+		if (COMMA != *s)
+			return -1;
+
+		++s;
+		SKIP_BLANKS(s, e);
+	}
+
+end:
+	SKIP_BLANKS(s, e);
+
+	return s == e && seen == sc->all ? 0 : -1;
+}
+
+/**
+ * Decode the LEN bytes at BUF into the struct at REC using
+ * the schema SC. If the document doesn't have the schema's
+ * shape, REC is left in an undefined state and, if DOCP isn't
+ * %NULL, the document is parsed as by JSON_parse_n() into
+ * *DOCP instead. Returns JSON_SCHEMA_OK if REC was filled in,
+ * JSON_SCHEMA_FALLBACK if it wasn't (with *DOCP the
+ * document, if asked for), or JSON_SCHEMA_ERROR if it
+ * doesn't parse either way.
+ */
+int
+JSON_parse_schema(const json_schema_t *sc, const char *buf, size_t len, void *rec, json_t **docp)
+{
+	assert(sc);
+	assert(buf);
+	assert(rec);
+
+	if (0 == schema_match(sc, buf, len, rec))
+		return JSON_SCHEMA_OK;
+
+	if (NULL == docp)
+		return JSON_SCHEMA_FALLBACK;
+
+	*docp = JSON_parse_n(buf, len);
+
+	return NULL == *docp ? JSON_SCHEMA_ERROR : JSON_SCHEMA_FALLBACK;
+}
+
+/*
+ * Incremental parsing. Each chunk is lexed where it lies;
+ * the only copying is of a token that straddles the end of
+ * one chunk and the start of the next, which is stitched
+ * together in the carry buffer and parsed on its own
+ * before we go on with the rest of the new chunk.
+ */
+static int
+carry_append(json_parser_t *ctx, const char *s, size_t len)
+{
+	if (ctx->carry_len + len > ctx->carry_alloc)
+	{
+		size_t n = ctx->carry_alloc ? ctx->carry_alloc : 256;
+		char *c;
+
+		while (n < ctx->carry_len + len)
+			n *= 2;
+
+		c = mem_realloc(&ctx->mem, ctx->carry, n);
+		if (NULL == c)
+			return PARSE_ERROR;
+
+		STAT_ADD(&ctx->stats, nr_reallocs, ctx->carry_alloc > 0);
+		ctx->carry = c;
+		ctx->carry_alloc = n;
+	}
+
+	memcpy(ctx->carry + ctx->carry_len, s, len);
+	ctx->carry_len += len;
+
+	return PARSE_OK;
+}
+
+/*
+ * Move as much of CHUNK into the carry buffer as it takes
+ * to finish the token there, setting *USED to the number of
+ * bytes that took. Returns PARSE_OK if the token is now
+ * whole and PARSE_MORE if it isn't yet.
+ */
+static int
+carry_complete(json_parser_t *ctx, const char *chunk, size_t len, size_t *used)
+{
+	const char *e = chunk + len;
+	const char *p = chunk;
+	const char *q;
+	const char *b;
+	size_t run;
+	size_t n;
+
+	if (DQUOTE != ctx->carry[0])
+	{
+		for (n = 0; n < len && !IS_DELIM(chunk[n]); ++n)
+			;
+
+		*used = n;
+		if (PARSE_OK != carry_append(ctx, chunk, n))
+			return PARSE_ERROR;
+
+		return n < len ? PARSE_OK : PARSE_MORE;
+	}
+
+/*
+ * A quote only closes the string if it follows an even
+ * number of backslashes, and the run may have begun
+ * before this chunk did.
+ */
+	while (p < e && NULL != (q = memchr(p, DQUOTE, e - p)))
+	{
+		for (b = q; b > chunk && b[-1] == BSLASH; --b)
+			;
+
+		run = q - b;
+
+		if (b == chunk)
+		{
+			for (n = ctx->carry_len; n > 1 && ctx->carry[n-1] == BSLASH; --n)
+				++run;
+		}
+
+		if (0 == (run & 1))
+		{
+			*used = q - chunk + 1;
+
+			return carry_append(ctx, chunk, *used);
+		}
+
+		p = q + 1;
+	}
+
+	*used = len;
+	if (PARSE_OK != carry_append(ctx, chunk, len))
+		return PARSE_ERROR;
+
+	return PARSE_MORE;
+}
+
+/*
+ * Parse BUF, stashing anything cut off at its end.
+ */
+static int
+stream_run(json_parser_t *ctx, const char *buf, size_t len, int final)
+{
+	int r;
+
+	parser_input(ctx, buf, len, final);
+	r = parse_run(ctx);
+
+	if (PARSE_MORE == r)
+	{
+		size_t left = ctx->end - ctx->tok;
+
+		ctx->carry_len = 0;
+
+		return carry_append(ctx, ctx->tok, left);
+	}
+
+	return r;
+}
+
+static int
+stream_status(json_parser_t *ctx, int r)
+{
+	if (PARSE_ERROR == r || PARSE_ABORT == r)
+	{
+		JSON_free(ctx->doc);
+		ctx->doc = NULL;
+
+		return JSON_STREAM_ERROR;
+	}
+
+	return ctx->done ? JSON_STREAM_DONE : JSON_STREAM_MORE;
+}
+
+/**
+ * Start building a new document from input that will be
+ * handed over in pieces through JSON_stream_feed(). The
+ * chunks needn't outlive the calls that pass them in, so
+ * JSON_OPT_ZERO_COPY and JSON_OPT_IN_PLACE are ignored.
+ */
+int
+JSON_stream_begin(json_parser_t *ctx, int flags)
+{
+	assert(ctx);
+
+	if (NULL != ctx->doc)
+		JSON_free(ctx->doc);
+
+	parser_reset(ctx, NULL, 0, flags & ~(JSON_OPT_ZERO_COPY | JSON_OPT_IN_PLACE));
+	ctx->final = 0;
+
+	if (NULL == new_document(ctx, 0))
+		return JSON_STREAM_ERROR;
+
+	return JSON_STREAM_MORE;
+}
+
+/**
+ * Parse the next LEN bytes of the document. Tokens may be
+ * split anywhere between one chunk and the next. Returns
+ * JSON_STREAM_MORE until the closing brace of the document
+ * has been seen, then JSON_STREAM_DONE; JSON_STREAM_ERROR
+ * if the input is not JSON.
+ */
+int
+JSON_stream_feed(json_parser_t *ctx, const char *chunk, size_t len)
+{
+	size_t used = 0;
+	int r;
+
+	assert(ctx);
+
+	if (NULL == ctx->doc)
+		return JSON_STREAM_ERROR;
+
+	if (ctx->done)
+		return JSON_STREAM_DONE;
+
+	if (ctx->carry_len > 0)
+	{
+		r = carry_complete(ctx, chunk, len, &used);
+		if (PARSE_MORE == r)
+			return JSON_STREAM_MORE;
+
+		if (PARSE_OK != r)
+			return stream_status(ctx, r);
+
+		len -= used;
+		chunk += used;
+
+		r = stream_run(ctx, ctx->carry, ctx->carry_len, 1);
+		ctx->carry_len = 0;
+
+		if (PARSE_OK != r)
+			return stream_status(ctx, r);
+	}
+
+	r = stream_run(ctx, chunk, len, 0);
+
+	return stream_status(ctx, r);
+}
+
+/**
+ * No more input is coming: hand over the finished document,
+ * or %NULL if what was fed in doesn't amount to one.
+ */
+json_t *
+JSON_stream_end(json_parser_t *ctx)
+{
+	json_t *jn;
+	int r = PARSE_OK;
+
+	assert(ctx);
+
+	if (NULL == ctx->doc)
+		return NULL;
+
+	if (!ctx->done && ctx->carry_len > 0)
+	{
+		char *c = ctx->carry;
+		size_t n = ctx->carry_len;
+
+		ctx->carry_len = 0;
+		parser_input(ctx, c, n, 1);
+		r = parse_run(ctx);
+	}
+
+	jn = ctx->doc;
+	ctx->doc = NULL;
+
+	if (!ctx->done || PARSE_ERROR == r)
+	{
+		JSON_free(jn);
+		return NULL;
+	}
+
+	return jn;
+}
+
+/*
+ * Decode an escaped view the first time it is asked for, and
+ * keep the result in place of the view so it's done only once.
+ */
+static char *
+decode_view(json_t *json, char *s, size_t *lenp)
+{
+	char *p = arena_alloc(&json->arena, *lenp + 1);
+
+	if (NULL == p)
+		return NULL;
+
+	*lenp = unescape(p, s, *lenp);
+	p[*lenp] = 0;
+
+	return p;
+}
+
+/**
+ * Get the name of V and its length. Outside of zero-copy
+ * mode it is also NUL-terminated; inside, it is only
+ * guaranteed to be so if it contained escape sequences.
+ */
+const char *
+JSON_name(json_t *json, json_value_t *v, size_t *len)
+{
+	assert(json);
+	assert(v);
+
+	if (v->flags & JSON_F_NAME_ESCAPED)
+	{
+		char *p = decode_view(json, v->name, &v->name_len);
+
+		if (NULL == p)
+			return NULL;
+
+		v->name = p;
+		v->flags &= ~JSON_F_NAME_ESCAPED;
+	}
+
+	if (NULL != len)
+		*len = v->name_len;
+
+	return v->name;
+}
+
+/**
+ * Get the string value of V and its length, with the same
+ * termination rules as JSON_name().
+ */
+const char *
+JSON_string(json_t *json, json_value_t *v, size_t *len)
+{
+	assert(json);
+	assert(v);
+
+	if (VALUE_STRING != v->type)
+		return NULL;
+
+	if (v->flags & JSON_F_STRING_ESCAPED)
+	{
+		char *p = decode_view(json, v->value.u_string, &v->len);
+
+		if (NULL == p)
+			return NULL;
+
+		v->value.u_string = p;
+		v->flags &= ~JSON_F_STRING_ESCAPED;
+	}
+
+	if (NULL != len)
+		*len = v->len;
+
+	return v->value.u_string;
+}
+
+/*
+ * Convert a number left as text by JSON_OPT_LAZY_NUMBERS,
+ * keeping the result in place of the text. An integer too
+ * big even for an unsigned long long becomes a VALUE_DOUBLE.
+ */
+static void
+number_value(json_value_t *v)
+{
+	const char *s = v->value.u_string;
+	json_number_t num;
+	const char *p;
+
+	if (!(v->flags & JSON_F_NUMBER_RAW))
+		return;
+
+/*
+ * The text was checked when it was parsed.
+ */
+	read_number(s, s + v->len, 1, &num, &p);
+
+	v->type = num.type;
+	v->flags = (v->flags & ~JSON_F_NUMBER_RAW) | num.flags;
+	v->len = 0;
+
+	if (VALUE_DOUBLE == num.type)
+		v->value.u_double = num.u.d;
+	else
+		v->value.u_ulong = num.u.u;
+}
+
+/**
+ * Get the number V as a long long, converting it if it was
+ * parsed lazily; doubles are truncated. 0 if V isn't a number.
+ */
+long long
+JSON_integer(json_t *json, json_value_t *v)
+{
+	assert(json);
+	assert(v);
+
+	number_value(v);
+
+	if (VALUE_NUMBER == v->type)
+		return v->value.u_long;
+
+	if (VALUE_DOUBLE == v->type)
+		return (long long)v->value.u_double;
+
+	return 0;
+}
+
+/**
+ * Get the number V as a double, converting it if it was
+ * parsed lazily. 0 if V isn't a number.
+ */
+double
+JSON_double(json_t *json, json_value_t *v)
+{
+	assert(json);
+	assert(v);
+
+	number_value(v);
+
+	if (VALUE_DOUBLE == v->type)
+		return v->value.u_double;
+
+	if (VALUE_NUMBER == v->type)
+		return v->flags & JSON_F_UNSIGNED ? (double)v->value.u_ulong : (double)v->value.u_long;
+
+	return 0;
+}
+
+/**
+ * The text of the number V as it was in the input, if it
+ * hasn't been converted yet, so that it can be passed on
+ * without ever being. With JSON_OPT_ZERO_COPY it is a view
+ * into the input and not terminated. %NULL otherwise.
+ */
+const char *
+JSON_number_text(json_t *json, json_value_t *v, size_t *len)
+{
+	assert(json);
+	assert(v);
+
+	if (!(v->flags & JSON_F_NUMBER_RAW))
+		return NULL;
+
+	if (NULL != len)
+		*len = v->len;
+
+	return v->value.u_string;
+}
+
+/*
+ * Building the flat tape. This is another handler for the
+ * same grammar, but keeps none of the tree's node/value
+ * machinery: entries go straight onto one growing array,
+ * and the only bookkeeping is the begin entries of the
+ * containers we're inside, in TAPE_OPEN.
+ */
+#define TAPE_PARENT(ctx) TAPE_ENTRY((ctx)->tp, (ctx)->frames[(ctx)->depth-1].tape_open)
+#define TAPE_GUESS_MAX 4096
+
+/*
+ * A tape keeps the allocator it was built with, and gives
+ * everything back to it when freed.
+ */
+static json_tape_t *
+tape_new(const json_allocator_t *mem)
+{
+	json_tape_t *tp = mem_alloc(mem, sizeof(json_tape_t));
+
+	if (NULL == tp)
+		return NULL;
+
+	memset(tp, 0, sizeof(*tp));
+	tp->mem = *mem;
+
+	return tp;
+}
+
+static json_tape_entry_t *
+tape_push(json_parser_t *ctx, int type)
+{
+	json_tape_entry_t *e;
+
+	if (ctx->tp->nr_entries == ctx->tp->nr_alloc)
+	{
+		size_t n = GROW_CAPACITY(ctx->tp->nr_alloc);
+
+		e = mem_realloc(&ctx->tp->mem, ctx->tp->entries, n * sizeof(json_tape_entry_t));
+		if (NULL == e)
+			return NULL;
+
+		STAT_ADD(&ctx->stats, nr_reallocs, ctx->tp->nr_alloc > 0);
+		ctx->tp->entries = e;
+		ctx->tp->nr_alloc = n;
+	}
+
+	e = &ctx->tp->entries[ctx->tp->nr_entries++];
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+
+	return e;
+}
+
+/*
+ * LEN of an array is its number of elements and
+ * of an object its number of keys.
+ */
+static void
+tape_count_value(json_parser_t *ctx)
+{
+	if (ctx->depth > 0 && !IN_OBJECT(ctx))
+		++TAPE_PARENT(ctx)->len;
+}
+
+/*
+ * Views that need no decoding are left in the input when
+ * zero-copy was asked for; the rest are decoded into the
+ * pool, NUL-terminated. Returns -1 if we run out of memory.
+ */
+static int
+tape_string(json_parser_t *ctx, int type, const char *str, size_t len, int escaped)
+{
+	json_tape_entry_t *e = tape_push(ctx, type);
+	size_t need;
+
+	if (NULL == e)
+		return -1;
+
+	if ((ctx->flags & JSON_OPT_ZERO_COPY) && !escaped)
+	{
+		e->flags = JSON_TAPE_F_INPUT;
+		e->u.off = str - ctx->tp->input;
+		e->len = len;
+
+		return 0;
+	}
+
+	STAT_SAMPLED(ctx, t);
+
+	need = ctx->tp->strings_len + len + 1;
+	if (need > ctx->tp->strings_alloc)
+	{
+		size_t n = ctx->tp->strings_alloc ? ctx->tp->strings_alloc : 256;
+		char *s;
+
+		while (n < need)
+			n *= 2;
+
+		s = mem_realloc(&ctx->tp->mem, ctx->tp->strings, n);
+		if (NULL == s)
+			return -1;
+
+		STAT_ADD(&ctx->stats, nr_reallocs, ctx->tp->strings_alloc > 0);
+		ctx->tp->strings = s;
+		ctx->tp->strings_alloc = n;
+	}
+
+	e->u.off = ctx->tp->strings_len;
+
+	if (escaped)
+		e->len = unescape(ctx->tp->strings + e->u.off, str, len);
+	else
+	{
+		memcpy(ctx->tp->strings + e->u.off, str, len);
+		e->len = len;
+	}
+
+	ctx->tp->strings[e->u.off + e->len] = 0;
+	ctx->tp->strings_len += e->len + 1;
+
+	STAT_TIME_IN(&ctx->stats, JSON_PHASE_STRING, JSON_PHASE_BUILD, t);
+
+	return 0;
+}
+
+static int
+tape_begin(json_parser_t *ctx, int type)
+{
+	tape_count_value(ctx);
+
+	ctx->frames[ctx->depth].tape_open = ctx->tp->nr_entries;
+
+	return NULL != tape_push(ctx, type) ? 0 : -1;
+}
+
+static int
+tape_end(json_parser_t *ctx, int type)
+{
+	size_t top = ctx->frames[ctx->depth-1].tape_open;
+	json_tape_entry_t *e = tape_push(ctx, type);
+
+	if (NULL == e)
+		return -1;
+
+	e->u.match = top;
+	TAPE_ENTRY(ctx->tp, top)->u.match = ctx->tp->nr_entries - 1;
+
+	return 0;
+}
+
+static int
+tape_object_begin(void *user)
+{
+	return tape_begin(user, VALUE_OBJECT);
+}
+
+static int
+tape_object_end(void *user)
+{
+	return tape_end(user, TAPE_OBJECT_END);
+}
+
+static int
+tape_array_begin(void *user)
+{
+	return tape_begin(user, VALUE_ARRAY);
+}
+
+static int
+tape_array_end(void *user)
+{
+	return tape_end(user, TAPE_ARRAY_END);
+}
+
+static int
+tape_key(void *user, const char *s, size_t len, int escaped)
+{
+	json_parser_t *ctx = user;
+
+	if (tape_string(ctx, TAPE_KEY, s, len, escaped) < 0)
+		return -1;
+
+	++TAPE_PARENT(ctx)->len;
+
+	return 0;
+}
+
+static int
+tape_string_value(void *user, const char *s, size_t len, int escaped)
+{
+	json_parser_t *ctx = user;
+
+	if (tape_string(ctx, VALUE_STRING, s, len, escaped) < 0)
+		return -1;
+
+	tape_count_value(ctx);
+
+	return 0;
+}
+
+static int
+tape_number(void *user, const char *s, size_t len, const json_number_t *num)
+{
+	json_parser_t *ctx = user;
+	json_tape_entry_t *e = tape_push(ctx, num->type);
+
+	(void)s;
+	(void)len;
+
+	if (NULL == e)
+		return -1;
+
+	if (VALUE_DOUBLE == num->type)
+		e->u.d = num->u.d;
+	else
+		e->u.u = num->u.u;
+
+	if (num->flags & JSON_F_UNSIGNED)
+		e->flags = JSON_TAPE_F_UNSIGNED;
+
+	tape_count_value(ctx);
+
+	return 0;
+}
+
+static int
+tape_bool(void *user, int b)
+{
+	json_parser_t *ctx = user;
+	json_tape_entry_t *e = tape_push(ctx, VALUE_BOOLEAN);
+
+	if (NULL == e)
+		return -1;
+
+	e->u.b = b;
+	tape_count_value(ctx);
+
+	return 0;
+}
+
+static int
+tape_null(void *user)
+{
+	json_parser_t *ctx = user;
+
+	if (NULL == tape_push(ctx, VALUE_NULL))
+		return -1;
+
+	tape_count_value(ctx);
+
+	return 0;
+}
+
+static const json_handler_t tape_handler =
+{
+	.on_object_begin = tape_object_begin,
+	.on_object_end = tape_object_end,
+	.on_array_begin = tape_array_begin,
+	.on_array_end = tape_array_end,
+	.on_key = tape_key,
+	.on_string = tape_string_value,
+	.on_number = tape_number,
+	.on_bool = tape_bool,
+	.on_null = tape_null
+};
+
+/**
+ * Parse the LEN bytes at BUF into a flat tape rather than a
+ * tree, using the state in CTX. FLAGS are the JSON_OPT_*
+ * options; with JSON_OPT_ZERO_COPY unescaped strings stay in
+ * BUF, which must then outlive the tape. The tape's memory
+ * comes from CTX's allocator. Returns %NULL if BUF isn't a
+ * document or the allocator refuses.
+ */
+json_tape_t *
+JSON_parse_tape_ctx(json_parser_t *ctx, const char *buf, size_t len, int flags)
+{
+	json_tape_t *tp;
+	int r;
+
+	assert(ctx);
+	assert(buf);
+
+/*
+ * Tape entries have nowhere to keep a number's
+ * text, so numbers are always converted.
+ */
+	parser_reset(ctx, buf, len, flags & ~JSON_OPT_LAZY_NUMBERS);
+
+	ctx->handler = &tape_handler;
+
+	ctx->tp = tape_new(&ctx->mem);
+	if (NULL == ctx->tp)
+		return NULL;
+
+	ctx->tp->input = buf;
+
+/*
+ * A guess at one entry per eight bytes of input saves
+ * most of the early regrowth. It is only a guess, and
+ * wrong by far for a document that is mostly long
+ * strings, so past TAPE_GUESS_MAX entries growing has
+ * to show the room is needed before it is taken.
+ */
+	ctx->tp->nr_alloc = (ctx->end - ctx->ptr) / 8 + CAPACITY_MIN;
+	if (ctx->tp->nr_alloc > TAPE_GUESS_MAX)
+		ctx->tp->nr_alloc = TAPE_GUESS_MAX;
+
+	ctx->tp->entries = mem_alloc(&ctx->mem, ctx->tp->nr_alloc * sizeof(json_tape_entry_t));
+
+	r = NULL != ctx->tp->entries ? parse_whole(ctx) : PARSE_ERROR;
+
+	tp = ctx->tp;
+	ctx->tp = NULL;
+
+	if (PARSE_DONE != r)
+	{
+		JSON_tape_free(tp);
+		return NULL;
+	}
+
+	return tp;
+}
+
+json_tape_t *
+JSON_parse_tape(char *json_data, int flags)
+{
+	json_parser_t ctx;
+	json_tape_t *tp;
+
+	assert(json_data);
+	parser_init(&ctx);
+	tp = JSON_parse_tape_ctx(&ctx, json_data, strlen(json_data), flags);
+	parser_release(&ctx);
+
+	return tp;
+}
+
+void
+JSON_tape_free(json_tape_t *tape)
+{
+	assert(tape);
+
+	if (NULL != tape->map)
+	{
+		munmap(tape->map, tape->map_len);
+	}
+	else
+	{
+		mem_free(&tape->mem, tape->entries);
+		mem_free(&tape->mem, tape->strings);
+	}
+
+	mem_free(&tape->mem, tape);
+
+	return;
+}
+
+/**
+ * Index of the entry after the value at I, stepping over
+ * the whole subtree if I begins a container. For a TAPE_KEY
+ * that is the key's value.
+ */
+size_t
+JSON_tape_next(json_tape_t *tape, size_t i)
+{
+	json_tape_entry_t *e = TAPE_ENTRY(tape, i);
+
+	if (VALUE_OBJECT == e->type || VALUE_ARRAY == e->type)
+		return e->u.match + 1;
+
+	return i + 1;
+}
+
+const char *
+JSON_tape_string(json_tape_t *tape, size_t i, size_t *len)
+{
+	json_tape_entry_t *e = TAPE_ENTRY(tape, i);
+
+	if (VALUE_STRING != e->type && TAPE_KEY != e->type)
+		return NULL;
+
+	if (NULL != len)
+		*len = e->len;
+
+	if (e->flags & JSON_TAPE_F_INPUT)
+		return tape->input + e->u.off;
+
+	return tape->strings + e->u.off;
+}
+
+/*
+ * Serialising. Everything goes through a dumper that keeps
+ * the first error, so the writes themselves needn't be
+ * checked. The sink's own buffer, when it is the growable
+ * kind, is the caller's and comes from realloc(); the only
+ * other thing allocated is the stack for a document nested
+ * deeper than DUMP_INLINE, and that comes from MEM, the
+ * document's allocator.
+ */
+#define SINK_SIZE_MIN 4096
+
+typedef struct JSON_Dumper
+{
+	json_sink_t *sk;
+	const json_allocator_t *mem;
+	int flags;
+	int depth;
+	int err;
+} json_dumper_t;
+
+/*
+ * Find the first byte in S that has to be escaped in a
+ * JSON string: a quote, a backslash or a control character.
+ */
+#if defined(__AVX2__)
+
+static size_t
+escape_scan(const char *s, size_t len)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i bslash = _mm256_set1_epi8('\\');
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	size_t i = 0;
+	__m256i v;
+	unsigned int m;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v)));
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+
+	while (i < len && (unsigned char)s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+		++i;
+
+	return i;
+}
+
+#elif defined(__SSE2__)
+
+static size_t
+escape_scan(const char *s, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	size_t i = 0;
+	__m128i v;
+	unsigned int m;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v)));
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+
+	while (i < len && (unsigned char)s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+		++i;
+
+	return i;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static size_t
+escape_scan(const char *s, size_t len)
+{
+	size_t i = 0;
+	uint8x16_t v;
+	uint8x16_t m;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = vld1q_u8((const uint8_t *)(s + i));
+		m = vorrq_u8(vorrq_u8(NEON_EQ(v, '"'), NEON_EQ(v, '\\')),
+			vcleq_u8(v, vdupq_n_u8(0x1f)));
+
+		if (vmaxvq_u8(m))
+			break;
+	}
+
+	while (i < len && (unsigned char)s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+		++i;
+
+	return i;
+}
+
+#else
+
+static size_t
+escape_scan(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && (unsigned char)s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+		++i;
+
+	return i;
+}
+
+#endif
+
+static int
+sink_grow(json_sink_t *sk, size_t n)
+{
+	size_t size = sk->size ? sk->size : SINK_SIZE_MIN;
+	char *b;
+
+/*
+ * One spare byte for the terminating NUL.
+ */
+	while (size < sk->len + n + 1)
+		size *= 2;
+
+	b = realloc(sk->buf, size);
+	if (NULL == b)
+		return -1;
+
+	sk->buf = b;
+	sk->size = size;
+
+	return 0;
+}
+
+static void
+out_write(json_dumper_t *d, const char *s, size_t n)
+{
+	json_sink_t *sk = d->sk;
+
+	if (d->err)
+		return;
+
+	if (sk->len + n >= sk->size)
+	{
+		if (NULL == sk->flush)
+		{
+			if (sink_grow(sk, n) < 0)
+			{
+				d->err = -1;
+				return;
+			}
+		}
+		else
+		{
+			if (sk->len > 0 && 0 != sk->flush(sk->user, sk->buf, sk->len))
+			{
+				d->err = -1;
+				return;
+			}
+
+			sk->len = 0;
+
+		/*
+		 * Too big for the buffer at all, so it goes straight out.
+		 */
+			if (n >= sk->size)
+			{
+				if (0 != sk->flush(sk->user, s, n))
+					d->err = -1;
+
+				return;
+			}
+		}
+	}
+
+	memcpy(sk->buf + sk->len, s, n);
+	sk->len += n;
+}
+
+static inline void
+out_char(json_dumper_t *d, char c)
+{
+	if (d->sk->len + 1 < d->sk->size && !d->err)
+		d->sk->buf[d->sk->len++] = c;
+	else
+		out_write(d, &c, 1);
+}
+
+static void
+out_newline(json_dumper_t *d)
+{
+	int i;
+
+	if (!(d->flags & JSON_DUMP_PRETTY))
+		return;
+
+	out_char(d, NL);
+
+	for (i = 0; i < d->depth; ++i)
+		out_char(d, TAB);
+}
+
+static const char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static void
+out_ulong(json_dumper_t *d, unsigned long long u, int neg)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned int i;
+
+	while (u >= 100)
+	{
+		i = (u % 100) * 2;
+		u /= 100;
+
+		*--p = digit_pairs[i + 1];
+		*--p = digit_pairs[i];
+	}
+
+	if (u >= 10)
+	{
+		i = u * 2;
+
+		*--p = digit_pairs[i + 1];
+		*--p = digit_pairs[i];
+	}
+	else
+	{
+		*--p = '0' + u;
+	}
+
+	if (neg)
+		*--p = MINUS;
+
+	out_write(d, p, tmp + sizeof(tmp) - p);
+}
+
+static void
+out_long(json_dumper_t *d, long long i)
+{
+	if (i < 0)
+		out_ulong(d, 0 - (unsigned long long)i, 1);
+	else
+		out_ulong(d, i, 0);
+}
+
+/*
+ * The fewest digits that read back as the same double,
+ * and always something that reads back as a double rather
+ * than an integer. JSON has no infinities or NaNs.
+ */
+#define DOUBLE_INTEGRAL_MAX 1e15
+
+static void
+out_double(json_dumper_t *d, double x)
+{
+	char tmp[32];
+	locale_t old;
+	int prec;
+	int n;
+
+	if (!isfinite(x))
+	{
+		out_write(d, "null", 4);
+		return;
+	}
+
+/*
+ * The range comes first: a cast of anything that doesn't
+ * fit in a long long is undefined.
+ */
+	if (x != 0 && fabs(x) < DOUBLE_INTEGRAL_MAX && x == (double)(long long)x)
+	{
+		out_long(d, (long long)x);
+		out_write(d, ".0", 2);
+
+		return;
+	}
+
+/*
+ * Fifteen digits are always few enough to be exact and
+ * %g drops any trailing zeros, so this is the shortest
+ * form unless it takes sixteen or seventeen. Subnormals
+ * have fewer digits to them and are tried from one up.
+ * Both ways are in the C locale, or the point might be
+ * written and read as a comma.
+ */
+	prec = fabs(x) < DBL_MIN ? 1 : 15;
+	old = numeric_begin();
+
+	do
+	{
+		n = snprintf(tmp, sizeof(tmp), "%.*g", prec, x);
+	}
+	while (strtod(tmp, NULL) != x && ++prec <= 17);
+
+	numeric_end(old);
+
+	if (NULL == strpbrk(tmp, ".e"))
+	{
+		tmp[n++] = '.';
+		tmp[n++] = '0';
+	}
+
+	out_write(d, tmp, n);
+}
+
+/*
+ * ESCAPED strings are zero-copy views that still hold their
+ * escape sequences, so are already fit to go out as they are.
+ */
+static void
+out_string(json_dumper_t *d, const char *s, size_t len, int escaped)
+{
+	static const char hex[] = "0123456789abcdef";
+	char u[6] = { BSLASH, 'u', '0', '0' };
+	size_t n;
+
+	out_char(d, DQUOTE);
+
+	if (escaped)
+	{
+		out_write(d, s, len);
+		len = 0;
+	}
+
+	while (len > 0)
+	{
+		n = escape_scan(s, len);
+		out_write(d, s, n);
+
+		s += n;
+		len -= n;
+
+		if (0 == len)
+			break;
+
+		switch(*s)
+		{
+			case '"': out_write(d, "\\\"", 2); break;
+			case '\\': out_write(d, "\\\\", 2); break;
+			case '\b': out_write(d, "\\b", 2); break;
+			case '\f': out_write(d, "\\f", 2); break;
+			case '\n': out_write(d, "\\n", 2); break;
+			case '\r': out_write(d, "\\r", 2); break;
+			case '\t': out_write(d, "\\t", 2); break;
+
+			default:
+				u[4] = hex[(unsigned char)*s >> 4];
+				u[5] = hex[*s & 0xf];
+				out_write(d, u, sizeof(u));
+				break;
+		}
+
+		++s;
+		--len;
+	}
+
+	out_char(d, DQUOTE);
+}
+
+static void
+out_separator(json_dumper_t *d, int first)
+{
+	if (!first)
+		out_char(d, COMMA);
+
+	out_newline(d);
+}
+
+static void
+out_colon(json_dumper_t *d)
+{
+	out_char(d, COLON);
+
+	if (d->flags & JSON_DUMP_PRETTY)
+		out_char(d, SPACE);
+}
+
+static void
+out_close(json_dumper_t *d, int empty, char c)
+{
+	--d->depth;
+
+	if (!empty)
+		out_newline(d);
+
+	out_char(d, c);
+}
+
+static void
+dump_value(json_dumper_t *d, json_value_t *v)
+{
+	if (v->flags & JSON_F_NUMBER_RAW)
+	{
+		out_write(d, v->value.u_string, v->len);
+		return;
+	}
+
+	switch(v->type)
+	{
+		case VALUE_STRING:
+			out_string(d, v->value.u_string, v->len, v->flags & JSON_F_STRING_ESCAPED);
+			break;
+
+		case VALUE_NULL:
+			out_write(d, "null", 4);
+			break;
+
+		case VALUE_BOOLEAN:
+			if (v->value.u_boolean)
+				out_write(d, "true", 4);
+			else
+				out_write(d, "false", 5);
+			break;
+
+		case VALUE_NUMBER:
+			if (v->flags & JSON_F_UNSIGNED)
+				out_ulong(d, v->value.u_ulong, 0);
+			else
+				out_long(d, v->value.u_long);
+			break;
+
+		case VALUE_FLOAT:
+			out_double(d, v->value.u_float);
+			break;
+
+		case VALUE_DOUBLE:
+			out_double(d, v->value.u_double);
+			break;
+
+	/*
+	 * Containers are seen to by dump_tree().
+	 */
+		case VALUE_ARRAY:
+		case VALUE_OBJECT:
+			break;
+	}
+}
+
+/*
+ * Containers are walked with a stack of our own rather
+ * than by recursion, so however deep the document (see
+ * JSON_parser_set_max_depth()) it costs no C stack.
+ */
+#define DUMP_INLINE 32
+
+typedef struct JSON_Dump_Frame
+{
+	json_node_t *n;
+	int i;
+	int array;
+} json_dump_frame_t;
+
+static void
+dump_tree(json_dumper_t *d, json_node_t *root, int type)
+{
+	json_dump_frame_t frames_inline[DUMP_INLINE];
+	json_dump_frame_t *frames = frames_inline;
+	json_dump_frame_t *f;
+	json_value_t *v;
+	int nr_alloc = DUMP_INLINE;
+	int nr = 0;
+
+	for (;;)
+	{
+		if (nr == nr_alloc)
+		{
+			f = mem_alloc(d->mem, nr_alloc * 2 * sizeof(json_dump_frame_t));
+			if (NULL == f)
+			{
+				d->err = -1;
+				break;
+			}
+
+			memcpy(f, frames, nr * sizeof(json_dump_frame_t));
+			if (frames != frames_inline)
+				mem_free(d->mem, frames);
+
+			frames = f;
+			nr_alloc *= 2;
+		}
+
+		frames[nr].n = root;
+		frames[nr].i = 0;
+		frames[nr].array = VALUE_ARRAY == type;
+		++nr;
+
+		out_char(d, VALUE_ARRAY == type ? LBRACK : LBRACE);
+		++d->depth;
+
+	/*
+	 * Down to the next container, or back up
+	 * through every one that has run out.
+	 */
+		for (root = NULL; NULL == root && nr > 0 && !d->err; )
+		{
+			f = &frames[nr-1];
+
+			if (f->i == NVALS(f->n))
+			{
+				out_close(d, 0 == NVALS(f->n), f->array ? RBRACK : RBRACE);
+				--nr;
+				continue;
+			}
+
+			v = VALUE(f->n, f->i);
+
+			out_separator(d, 0 == f->i);
+			if (!f->array)
+			{
+				out_string(d, v->name, v->name_len, v->flags & JSON_F_NAME_ESCAPED);
+				out_colon(d);
+			}
+
+			++f->i;
+
+			if (VALUE_OBJECT == v->type || VALUE_ARRAY == v->type)
+			{
+				root = VALUE_ARRAY == v->type ? v->value.u_array : v->value.u_object;
+				type = v->type;
+			}
+			else
+			{
+				dump_value(d, v);
+			}
+		}
+
+		if (NULL == root)
+			break;
+	}
+
+	if (frames != frames_inline)
+		mem_free(d->mem, frames);
+}
+
+static void
+dumper_init(json_dumper_t *d, json_sink_t *sink, int flags, const json_allocator_t *mem)
+{
+	d->sk = sink;
+	d->mem = mem;
+	d->flags = flags;
+	d->depth = 0;
+	d->err = 0;
+}
+
+/*
+ * Hand what's left to a flushing sink, or terminate
+ * the contents of a growable one.
+ */
+static int
+dumper_finish(json_dumper_t *d)
+{
+	json_sink_t *sk = d->sk;
+
+	if (d->err)
+		return -1;
+
+	if (NULL != sk->flush)
+	{
+		if (sk->len > 0 && 0 != sk->flush(sk->user, sk->buf, sk->len))
+			return -1;
+
+		sk->len = 0;
+	}
+	else
+	{
+		if (sk->len + 1 > sk->size && sink_grow(sk, 1) < 0)
+			return -1;
+
+		sk->buf[sk->len] = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Write JSON out as JSON to SINK: minified, or indented with
+ * a tab per level if FLAGS has JSON_DUMP_PRETTY. Strings and
+ * numbers that are still as they were in the input (zero-copy
+ * escaped views, lazy numbers) are copied out untouched.
+ * Returns 0, or -1 if the sink couldn't take it, in which
+ * case some of the output may already have gone.
+ */
+int
+JSON_dump(json_t *json, json_sink_t *sink, int flags)
+{
+	json_dumper_t d;
+
+	assert(json);
+	assert(sink);
+
+	dumper_init(&d, sink, flags, &json->arena.mem);
+	dump_tree(&d, json->root, json->type);
+
+	return dumper_finish(&d);
+}
+
+/**
+ * As JSON_dump(), from a tape.
+ */
+int
+JSON_dump_tape(json_tape_t *tape, json_sink_t *sink, int flags)
+{
+	json_tape_entry_t *e;
+	json_dumper_t d;
+	const char *s;
+	int first = 1;
+	int after_key = 0;
+	size_t len = 0;
+	size_t i;
+
+	assert(tape);
+	assert(sink);
+
+	dumper_init(&d, sink, flags, &tape->mem);
+
+	for (i = 0; i < tape->nr_entries && !d.err; ++i)
+	{
+		e = TAPE_ENTRY(tape, i);
+
+		if (TAPE_OBJECT_END == e->type || TAPE_ARRAY_END == e->type)
+		{
+			out_close(&d, first, TAPE_OBJECT_END == e->type ? RBRACE : RBRACK);
+			first = 0;
+
+			continue;
+		}
+
+		if (after_key)
+			after_key = 0;
+		else
+		if (d.depth > 0)
+			out_separator(&d, first);
+
+		first = 0;
+
+		switch(e->type)
+		{
+			case TAPE_KEY:
+				s = JSON_tape_string(tape, i, &len);
+				out_string(&d, s, len, 0);
+				out_colon(&d);
+				after_key = 1;
+				break;
+
+			case VALUE_STRING:
+				s = JSON_tape_string(tape, i, &len);
+				out_string(&d, s, len, 0);
+				break;
+
+			case VALUE_OBJECT:
+			case VALUE_ARRAY:
+				out_char(&d, VALUE_OBJECT == e->type ? LBRACE : LBRACK);
+				++d.depth;
+				first = 1;
+				break;
+
+			case VALUE_NULL:
+				out_write(&d, "null", 4);
+				break;
+
+			case VALUE_BOOLEAN:
+				if (e->u.b)
+					out_write(&d, "true", 4);
+				else
+					out_write(&d, "false", 5);
+				break;
+
+			case VALUE_NUMBER:
+				if (e->flags & JSON_TAPE_F_UNSIGNED)
+					out_ulong(&d, e->u.u, 0);
+				else
+					out_long(&d, e->u.i);
+				break;
+
+			case VALUE_DOUBLE:
+				out_double(&d, e->u.d);
+				break;
+		}
+	}
+
+	return dumper_finish(&d);
+}
+
+/*
+ * Changing a document in place. Values go into and come out
+ * of their node's value array, which grows just as it does
+ * while parsing, and everything new comes from the document's
+ * arena; nothing taken out is freed before the document is.
+ * The member index is kept in step where it stands: a value
+ * added at the end is picked up by the lazy index as usual,
+ * and one added or taken out before the end has its own slot
+ * filled or emptied and the positions after it renumbered.
+ * That, like moving the values along, is linear in the width
+ * of the node, but nothing is hashed or compared again; at
+ * the end both are constant time.
+ */
+#define IS_CONTAINER(v) (VALUE_OBJECT == (v)->type || VALUE_ARRAY == (v)->type)
+#define VALUE_NODE(v) (VALUE_ARRAY == (v)->type ? (v)->value.u_array : (v)->value.u_object)
+
+/*
+ * Every position in the index of N past I moves by BY.
+ */
+static void
+index_shift(json_node_t *n, int i, int by)
+{
+	int slot;
+
+	for (slot = 0; slot < n->index_size; ++slot)
+	{
+		if (n->index[slot] > i + 1)
+			n->index[slot] += by;
+	}
+}
+
+/*
+ * The I'th value of N is about to go: if it is the one its
+ * name is indexed by, empty its slot, moving up whatever
+ * probed past it (the index is open addressing with linear
+ * probing, so there are no tombstones). Returns whether it
+ * was.
+ */
+static int
+index_delete(json_node_t *n, int i)
+{
+	json_value_t *v = VALUE(n, i);
+	unsigned int mask = n->index_size - 1;
+	unsigned int hole;
+	unsigned int home;
+	unsigned int slot;
+
+	for (hole = v->name_hash & mask; n->index[hole]; hole = (hole + 1) & mask)
+	{
+		if (SAME_NAME(VALUE(n, n->index[hole] - 1), v->name_hash, v->name, v->name_len))
+			break;
+	}
+
+	if (n->index[hole] != i + 1)
+		return 0;
+
+	for (slot = (hole + 1) & mask; n->index[slot]; slot = (slot + 1) & mask)
+	{
+		home = VALUE(n, n->index[slot] - 1)->name_hash & mask;
+
+		if (((slot - home) & mask) >= ((slot - hole) & mask))
+		{
+			n->index[hole] = n->index[slot];
+			hole = slot;
+		}
+	}
+
+	n->index[hole] = 0;
+
+	return 1;
+}
+
+static int
+node_insert(json_t *json, json_node_t *n, int i, json_value_t *v)
+{
+	assert(i >= 0 && i <= NVALS(n));
+
+	if (NVALS(n) == NALLOC(n)
+	&& node_reserve(&json->arena, n, GROW_CAPACITY(NALLOC(n))) < 0)
+		return -1;
+
+	memmove(&VALUE(n, i+1), &VALUE(n, i), (NVALS(n) - i) * sizeof(json_value_t *));
+	VALUE(n, i) = v;
+	++NVALS(n);
+
+	if (NULL == n->index || i >= n->nr_indexed)
+		return 0;
+
+/*
+ * Rather than let the index fill up, leave it
+ * to be built again, twice the size.
+ */
+	if ((n->nr_indexed + 1) * 2 > n->index_size)
+	{
+		n->index = NULL;
+		n->nr_indexed = 0;
+
+		return 0;
+	}
+
+	index_shift(n, i - 1, 1);
+	++n->nr_indexed;
+	index_insert(json, n, i);
+
+	return 0;
+}
+
+/*
+ * If the value taken out was the first of its name and
+ * there is another after it, that one is indexed instead.
+ */
+static json_value_t *
+node_remove(json_t *json, json_node_t *n, int i)
+{
+	json_value_t *v = VALUE(n, i);
+	int deleted = 0;
+	int j;
+
+	assert(i >= 0 && i < NVALS(n));
+
+	if (NULL != n->index && i < n->nr_indexed)
+		deleted = index_delete(n, i);
+
+	--NVALS(n);
+	memmove(&VALUE(n, i), &VALUE(n, i+1), (NVALS(n) - i) * sizeof(json_value_t *));
+
+	if (NULL == n->index || i >= n->nr_indexed)
+		return v;
+
+	if (i < NVALS(n))
+		index_shift(n, i, -1);
+
+	--n->nr_indexed;
+
+	for (j = i; deleted && j < n->nr_indexed; ++j)
+	{
+		if (SAME_NAME(VALUE(n, j), v->name_hash, v->name, v->name_len))
+		{
+			index_insert(json, n, j);
+			break;
+		}
+	}
+
+	return v;
+}
+
+/*
+ * V takes the name of the value it replaces, so
+ * the index has nothing to change.
+ */
+static json_value_t *
+node_replace(json_node_t *n, int i, json_value_t *v)
+{
+	json_value_t *old = VALUE(n, i);
+
+	v->name = old->name;
+	v->name_len = old->name_len;
+	v->name_hash = old->name_hash;
+	v->flags = (v->flags & ~JSON_F_NAME_ESCAPED) | (old->flags & JSON_F_NAME_ESCAPED);
+
+	VALUE(n, i) = v;
+
+	return old;
+}
+
+/*
+ * Name V KEY, interned if the document interns its names.
+ */
+static int
+value_set_name(json_t *json, json_value_t *v, const char *key, size_t len)
+{
+	unsigned int h = hash_name(key, len);
+	char *name;
+
+	if (NULL != json->keys)
+		name = (char *)intern(json->keys, key, len, h);
+	else
+		name = arena_strndup(&json->arena, key, len);
+
+	if (NULL == name)
+		return -1;
+
+	v->name = name;
+	v->name_len = len;
+	v->name_hash = h;
+	v->flags &= ~JSON_F_NAME_ESCAPED;
+
+	return 0;
+}
+
+/**
+ * A new value of TYPE in JSON, ready to be added to it with
+ * JSON_node_insert() or JSON_object_set(): "", null, false,
+ * 0, or an empty array or object. Returns %NULL if we run
+ * out of memory.
+ */
+json_value_t *
+JSON_value_new(json_t *json, int type)
+{
+	json_value_t *v;
+
+	assert(json);
+	assert(type >= VALUE_STRING && type <= VALUE_OBJECT);
+
+	v = arena_calloc(&json->arena, sizeof(json_value_t));
+	if (NULL == v)
+		return NULL;
+
+	v->type = type;
+
+	if (VALUE_STRING == type)
+	{
+		v->value.u_string = arena_strndup(&json->arena, "", 0);
+		if (NULL == v->value.u_string)
+			return NULL;
+	}
+	else
+	if (VALUE_ARRAY == type)
+	{
+		v->value.u_array = document_node(json);
+		if (NULL == v->value.u_array)
+			return NULL;
+	}
+	else
+	if (VALUE_OBJECT == type)
+	{
+		v->value.u_object = document_node(json);
+		if (NULL == v->value.u_object)
+			return NULL;
+	}
+
+	return v;
+}
+
+/**
+ * A new string value in JSON holding a copy of the LEN bytes at S.
+ */
+json_value_t *
+JSON_value_string(json_t *json, const char *s, size_t len)
+{
+	json_value_t *v;
+
+	assert(json);
+	assert(s);
+
+	v = arena_calloc(&json->arena, sizeof(json_value_t));
+	if (NULL == v)
+		return NULL;
+
+	v->type = VALUE_STRING;
+	v->value.u_string = arena_strndup(&json->arena, s, len);
+	v->len = len;
+
+	return NULL == v->value.u_string ? NULL : v;
+}
+
+json_value_t *
+JSON_value_integer(json_t *json, long long i)
+{
+	json_value_t *v;
+
+	assert(json);
+
+	v = JSON_value_new(json, VALUE_NUMBER);
+	if (NULL != v)
+		v->value.u_long = i;
+
+	return v;
+}
+
+json_value_t *
+JSON_value_double(json_t *json, double d)
+{
+	json_value_t *v;
+
+	assert(json);
+
+	v = JSON_value_new(json, VALUE_DOUBLE);
+	if (NULL != v)
+		v->value.u_double = d;
+
+	return v;
+}
+
+json_value_t *
+JSON_value_bool(json_t *json, int b)
+{
+	json_value_t *v;
+
+	assert(json);
+
+	v = JSON_value_new(json, VALUE_BOOLEAN);
+	if (NULL != v)
+		v->value.u_boolean = !!b;
+
+	return v;
+}
+
+/*
+ * Copying, comparing and diffing walk one or two trees with
+ * a stack of their own, as dump_tree() does: A and B are the
+ * containers at the same place in each, and I how far along
+ * them we are. PATH_LEN is for diffing, the length of the
+ * path to them.
+ */
+typedef struct JSON_Walk_Frame
+{
+	json_node_t *a;
+	json_node_t *b;
+	int type;
+	int i;
+	size_t path_len;
+} json_walk_frame_t;
+
+typedef struct JSON_Walk
+{
+	json_walk_frame_t frames_inline[DUMP_INLINE];
+	json_walk_frame_t *frames;
+	const json_allocator_t *mem;
+	int nr;
+	int nr_alloc;
+} json_walk_t;
+
+#define WALK_TOP(w) (&(w)->frames[(w)->nr-1])
+
+static void
+walk_init(json_walk_t *w, const json_allocator_t *mem)
+{
+	w->frames = w->frames_inline;
+	w->mem = mem;
+	w->nr = 0;
+	w->nr_alloc = DUMP_INLINE;
+}
+
+static int
+walk_push(json_walk_t *w, json_node_t *a, json_node_t *b, int type)
+{
+	json_walk_frame_t *f;
+
+	if (w->nr == w->nr_alloc)
+	{
+		f = mem_alloc(w->mem, w->nr_alloc * 2 * sizeof(json_walk_frame_t));
+		if (NULL == f)
+			return -1;
+
+		memcpy(f, w->frames, w->nr * sizeof(json_walk_frame_t));
+		if (w->frames != w->frames_inline)
+			mem_free(w->mem, w->frames);
+
+		w->frames = f;
+		w->nr_alloc *= 2;
+	}
+
+	f = &w->frames[w->nr++];
+	f->a = a;
+	f->b = b;
+	f->type = type;
+	f->i = 0;
+	f->path_len = 0;
+
+	return 0;
+}
+
+static void
+walk_release(json_walk_t *w)
+{
+	if (w->frames != w->frames_inline)
+		mem_free(w->mem, w->frames);
+}
+
+/*
+ * A copy in JSON of V without its name, and an empty
+ * node for it if it is a container. Strings and
+ * numbers are copied as they are, still escaped or still
+ * text if that's how they were.
+ */
+static json_value_t *
+copy_one(json_t *json, json_value_t *v)
+{
+	json_value_t *c = arena_alloc(&json->arena, sizeof(json_value_t));
+
+	if (NULL == c)
+		return NULL;
+
+	*c = *v;
+	c->name = NULL;
+	c->name_len = 0;
+	c->name_hash = 0;
+	c->flags &= ~JSON_F_NAME_ESCAPED;
+
+	if (VALUE_STRING == v->type || (v->flags & JSON_F_NUMBER_RAW))
+	{
+		c->value.u_string = arena_strndup(&json->arena, v->value.u_string, v->len);
+		if (NULL == c->value.u_string)
+			return NULL;
+	}
+	else
+	if (VALUE_ARRAY == v->type)
+	{
+		c->value.u_array = document_node(json);
+		if (NULL == c->value.u_array)
+			return NULL;
+	}
+	else
+	if (VALUE_OBJECT == v->type)
+	{
+		c->value.u_object = document_node(json);
+		if (NULL == c->value.u_object)
+			return NULL;
+	}
+
+	return c;
+}
+
+static json_value_t *
+copy_value(json_t *json, json_t *from, json_value_t *v)
+{
+	json_walk_t w;
+	json_walk_frame_t *f;
+	json_value_t *root;
+	json_value_t *c;
+	const char *name;
+	size_t len;
+
+	root = copy_one(json, v);
+	if (NULL == root || !IS_CONTAINER(root))
+		return root;
+
+	walk_init(&w, &json->arena.mem);
+	if (walk_push(&w, VALUE_NODE(v), VALUE_NODE(root), v->type) < 0)
+		goto fail;
+
+	while (w.nr > 0)
+	{
+		f = WALK_TOP(&w);
+
+		if (f->i == NVALS(f->a))
+		{
+			--w.nr;
+			continue;
+		}
+
+		if (0 == f->i && node_reserve(&json->arena, f->b, NVALS(f->a)) < 0)
+			goto fail;
+
+		v = VALUE(f->a, f->i);
+		++f->i;
+
+		c = copy_one(json, v);
+		if (NULL == c)
+			goto fail;
+
+		if (VALUE_OBJECT == f->type)
+		{
+			name = JSON_name(from, v, &len);
+			if (NULL == name || value_set_name(json, c, name, len) < 0)
+				goto fail;
+		}
+
+		VALUE(f->b, NVALS(f->b)) = c;
+		++NVALS(f->b);
+
+		if (IS_CONTAINER(c) && walk_push(&w, VALUE_NODE(v), VALUE_NODE(c), v->type) < 0)
+			goto fail;
+	}
+
+	walk_release(&w);
+	return root;
+
+fail:
+	walk_release(&w);
+	return NULL;
+}
+
+/**
+ * A copy in JSON of the value V from the document FROM, which
+ * may be JSON itself, and all that is in it. The copy has no
+ * name until it is given one by being added. Returns %NULL if
+ * we run out of memory.
+ */
+json_value_t *
+JSON_value_copy(json_t *json, json_t *from, json_value_t *v)
+{
+	assert(json);
+	assert(from);
+	assert(v);
+
+	return copy_value(json, from, v);
+}
+
+/**
+ * Put V into NODE of JSON at position I, from 0 to the number
+ * of values in it, moving those after it along. This is for
+ * arrays and objects alike: an element of an array must have
+ * no name and a member of an object must have one, as given
+ * by JSON_object_set(). At the end this costs no more than
+ * it would when parsing; anywhere else it is a move of the
+ * values after it and a renumbering of a wide object's index,
+ * both linear in the number of values. Returns 0, or -1 if
+ * we run out of memory.
+ */
+int
+JSON_node_insert(json_t *json, json_node_t *node, int i, json_value_t *v)
+{
+	assert(json);
+	assert(node);
+	assert(v);
+
+	if (i < 0 || i > NVALS(node))
+		return -1;
+
+	return node_insert(json, node, i, v);
+}
+
+/**
+ * Put V in place of the I'th value of NODE, which it takes the
+ * name of, and give back the value it replaced; %NULL if NODE
+ * hasn't that many.
+ */
+json_value_t *
+JSON_node_replace(json_t *json, json_node_t *node, int i, json_value_t *v)
+{
+	assert(json);
+	assert(node);
+	assert(v);
+
+	if (i < 0 || i >= NVALS(node))
+		return NULL;
+
+	return node_replace(node, i, v);
+}
+
+/**
+ * Take the I'th value out of NODE, moving those after it back,
+ * and give it back; %NULL if NODE hasn't that many. Costs as
+ * JSON_node_insert() does.
+ */
+json_value_t *
+JSON_node_remove(json_t *json, json_node_t *node, int i)
+{
+	assert(json);
+	assert(node);
+
+	if (i < 0 || i >= NVALS(node))
+		return NULL;
+
+	return node_remove(json, node, i);
+}
+
+/**
+ * Make V the member of the object NODE called KEY, LEN bytes
+ * long: in place of the one there is, or else added at the end.
+ * Returns 0, or -1 if we run out of memory.
+ */
+int
+JSON_object_set(json_t *json, json_node_t *node, const char *key, size_t len, json_value_t *v)
+{
+	int i;
+
+	assert(json);
+	assert(node);
+	assert(key);
+	assert(v);
+
+	i = node_find(json, node, key, len, 0);
+	if (i >= 0)
+	{
+		node_replace(node, i, v);
+		return 0;
+	}
+
+	if (value_set_name(json, v, key, len) < 0)
+		return -1;
+
+	return node_insert(json, node, NVALS(node), v);
+}
+
+/**
+ * Take the member called KEY out of the object NODE and give
+ * it back, or %NULL if there is none.
+ */
+json_value_t *
+JSON_object_remove(json_t *json, json_node_t *node, const char *key, size_t len)
+{
+	int i;
+
+	assert(json);
+	assert(node);
+	assert(key);
+
+	i = node_find(json, node, key, len, 0);
+
+	return i < 0 ? NULL : node_remove(json, node, i);
+}
+
+/*
+ * Equality as RFC 6902's "test" has it: numbers are equal if
+ * their values are, however they were written, and members
+ * of objects may be in any order.
+ */
+static double
+number_double(json_value_t *v)
+{
+	if (VALUE_FLOAT == v->type)
+		return v->value.u_float;
+
+	if (VALUE_DOUBLE == v->type)
+		return v->value.u_double;
+
+	return v->flags & JSON_F_UNSIGNED ? (double)v->value.u_ulong : (double)v->value.u_long;
+}
+
+#define IS_NUMERIC(v) (VALUE_NUMBER == (v)->type || VALUE_FLOAT == (v)->type || VALUE_DOUBLE == (v)->type)
+
+static int
+scalar_equal(json_t *ja, json_value_t *a, json_t *jb, json_value_t *b)
+{
+	const char *s;
+	const char *t;
+	size_t n;
+	size_t m;
+
+	number_value(a);
+	number_value(b);
+
+	if (IS_NUMERIC(a) && IS_NUMERIC(b))
+	{
+		if (VALUE_NUMBER == a->type && VALUE_NUMBER == b->type)
+		{
+			return a->value.u_ulong == b->value.u_ulong
+				&& (a->flags & JSON_F_UNSIGNED) == (b->flags & JSON_F_UNSIGNED);
+		}
+
+		return number_double(a) == number_double(b);
+	}
+
+	if (a->type != b->type)
+		return 0;
+
+	switch(a->type)
+	{
+		case VALUE_STRING:
+			s = JSON_string(ja, a, &n);
+			t = JSON_string(jb, b, &m);
+
+			if (NULL == s || NULL == t)
+				return -1;
+
+			return n == m && !memcmp(s, t, n);
+
+		case VALUE_BOOLEAN:
+			return !a->value.u_boolean == !b->value.u_boolean;
+
+		case VALUE_NULL:
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * 1 if A in JA is equal to B in JB, 0 if not, or -1 if
+ * we ran out of memory finding out.
+ */
+static int
+value_equal(json_t *ja, json_value_t *a, json_t *jb, json_value_t *b)
+{
+	json_walk_t w;
+	json_walk_frame_t *f;
+	const char *name;
+	size_t len;
+	int r = 1;
+
+	if (!IS_CONTAINER(a) || !IS_CONTAINER(b))
+		return scalar_equal(ja, a, jb, b);
+
+	if (a->type != b->type)
+		return 0;
+
+	walk_init(&w, &ja->arena.mem);
+	if (walk_push(&w, VALUE_NODE(a), VALUE_NODE(b), a->type) < 0)
+		return -1;
+
+	while (r > 0 && w.nr > 0)
+	{
+		f = WALK_TOP(&w);
+
+		if (0 == f->i && NVALS(f->a) != NVALS(f->b))
+		{
+			r = 0;
+			break;
+		}
+
+		if (f->i == NVALS(f->a))
+		{
+			--w.nr;
+			continue;
+		}
+
+		a = VALUE(f->a, f->i);
+
+		if (VALUE_ARRAY == f->type)
+			b = VALUE(f->b, f->i);
+		else
+		{
+			name = JSON_name(ja, a, &len);
+			if (NULL == name)
+			{
+				r = -1;
+				break;
+			}
+
+			b = node_get(jb, f->b, name, len, a->name_hash);
+			if (NULL == b)
+			{
+				r = 0;
+				break;
+			}
+		}
+
+		++f->i;
+
+		if (!IS_CONTAINER(a) || !IS_CONTAINER(b))
+			r = scalar_equal(ja, a, jb, b);
+		else
+		if (a->type != b->type)
+			r = 0;
+		else
+		if (walk_push(&w, VALUE_NODE(a), VALUE_NODE(b), a->type) < 0)
+			r = -1;
+	}
+
+	walk_release(&w);
+
+	return r;
+}
+
+/*
+ * A whole document as a value, for where
+ * a path of "" means all of it.
+ */
+static void
+root_value(json_t *json, json_value_t *v)
+{
+	memset(v, 0, sizeof(*v));
+	v->type = json->type;
+
+	if (VALUE_ARRAY == json->type)
+		v->value.u_array = json->root;
+	else
+		v->value.u_object = json->root;
+}
+
+/*
+ * Patches. Each operation is applied as it comes, and every
+ * change it makes is logged, so that if one of them can't be
+ * applied the log can be played back to leave the document
+ * just as it was. For a removal the log keeps the value's
+ * name as well, since adding it again elsewhere renames it.
+ */
+enum
+{
+	UNDO_INSERT = 0,
+	UNDO_REMOVE,
+	UNDO_REPLACE,
+	UNDO_ROOT
+};
+
+typedef struct JSON_Undo
+{
+	int what;
+	json_node_t *node;
+	int i;
+	json_value_t *v;
+	char *name;
+	size_t name_len;
+	unsigned int name_hash;
+	int flags;
+} json_undo_t;
+
+typedef struct JSON_Patcher
+{
+	json_t *json;
+	json_t *patch;
+	json_undo_t *undo;
+	int nr_undo;
+	int nr_alloc;
+} json_patcher_t;
+
+static int
+patch_log(json_patcher_t *p, int what, json_node_t *node, int i, json_value_t *v)
+{
+	json_undo_t *u;
+
+	if (p->nr_undo == p->nr_alloc)
+	{
+		u = mem_realloc(&p->json->arena.mem, p->undo, GROW_CAPACITY(p->nr_alloc) * sizeof(json_undo_t));
+		if (NULL == u)
+			return -1;
+
+		p->undo = u;
+		p->nr_alloc = GROW_CAPACITY(p->nr_alloc);
+	}
+
+	u = &p->undo[p->nr_undo++];
+	u->what = what;
+	u->node = node;
+	u->i = i;
+	u->v = v;
+
+	if (NULL != v)
+	{
+		u->name = v->name;
+		u->name_len = v->name_len;
+		u->name_hash = v->name_hash;
+		u->flags = v->flags & JSON_F_NAME_ESCAPED;
+	}
+
+	return 0;
+}
+
+static int
+patch_insert(json_patcher_t *p, json_node_t *n, int i, json_value_t *v)
+{
+	if (patch_log(p, UNDO_INSERT, n, i, NULL) < 0)
+		return JSON_PATCH_ERROR;
+
+	if (node_insert(p->json, n, i, v) < 0)
+	{
+		--p->nr_undo;
+		return JSON_PATCH_ERROR;
+	}
+
+	return JSON_PATCH_OK;
+}
+
+static json_value_t *
+patch_remove(json_patcher_t *p, json_node_t *n, int i)
+{
+	if (patch_log(p, UNDO_REMOVE, n, i, VALUE(n, i)) < 0)
+		return NULL;
+
+	return node_remove(p->json, n, i);
+}
+
+static int
+patch_replace(json_patcher_t *p, json_node_t *n, int i, json_value_t *v)
+{
+	if (patch_log(p, UNDO_REPLACE, n, i, VALUE(n, i)) < 0)
+		return JSON_PATCH_ERROR;
+
+	node_replace(n, i, v);
+
+	return JSON_PATCH_OK;
+}
+
+/*
+ * The document itself can only be replaced by an object
+ * or an array, because that's all a json_t can be.
+ */
+static int
+patch_root(json_patcher_t *p, json_value_t *v)
+{
+	json_t *json = p->json;
+
+	if (!IS_CONTAINER(v))
+		return JSON_PATCH_FAILED;
+
+	if (patch_log(p, UNDO_ROOT, json->root, json->type, NULL) < 0)
+		return JSON_PATCH_ERROR;
+
+	VALUE_NODE(v)->name = json->root->name;
+	json->root = VALUE_NODE(v);
+	json->type = v->type;
+
+	return JSON_PATCH_OK;
+}
+
+/*
+ * None of these need memory: a node only ever gets
+ * back to a size it has already had room for.
+ */
+static void
+patch_undo(json_patcher_t *p)
+{
+	json_undo_t *u;
+	int r;
+
+	while (p->nr_undo > 0)
+	{
+		u = &p->undo[--p->nr_undo];
+
+		switch(u->what)
+		{
+			case UNDO_INSERT:
+				node_remove(p->json, u->node, u->i);
+				break;
+
+			case UNDO_REMOVE:
+				u->v->name = u->name;
+				u->v->name_len = u->name_len;
+				u->v->name_hash = u->name_hash;
+				u->v->flags = (u->v->flags & ~JSON_F_NAME_ESCAPED) | u->flags;
+
+				r = node_insert(p->json, u->node, u->i, u->v);
+				assert(0 == r);
+				(void)r;
+				break;
+
+			case UNDO_REPLACE:
+				node_replace(u->node, u->i, u->v);
+				break;
+
+			case UNDO_ROOT:
+				p->json->root = u->node;
+				p->json->type = u->i;
+				break;
+		}
+	}
+}
+
+/*
+ * Where step ST is in N, a container of TYPE,
+ * or -1 if there's nothing there.
+ */
+static int
+patch_find(json_t *json, json_node_t *n, int type, const json_query_step_t *st)
+{
+	if (VALUE_ARRAY == type)
+		return st->index >= 0 && st->index < NVALS(n) ? (int)st->index : -1;
+
+	return node_find(json, n, st->key, st->len, st->hash);
+}
+
+/*
+ * Follow all but the last step of PATH from the root, to
+ * the container the last step is in. A path in a patch
+ * has no wildcards: "*" is just a name.
+ */
+static int
+patch_parent(json_t *json, const json_query_t *path, json_node_t **np, int *typep)
+{
+	json_node_t *n = json->root;
+	int type = json->type;
+	json_value_t *v;
+	int d;
+	int i;
+
+	for (d = 0; d < path->nr_steps - 1; ++d)
+	{
+		i = patch_find(json, n, type, &path->steps[d]);
+		if (i < 0)
+			return -1;
+
+		v = VALUE(n, i);
+		if (!IS_CONTAINER(v))
+			return -1;
+
+		n = VALUE_NODE(v);
+		type = v->type;
+	}
+
+	*np = n;
+	*typep = type;
+
+	return 0;
+}
+
+#define LAST_STEP(q) (&(q)->steps[(q)->nr_steps-1])
+
+/*
+ * The value at PATH, which for "" is the document
+ * as a value in ROOT.
+ */
+static int
+patch_at(json_patcher_t *p, const json_query_t *path, json_value_t *root, json_value_t **vp)
+{
+	json_node_t *n;
+	int type;
+	int i;
+
+	if (0 == path->nr_steps)
+	{
+		root_value(p->json, root);
+		*vp = root;
+
+		return JSON_PATCH_OK;
+	}
+
+	if (patch_parent(p->json, path, &n, &type) < 0)
+		return JSON_PATCH_FAILED;
+
+	i = patch_find(p->json, n, type, LAST_STEP(path));
+	if (i < 0)
+		return JSON_PATCH_FAILED;
+
+	*vp = VALUE(n, i);
+
+	return JSON_PATCH_OK;
+}
+
+/*
+ * "add": into an array at an index up to its length, or
+ * at the end for "-", or as a member of an object, in
+ * place of any it already has.
+ */
+static int
+patch_add(json_patcher_t *p, const json_query_t *path, json_value_t *v)
+{
+	const json_query_step_t *st;
+	json_node_t *n;
+	long i;
+	int type;
+
+	if (0 == path->nr_steps)
+		return patch_root(p, v);
+
+	if (patch_parent(p->json, path, &n, &type) < 0)
+		return JSON_PATCH_FAILED;
+
+	st = LAST_STEP(path);
+
+	if (VALUE_ARRAY == type)
+	{
+		i = 1 == st->len && '-' == *st->key ? NVALS(n) : st->index;
+		if (i < 0 || i > NVALS(n))
+			return JSON_PATCH_FAILED;
+
+		v->name = NULL;
+		v->name_len = 0;
+		v->name_hash = 0;
+		v->flags &= ~JSON_F_NAME_ESCAPED;
+
+		return patch_insert(p, n, i, v);
+	}
+
+	i = node_find(p->json, n, st->key, st->len, st->hash);
+	if (i >= 0)
+		return patch_replace(p, n, i, v);
+
+	if (value_set_name(p->json, v, st->key, st->len) < 0)
+		return JSON_PATCH_ERROR;
+
+	return patch_insert(p, n, NVALS(n), v);
+}
+
+/*
+ * "remove", and the first half of "move". The
+ * document as a whole can't be taken away.
+ */
+static int
+patch_take(json_patcher_t *p, const json_query_t *path, json_value_t **vp)
+{
+	json_node_t *n;
+	int type;
+	int i;
+
+	if (0 == path->nr_steps)
+		return JSON_PATCH_FAILED;
+
+	if (patch_parent(p->json, path, &n, &type) < 0)
+		return JSON_PATCH_FAILED;
+
+	i = patch_find(p->json, n, type, LAST_STEP(path));
+	if (i < 0)
+		return JSON_PATCH_FAILED;
+
+	*vp = patch_remove(p, n, i);
+
+	return NULL == *vp ? JSON_PATCH_ERROR : JSON_PATCH_OK;
+}
+
+/*
+ * "replace": only what is already there.
+ */
+static int
+patch_put(json_patcher_t *p, const json_query_t *path, json_value_t *v)
+{
+	json_node_t *n;
+	int type;
+	int i;
+
+	if (0 == path->nr_steps)
+		return patch_root(p, v);
+
+	if (patch_parent(p->json, path, &n, &type) < 0)
+		return JSON_PATCH_FAILED;
+
+	i = patch_find(p->json, n, type, LAST_STEP(path));
+	if (i < 0)
+		return JSON_PATCH_FAILED;
+
+	return patch_replace(p, n, i, v);
+}
+
+/*
+ * A string member of an operation, or %NULL.
+ */
+static const char *
+patch_member(json_patcher_t *p, json_node_t *op, const char *key)
+{
+	json_value_t *v = node_get(p->patch, op, key, strlen(key), 0);
+
+	if (NULL == v || VALUE_STRING != v->type)
+		return NULL;
+
+	return JSON_string(p->patch, v, NULL);
+}
+
+/*
+ * One operation of an RFC 6902 patch.
+ */
+static int
+patch_op(json_patcher_t *p, json_node_t *op)
+{
+	json_query_t *path = NULL;
+	json_query_t *from = NULL;
+	json_value_t *value;
+	json_value_t *v;
+	json_value_t root;
+	const char *name;
+	const char *path_s;
+	const char *from_s;
+	size_t n;
+	int r = JSON_PATCH_ERROR;
+
+	name = patch_member(p, op, "op");
+	path_s = patch_member(p, op, "path");
+	from_s = patch_member(p, op, "from");
+	value = node_get(p->patch, op, "value", 5, 0);
+
+	if (NULL == name || NULL == path_s)
+		return JSON_PATCH_ERROR;
+
+	path = pointer_parse(&p->json->arena.mem, path_s, INT_MAX);
+	if (NULL == path)
+		goto out;
+
+	if (!strcmp(name, "add") || !strcmp(name, "replace") || !strcmp(name, "test"))
+	{
+		if (NULL == value)
+			goto out;
+
+		if (!strcmp(name, "test"))
+		{
+			r = patch_at(p, path, &root, &v);
+			if (JSON_PATCH_OK != r)
+				goto out;
+
+			switch(value_equal(p->json, v, p->patch, value))
+			{
+				case 1: r = JSON_PATCH_OK; break;
+				case 0: r = JSON_PATCH_FAILED; break;
+				default: r = JSON_PATCH_ERROR; break;
+			}
+
+			goto out;
+		}
+
+		v = copy_value(p->json, p->patch, value);
+		if (NULL == v)
+			goto out;
+
+		if (!strcmp(name, "add"))
+			r = patch_add(p, path, v);
+		else
+			r = patch_put(p, path, v);
+	}
+	else
+	if (!strcmp(name, "remove"))
+	{
+		r = patch_take(p, path, &v);
+	}
+	else
+	if (!strcmp(name, "move") || !strcmp(name, "copy"))
+	{
+		if (NULL == from_s)
+			goto out;
+
+		from = pointer_parse(&p->json->arena.mem, from_s, INT_MAX);
+		if (NULL == from)
+			goto out;
+
+		if (!strcmp(name, "copy"))
+		{
+			r = patch_at(p, from, &root, &v);
+			if (JSON_PATCH_OK != r)
+				goto out;
+
+			v = copy_value(p->json, p->json, v);
+			r = NULL == v ? JSON_PATCH_ERROR : patch_add(p, path, v);
+
+			goto out;
+		}
+
+	/*
+	 * Nothing can be moved into itself. Moving
+	 * it to where it is changes nothing.
+	 */
+		n = strlen(from_s);
+		if (!strcmp(from_s, path_s))
+		{
+			r = patch_at(p, from, &root, &v);
+			goto out;
+		}
+
+		if (!strncmp(from_s, path_s, n) && '/' == path_s[n])
+		{
+			r = JSON_PATCH_FAILED;
+			goto out;
+		}
+
+		r = patch_take(p, from, &v);
+		if (JSON_PATCH_OK == r)
+			r = patch_add(p, path, v);
+	}
+
+out:
+	mem_free(&p->json->arena.mem, path);
+	mem_free(&p->json->arena.mem, from);
+
+	return r;
+}
+
+static int
+patch_ops(json_patcher_t *p)
+{
+	json_node_t *ops = p->patch->root;
+	json_value_t *op;
+	int r = JSON_PATCH_OK;
+	int i;
+
+	if (VALUE_ARRAY != p->patch->type)
+		return JSON_PATCH_ERROR;
+
+	for (i = 0; i < NVALS(ops) && JSON_PATCH_OK == r; ++i)
+	{
+		op = VALUE(ops, i);
+
+		if (VALUE_OBJECT != op->type)
+			return JSON_PATCH_ERROR;
+
+		r = patch_op(p, op->value.u_object);
+	}
+
+	return r;
+}
+
+/*
+ * An RFC 7386 merge patch: its members are set in the
+ * document, recursively for objects in both, and those that
+ * are null are removed. Anything but an object replaces the
+ * document whole, and is put into an object if it isn't one.
+ */
+static int
+merge_patch(json_patcher_t *p)
+{
+	json_t *json = p->json;
+	json_t *patch = p->patch;
+	json_walk_t w;
+	json_walk_frame_t *f;
+	json_node_t *a;
+	json_value_t *pv;
+	json_value_t *v;
+	json_value_t root;
+	const char *name;
+	size_t len;
+	int r = JSON_PATCH_OK;
+	int i;
+
+	if (VALUE_OBJECT != patch->type)
+	{
+		root_value(patch, &root);
+
+		v = copy_value(json, patch, &root);
+		if (NULL == v)
+			return JSON_PATCH_ERROR;
+
+		return patch_root(p, v);
+	}
+
+	if (VALUE_OBJECT != json->type)
+	{
+		v = JSON_value_new(json, VALUE_OBJECT);
+		if (NULL == v || JSON_PATCH_OK != patch_root(p, v))
+			return JSON_PATCH_ERROR;
+	}
+
+	walk_init(&w, &json->arena.mem);
+	if (walk_push(&w, json->root, patch->root, VALUE_OBJECT) < 0)
+		return JSON_PATCH_ERROR;
+
+	while (JSON_PATCH_OK == r && w.nr > 0)
+	{
+		f = WALK_TOP(&w);
+
+		if (f->i == NVALS(f->b))
+		{
+			--w.nr;
+			continue;
+		}
+
+		a = f->a;
+		pv = VALUE(f->b, f->i);
+		++f->i;
+
+		name = JSON_name(patch, pv, &len);
+		if (NULL == name)
+		{
+			r = JSON_PATCH_ERROR;
+			break;
+		}
+
+		i = node_find(json, a, name, len, pv->name_hash);
+
+		if (VALUE_NULL == pv->type)
+		{
+			if (i >= 0 && NULL == patch_remove(p, a, i))
+				r = JSON_PATCH_ERROR;
+
+			continue;
+		}
+
+		if (VALUE_OBJECT == pv->type && i >= 0 && VALUE_OBJECT == VALUE(a, i)->type)
+		{
+			if (walk_push(&w, VALUE(a, i)->value.u_object, pv->value.u_object, VALUE_OBJECT) < 0)
+				r = JSON_PATCH_ERROR;
+
+			continue;
+		}
+
+	/*
+	 * An object is merged into an empty one, which
+	 * drops its nulls; anything else is copied.
+	 */
+		if (VALUE_OBJECT == pv->type)
+			v = JSON_value_new(json, VALUE_OBJECT);
+		else
+			v = copy_value(json, patch, pv);
+
+		if (NULL == v)
+		{
+			r = JSON_PATCH_ERROR;
+			break;
+		}
+
+		if (i >= 0)
+			r = patch_replace(p, a, i, v);
+		else
+		if (value_set_name(json, v, name, len) < 0)
+			r = JSON_PATCH_ERROR;
+		else
+			r = patch_insert(p, a, NVALS(a), v);
+
+		if (JSON_PATCH_OK == r && VALUE_OBJECT == pv->type
+		&& walk_push(&w, v->value.u_object, pv->value.u_object, VALUE_OBJECT) < 0)
+			r = JSON_PATCH_ERROR;
+	}
+
+	walk_release(&w);
+
+	return r;
+}
+
+/**
+ * Apply the LEN bytes of PATCH to JSON: an RFC 6902 JSON Patch,
+ * an array of operations, or with JSON_PATCH_MERGE in FLAGS an
+ * RFC 7386 merge patch. Only what the patch touches is changed;
+ * the rest of the document stays as it is. Each operation
+ * costs the walk along its path (the first lookup in a wide
+ * object builds its index, which then stays), the size of
+ * any value it copies or tests, and, adding or removing
+ * anywhere but at the end of an object or array, a pass over
+ * that one's values, as for JSON_node_insert(). Undoing a
+ * patch costs what applying it did. Either the whole patch
+ * is applied or none of it: returns JSON_PATCH_OK, JSON_PATCH_FAILED if some operation
+ * doesn't apply (a path that isn't there, a "test" that fails)
+ * or JSON_PATCH_ERROR if PATCH isn't a patch or we run out of
+ * memory, and in both of those JSON is left as it was. The
+ * document itself can only ever be an object or an array, so
+ * a merge patch that is a string, number, true, false or
+ * null is JSON_PATCH_FAILED.
+ */
+int
+JSON_apply_patch(json_t *json, const char *patch, size_t len, int flags)
+{
+	json_parser_t ctx;
+	json_patcher_t p;
+	int r;
+
+	assert(json);
+	assert(patch);
+
+	memset(&p, 0, sizeof(p));
+	p.json = json;
+
+	parser_init(&ctx);
+	p.patch = parse_tree(&ctx, patch, len, JSON_OPT_STRICT, 0);
+	parser_release(&ctx);
+
+/*
+ * A merge patch that is a lone scalar is a well-formed
+ * patch asking for the document to become that scalar,
+ * which no tree can be; it doesn't apply any more than a
+ * JSON Patch "replace" of the root with one does.
+ */
+	if (NULL == p.patch)
+	{
+		if ((flags & JSON_PATCH_MERGE) && JSON_ERR_NONE == JSON_validate(patch, len, NULL))
+			return JSON_PATCH_FAILED;
+
+		return JSON_PATCH_ERROR;
+	}
+
+	if (flags & JSON_PATCH_MERGE)
+		r = merge_patch(&p);
+	else
+		r = patch_ops(&p);
+
+	if (JSON_PATCH_OK != r)
+		patch_undo(&p);
+
+	mem_free(&json->arena.mem, p.undo);
+	JSON_free(p.patch);
+
+	return r;
+}
+
+/*
+ * Diffing. Objects are matched up member by member and
+ * arrays element by element, and only what differs makes an
+ * operation, at the path it was found at; the path is kept
+ * as it is written in the patch, ~0 and ~1 and all.
+ */
+typedef struct JSON_Differ
+{
+	json_dumper_t d;
+	json_t *a;
+	json_t *b;
+	char *path;
+	size_t len;
+	size_t alloc;
+	int nr_ops;
+} json_differ_t;
+
+static int
+diff_path(json_differ_t *df, const char *s, size_t len)
+{
+	size_t need = df->len + 1 + 2 * len;
+	char *p;
+
+	if (need > df->alloc)
+	{
+		p = mem_realloc(&df->a->arena.mem, df->path, need * 2);
+		if (NULL == p)
+			return -1;
+
+		df->path = p;
+		df->alloc = need * 2;
+	}
+
+	df->path[df->len++] = '/';
+
+	while (len--)
+	{
+		if ('~' == *s || '/' == *s)
+		{
+			df->path[df->len++] = '~';
+			df->path[df->len++] = '~' == *s ? '0' : '1';
+		}
+		else
+		{
+			df->path[df->len++] = *s;
+		}
+
+		++s;
+	}
+
+	return 0;
+}
+
+static int
+diff_index(json_differ_t *df, int i)
+{
+	char tmp[16];
+
+	return diff_path(df, tmp, snprintf(tmp, sizeof(tmp), "%d", i));
+}
+
+static void
+diff_op(json_differ_t *df, const char *op, json_value_t *v)
+{
+	json_dumper_t *d = &df->d;
+
+	if (df->nr_ops++ > 0)
+		out_char(d, COMMA);
+
+	out_write(d, "{\"op\":\"", 7);
+	out_write(d, op, strlen(op));
+	out_write(d, "\",\"path\":", 9);
+	out_string(d, df->path, df->len, 0);
+
+	if (NULL != v)
+	{
+		out_write(d, ",\"value\":", 9);
+
+		if (IS_CONTAINER(v))
+			dump_tree(d, VALUE_NODE(v), v->type);
+		else
+			dump_value(d, v);
+	}
+
+	out_char(d, RBRACE);
+}
+
+/*
+ * What to do about A, in the old document, and B at the same
+ * place in the new: nothing, or replace A, or look inside if
+ * they're both objects or both arrays.
+ */
+static int
+diff_pair(json_differ_t *df, json_walk_t *w, json_value_t *a, json_value_t *b)
+{
+	int r;
+
+	if (IS_CONTAINER(a) && a->type == b->type)
+	{
+		if (walk_push(w, VALUE_NODE(a), VALUE_NODE(b), a->type) < 0)
+			return -1;
+
+		WALK_TOP(w)->path_len = df->len;
+
+		return 0;
+	}
+
+	r = value_equal(df->a, a, df->b, b);
+	if (r < 0)
+		return -1;
+
+	if (0 == r)
+		diff_op(df, "replace", b);
+
+	return 0;
+}
+
+/*
+ * A member of an object: I runs over A's members for what
+ * was removed or changed, and then over B's for what was
+ * added. An array: I runs over the elements both have, then
+ * those only B has, added at the end, and then those only A
+ * has, removed from the end back.
+ */
+static int
+diff_step(json_differ_t *df, json_walk_t *w)
+{
+	json_walk_frame_t *f = WALK_TOP(w);
+	int la = NVALS(f->a);
+	int lb = NVALS(f->b);
+	json_value_t *v;
+	const char *name;
+	size_t len;
+	int i = f->i++;
+	int j;
+
+	df->len = f->path_len;
+
+	if (VALUE_ARRAY == f->type)
+	{
+		if (i >= (la > lb ? la : lb))
+		{
+			--w->nr;
+			return 0;
+		}
+
+		if (i < la && i < lb)
+		{
+			if (diff_index(df, i) < 0)
+				return -1;
+
+			return diff_pair(df, w, VALUE(f->a, i), VALUE(f->b, i));
+		}
+
+		if (i < lb)
+		{
+			if (diff_index(df, i) < 0)
+				return -1;
+
+			diff_op(df, "add", VALUE(f->b, i));
+		}
+		else
+		{
+			if (diff_index(df, la - 1 - (i - lb)) < 0)
+				return -1;
+
+			diff_op(df, "remove", NULL);
+		}
+
+		return 0;
+	}
+
+	if (i >= la + lb)
+	{
+		--w->nr;
+		return 0;
+	}
+
+	v = i < la ? VALUE(f->a, i) : VALUE(f->b, i - la);
+
+	name = JSON_name(i < la ? df->a : df->b, v, &len);
+	if (NULL == name)
+		return -1;
+
+	j = node_find(i < la ? df->b : df->a, i < la ? f->b : f->a, name, len, v->name_hash);
+
+	if (i >= la && j >= 0)
+		return 0;
+
+	if (diff_path(df, name, len) < 0)
+		return -1;
+
+	if (i >= la)
+		diff_op(df, "add", v);
+	else
+	if (j < 0)
+		diff_op(df, "remove", NULL);
+	else
+		return diff_pair(df, w, v, VALUE(f->b, j));
+
+	return 0;
+}
+
+/**
+ * Write to SINK an RFC 6902 patch that turns A into B, for
+ * JSON_apply_patch(). Only what differs is in it: members
+ * that were removed, added or changed, and elements changed
+ * in place or added or removed at the end; nothing is ever
+ * found to have moved. Returns 0, or -1 if we ran out of
+ * memory or the sink couldn't take it.
+ */
+int
+JSON_diff(json_t *a, json_t *b, json_sink_t *sink)
 {
-	return lookahead == tok;
-}
+	json_differ_t df;
+	json_walk_t w;
+	json_value_t root;
+	int r = 0;
 
-static char *ptr = NULL;
+	assert(a);
+	assert(b);
+	assert(sink);
 
-static char charseq[8192];
-static void
-parse_charseq(void)
-{
-	char *s = ptr;
+	memset(&df, 0, sizeof(df));
+	df.a = a;
+	df.b = b;
 
-repeat:
-	ptr = memchr(ptr, DQUOTE, end - ptr);
+	dumper_init(&df.d, sink, 0, &a->arena.mem);
+	out_char(&df.d, LBRACK);
 
-	if (*(ptr-1) == '\\')
+	walk_init(&w, &a->arena.mem);
+
+	if (a->type != b->type)
+	{
+		root_value(b, &root);
+		diff_op(&df, "replace", &root);
+	}
+	else
 	{
-		++ptr;
-		goto repeat;
+		r = walk_push(&w, a->root, b->root, a->type);
+
+		while (0 == r && w.nr > 0 && !df.d.err)
+			r = diff_step(&df, &w);
 	}
 
-	strncpy(charseq, s, ptr - s);
-	charseq[ptr - s] = 0;
+	out_char(&df.d, RBRACK);
 
-	advance();
-	assert(matches(TOK_DQUOTE));
+	walk_release(&w);
+	mem_free(&a->arena.mem, df.path);
 
-	return;
+	if (r < 0)
+		return -1;
+
+	return dumper_finish(&df.d);
 }
 
-char *
-parse_string(void)
+/*
+ * Binary snapshots. A snapshot is a tape laid out in a file
+ * just as it is in memory: a header, the entries, and then
+ * the string pool, which holds every string itself (nothing
+ * points back into an input) and each distinct key only
+ * once. A tape has no pointers in it, only offsets, so once
+ * the file is mapped the tape is ready to use where it lies.
+ * The header records the entry size and the byte order, and
+ * a snapshot is only loaded on a machine that agrees.
+ */
+#define SNAPSHOT_MAGIC "JSONSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ORDER 0x0102030405060708ULL
+
+typedef struct JSON_Snapshot_Header
 {
-	parse_charseq();
-	return strdup(charseq);
-}
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t order;
+	uint64_t nr_entries;
+	uint64_t strings_len;
+} json_snapshot_header_t;
 
-char *
-parse_string_nodquotes(void)
+/*
+ * A tree goes into a tape by being played back through the
+ * grammar's own bookkeeping into the tape builder, as though
+ * it were being parsed again. Containers are walked with a
+ * stack of our own, as for JSON_dump().
+ */
+static int
+tape_value(json_parser_t *ctx, json_t *json, json_value_t *v)
 {
-	char *s = ptr;
+	json_number_t num;
+	const char *s;
+	size_t len;
+	int r;
 
-	while (*ptr != COMMA && *ptr != SPACE && !IS_CRNL(*ptr))
-		++ptr;
+	switch(v->type)
+	{
+		case VALUE_STRING:
+			s = JSON_string(json, v, &len);
+			if (NULL == s)
+				return PARSE_ERROR;
 
-	strncpy(charseq, s, ptr - s);
-	charseq[ptr - s] = 0;
+			r = EMIT(on_string, s, len, 0);
+			break;
 
-	return strdup(charseq);
-}
+		case VALUE_NULL:
+			r = EMIT(on_null);
+			break;
 
-char *
-parse_value_name(void)
-{
-	char *s = parse_string();
+		case VALUE_BOOLEAN:
+			r = EMIT(on_bool, v->value.u_boolean);
+			break;
 
-	advance();
-	assert(matches(TOK_COLON));
+		default:
+			number_value(v);
 
-	return s;
-}
+			num.type = VALUE_NUMBER == v->type ? VALUE_NUMBER : VALUE_DOUBLE;
+			num.flags = v->flags & JSON_F_UNSIGNED;
 
-#define NUM_CHARS_MAX 32
-static char _number[NUM_CHARS_MAX];
-int
-parse_number(void)
-{
-	char *s = ptr;
+			if (VALUE_NUMBER == v->type)
+				num.u.u = v->value.u_ulong;
+			else
+			if (VALUE_FLOAT == v->type)
+				num.u.d = v->value.u_float;
+			else
+				num.u.d = v->value.u_double;
 
-	while (isdigit(*ptr))
-		++ptr;
+			r = EMIT(on_number, NULL, 0, &num);
+			break;
+	}
 
-	strncpy(_number, s, ptr - s);
-	_number[ptr - s] = 0;
+	if (PARSE_OK == r)
+		value_done(ctx);
 
-	return atoi(_number);
+	return r;
 }
 
-int
-string_type(char *str)
+static int
+tape_walk(json_parser_t *ctx, json_t *json)
 {
-	assert(str);
-
-	if (!strcmp("true", str) || !strcmp("false", str))
-		return VALUE_BOOLEAN;
-
-	return VALUE_NULL;
-}
-
-static int ARRAY_END_SENTINEL = 0xdeadbeef;
+	json_dump_frame_t *frames;
+	json_dump_frame_t *f;
+	json_value_t *v;
+	json_node_t *n = json->root;
+	const char *name;
+	size_t len;
+	int nr_alloc = DUMP_INLINE;
+	int nr = 0;
+	int type = json->type;
+	int r = PARSE_OK;
+
+	frames = malloc(nr_alloc * sizeof(json_dump_frame_t));
+	if (NULL == frames)
+		return PARSE_ERROR;
+
+	while (NULL != n && PARSE_OK == r)
+	{
+		if (nr == nr_alloc)
+		{
+			f = realloc(frames, nr_alloc * 2 * sizeof(json_dump_frame_t));
+			if (NULL == f)
+			{
+				r = PARSE_ERROR;
+				break;
+			}
 
-json_value_t *
-parse_array(void)
-{
-	json_value_t *arr = NULL;
-	json_value_t *o = NULL;
-	int nr;
-	char _s[1024];
+			frames = f;
+			nr_alloc *= 2;
+		}
 
-	for (arr = calloc(1, sizeof(json_value_t)), nr = 0;
-		;
-		arr = realloc(arr, (nr+1) * sizeof(json_value_t)), ++nr) 
-	{
-		advance();
+		r = open_container(ctx, VALUE_ARRAY == type ? NEST_ARRAY : NEST_OBJECT);
 
-		o = &arr[nr];
-		sprintf(_s, "#%d", nr);
-		o->name = strdup(_s); 
+		frames[nr].n = n;
+		frames[nr].i = 0;
+		frames[nr].array = VALUE_ARRAY == type;
+		++nr;
 
-		if (matches(TOK_DQUOTE))
-		{
-			o->value.u_string = parse_string();
-			o->type = VALUE_STRING;
-		}
-		else
-		if (matches(TOK_MINUS))
+		for (n = NULL; NULL == n && nr > 0 && PARSE_OK == r; )
 		{
-			o->value.u_int = -1 * parse_number();
-			o->type = VALUE_NUMBER;
-		}
-		else
-		if (matches(TOK_DIGIT))
-		{
-			o->value.u_int = parse_number();
-			o->type = VALUE_NUMBER;
-		}
-		else
-		if (matches(TOK_CHARSEQ))
-		{
-			o->value.u_string = parse_string_nodquotes();
-			o->type = string_type(s);
-		}
-		else
-		if (matches(TOK_ARRAY))
-		{
-			fprintf(stderr, "No nested arrays supported at the moment\n");
-			abort();
-		}
-
-	/*
-	 * Either we will parse a comma or finally the ']' character.
-	 */
-		advance();
+			f = &frames[nr-1];
+
+			if (f->i == NVALS(f->n))
+			{
+				r = close_container(ctx, f->array ? NEST_ARRAY : NEST_OBJECT);
+				--nr;
+				continue;
+			}
+
+			v = VALUE(f->n, f->i);
+			++f->i;
+
+			if (!f->array)
+			{
+				name = JSON_name(json, v, &len);
+				if (NULL == name)
+				{
+					r = PARSE_ERROR;
+					break;
+				}
 
-		if (matches(TOK_RBRACK))
-			break;
+				r = EMIT(on_key, name, len, 0);
+				ctx->want_key = 0;
+
+				if (PARSE_OK != r)
+					break;
+			}
+
+			if (VALUE_OBJECT == v->type || VALUE_ARRAY == v->type)
+			{
+				n = VALUE_ARRAY == v->type ? v->value.u_array : v->value.u_object;
+				type = v->type;
+			}
+			else
+			{
+				r = tape_value(ctx, json, v);
+			}
+		}
 	}
 
-/*
- * Nowhere to encode the size of the array, so copy a known
- * json_uvalue_t sentinel that resides in static memory
- * into the end of the array on the heap.
- */
-	arr = realloc(arr, (nr+1) * sizeof(json_uvalue_t));
-	assert(arr);
-
-	o = &arr[nr];
-	o->value.u_int = ARRAY_END_SENTINEL;
-	o->name = NULL;
+	free(frames);
 
-	return arr;
+	return r;
 }
 
-/**
- * Create a new JSON node. The only times we need to create
- * a node is for the root node and then for when a json value
- * is itself another json object, e.g.,:
- *
- * "item" : { ... }
- */
-static json_node_t *
-new_node(void)
+static json_tape_t *
+tape_from_tree(json_t *json)
 {
-	json_node_t *n = malloc(sizeof(json_node_t));
+	json_parser_t ctx;
+	json_tape_t *tp;
+	int r;
 
-	if (NULL == n)
-		return NULL;
+	parser_init(&ctx);
+	parser_reset(&ctx, NULL, 0, 0);
 
-	memset(n, 0, sizeof(*n));
+	ctx.handler = &tape_handler;
+	ctx.max_depth = INT_MAX;
 
-	return n;
-}
+	ctx.tp = tape_new(&ctx.mem);
+	if (NULL == ctx.tp)
+	{
+		parser_release(&ctx);
+		return NULL;
+	}
 
-static json_value_t *
-new_value(void)
-{
-	json_value_t *v = malloc(sizeof(json_value_t));
+	r = tape_walk(&ctx, json);
 
-	if (NULL == v)
-		return NULL;
+	tp = ctx.tp;
+	ctx.tp = NULL;
+	parser_release(&ctx);
 
-	memset(v, 0, sizeof(*v));
+	if (PARSE_OK != r || !ctx.done)
+	{
+		JSON_tape_free(tp);
+		return NULL;
+	}
 
-	return v;
+	return tp;
 }
 
-#define NVALS(n) ((n)->nr_values)
-#define VALUES(n) ((n)->values)
-#define VALUE(n,i) ((n)->values[(i)])
-#define LAST_VALUE(n) VALUE(n, NVALS(n)-1)
-#define FIRST_VALUE(n) VALUE(n,0)
-
-/**
- * Add a new pointer to json_value_t to the array of value pointers
- * in the parent node (holds a json_value_t ** array).
+/*
+ * A key already in the new pool: its offset there plus
+ * one (0 is an empty slot), and its length, since a
+ * decoded key may well have a NUL in it.
  */
-static void
-add_value(json_node_t *parent, json_value_t *value)
+typedef struct JSON_Snapshot_Key
 {
-	assert(parent);
-	assert(value);
+	size_t off;
+	size_t len;
+} json_snapshot_key_t;
 
-	if (NULL == VALUES(parent))
-		VALUES(parent) = calloc(1, sizeof(json_value_t *));
-	else
-		VALUES(parent) = realloc(VALUES(parent), (NVALS(parent)+1) * sizeof(json_value_t *));
-
-	assert(VALUES(parent));
+static int
+pool_add(char **pool, size_t *len, size_t *alloc, const char *s, size_t n)
+{
+	size_t need = *len + n + 1;
+	char *p;
 
-	VALUE(parent, NVALS(parent)) = value;
-	++NVALS(parent);
+	if (need > *alloc)
+	{
+		size_t a = *alloc ? *alloc : 256;
 
-	return;
-}
+		while (a < need)
+			a *= 2;
 
-static json_t *
-JSON_new(void)
-{
-	json_t *jn = malloc(sizeof(json_t));
+		p = realloc(*pool, a);
+		if (NULL == p)
+			return -1;
 
-	if (NULL == jn)
-		return NULL;
+		*pool = p;
+		*alloc = a;
+	}
 
-	memset(jn, 0, sizeof(*jn));
+	memcpy(*pool + *len, s, n);
+	(*pool)[*len + n] = 0;
+	*len += n + 1;
 
-	return jn;
+	return 0;
 }
 
-/**
- * The value array is allocated as one chunk of memory on the heap.
- * So only one free is needed unlike the array of values that are
- * within JSON nodes (json_value_t **).
- *
- * The only value types that need freed are VALUE_STRING.
- */
-static void
-do_free_value_array(json_value_t *arr)
+static int
+write_all(int fd, const void *buf, size_t len)
 {
-	assert(arr);
-
-	int i;
+	const char *p = buf;
+	ssize_t n;
 
-	for (i = 0; VALUE_CAST(&arr[i], int) != 0xdeadbeef; ++i)
+	while (len > 0)
 	{
-		switch(arr[i].type)
+		n = write(fd, p, len);
+		if (n < 0)
 		{
-			case VALUE_STRING:
-
-				free(arr[i].value.u_string);
-				break;
+			if (EINTR == errno)
+				continue;
 
-			default:
-				break;
+			return -1;
 		}
-	}
 
-	free(arr);
+		p += n;
+		len -= n;
+	}
 
-	return;
+	return 0;
 }
 
-/**
- * Free all heap-allocated data within the json node
- * structure. All json nodes have a NAME allocated
- * on the heap. They all have a pointer to pointer
- * json_value_t ** array, requiring a free per
- * json_value_t * in the array and a free of the
- * heap memory used to hold the array of pointers.
- *
- * JSON array values are just json_value_t *, so
- * only one free is needed for that one contiguous
- * chunk of memory.
+/*
+ * Write TP out with a pool of its own: every string copied
+ * in, keys shared. Offsets into the new pool go into a copy
+ * of the entries so that TP itself is left alone.
  */
-static void
-do_free(json_node_t *root)
+static int
+snapshot_write(json_tape_t *tp, int fd)
 {
-	assert(root);
+	json_snapshot_header_t hdr;
+	json_snapshot_key_t *keys = NULL;
+	json_snapshot_key_t *k;
+	json_tape_entry_t *entries;
+	json_tape_entry_t *e;
+	char *pool = NULL;
+	size_t pool_len = 0;
+	size_t pool_alloc = 0;
+	const char *s;
+	size_t len = 0;
+	size_t nr_keys = 0;
+	size_t size;
+	size_t slot;
+	size_t i;
+	int r = -1;
+
+	entries = malloc((tp->nr_entries ? tp->nr_entries : 1) * sizeof(json_tape_entry_t));
+	if (NULL == entries)
+		return -1;
+
+	if (tp->nr_entries)
+		memcpy(entries, tp->entries, tp->nr_entries * sizeof(json_tape_entry_t));
+
+	for (i = 0; i < tp->nr_entries; ++i)
+	{
+		if (TAPE_KEY == entries[i].type)
+			++nr_keys;
+	}
 
-	int nr = root->nr_values;
-	json_value_t *v = NULL;
-	int i;
+	for (size = 16; size < nr_keys * 2; size *= 2)
+		;
 
-	for (i = 0; i < nr; ++i)
+	keys = calloc(size, sizeof(json_snapshot_key_t));
+	if (NULL == keys)
+		goto out;
+
+	for (i = 0; i < tp->nr_entries; ++i)
 	{
-		if (NULL != root->name)
-			free(root->name);
+		e = &entries[i];
 
-		if (NULL == root->values)
+		if (VALUE_STRING != e->type && TAPE_KEY != e->type)
 			continue;
-		// nodes hold a json_value_t ** (pointer to pointer)
-		v = root->values[i];
-
-		switch(v->type)
-		{
-			case VALUE_OBJECT:
 
-				do_free(v->value.u_object);
-				break;
+		s = JSON_tape_string(tp, i, &len);
+		e->flags &= ~JSON_TAPE_F_INPUT;
 
-			case VALUE_STRING:
+		if (TAPE_KEY == e->type)
+		{
+			slot = hash_name(s, len) & (size - 1);
 
-				free(v->value.u_string);
-				break;
+			for (k = &keys[slot]; k->off; k = &keys[slot])
+			{
+				if (k->len == len && !memcmp(pool + k->off - 1, s, len))
+					break;
 
-			case VALUE_ARRAY:
+				slot = (slot + 1) & (size - 1);
+			}
 
-				do_free_value_array(v->value.u_array));
-				break;
+			if (k->off)
+			{
+				e->u.off = k->off - 1;
+				continue;
+			}
 
-			default:
-				break;
+			k->off = pool_len + 1;
+			k->len = len;
 		}
 
-		if (NULL != v->name)
-			free(v->name);
+		e->u.off = pool_len;
 
-		free(v); // free json_value_t *
+		if (pool_add(&pool, &pool_len, &pool_alloc, s, len) < 0)
+			goto out;
 	}
 
-	free(root->values); // free the json_value_t **
-}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.entry_size = sizeof(json_tape_entry_t);
+	hdr.order = SNAPSHOT_ORDER;
+	hdr.nr_entries = tp->nr_entries;
+	hdr.strings_len = pool_len;
 
-void
-JSON_free(json_t *json)
-{
-	assert(json);
-	if (NULL == json->root)
-		return;
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0
+	|| write_all(fd, entries, tp->nr_entries * sizeof(json_tape_entry_t)) < 0
+	|| write_all(fd, pool, pool_len) < 0)
+		goto out;
 
-	do_free(json->root);
+	r = 0;
 
-	return;
+out:
+	free(keys);
+	free(entries);
+	free(pool);
+
+	return r;
 }
 
-#define STACK_MAX_SIZE 256
-// keep track of the current parent node of newly values
-static json_node_t *stack[STACK_MAX_SIZE];
-static int stack_idx = 0;
+/**
+ * Write a snapshot of JSON to FD, from which JSON_load_binary()
+ * gets back the same document as a tape with no parsing at
+ * all. Lazy numbers are converted on the way. Returns 0, or
+ * -1 with errno set if the write fails.
+ */
+int
+JSON_save_binary(json_t *json, int fd)
+{
+	json_tape_t *tp;
+	int r;
 
-#define CLEAR_STACK() memset(stack, 0, STACK_MAX_SIZE * sizeof(json_node_t))
+	assert(json);
 
-#define P_PUSH(p) \
-do { \
-	assert(stack_idx < STACK_MAX_SIZE); \
-	stack[stack_idx++] = (p); \
-} while (0)
+	tp = tape_from_tree(json);
+	if (NULL == tp)
+		return -1;
 
-#define P_POP() \
-({ \
-	assert(stack_idx > 0); \
-	stack[--stack_idx]; \
-})
+	r = snapshot_write(tp, fd);
+	JSON_tape_free(tp);
 
-static json_node_t *node = NULL;
-static json_node_t *parent = NULL;
-static json_value_t *value = NULL;
+	return r;
+}
 
-/*
- * Always 0 or 1. So when we encounter a DQUOTE
- * and need to parse a string we know whether
- * this is going to be the key or the value.
- * (0 for key, 1 for value).
+/**
+ * As JSON_save_binary(), from a tape.
  */
-#define TOGGLE_STATE() (state = (state + 1) & 1)
-#define GETTING_VALUE() (state == 1)
-static int state = 0;
-
-json_t *
-JSON_parse(char *json_data)
+int
+JSON_save_tape_binary(json_tape_t *tape, int fd)
 {
-	char *__str = NULL;
+	assert(tape);
 
-	assert(json_data);
-	ptr = json_data;
-
-	json_t *jn = JSON_new();
-	jn->root = new_node();
-
-	assert(jn);
-	assert(jn->root);
-
-	jn->root->name = strdup("root");
-	parent = jn->root;
-
-	CLEAR_STACK();
+	return snapshot_write(tape, fd);
+}
 
 /*
- * First lex'd character should always be an opening '{'
+ * A snapshot is used where it lies, so before it is trusted
+ * every entry is looked at once: strings must lie in the
+ * pool with their NUL, nothing may point into an input, and
+ * each container's begin and end must name each other and
+ * nest inside their parent. There is one root, as there is
+ * on any tape. Returns -1, with errno set to EINVAL if any
+ * of that fails.
  */
-	advance();
-	assert(matches(TOK_LBRACE));
+static int
+snapshot_check(const json_tape_entry_t *entries, size_t nr, const char *strings, size_t strings_len)
+{
+	const json_tape_entry_t *e;
+	size_t *open = NULL;
+	size_t *p;
+	size_t nr_alloc = 0;
+	size_t depth = 0;
+	size_t i;
+	int r = -1;
 
-	advance();
-	int minus = 0;
+	if (0 == nr)
+		goto out;
 
-	while (ptr < end)
+	for (i = 0; i < nr; ++i)
 	{
-		switch(lookahead)
-		{
-			case TOK_MINUS:
-
-				assert(GETTING_VALUE());
-
-				minus = 1;
-				advance();
-				assert(isdigit(*ptr));
-
-			case TOK_DIGIT:
-
-				assert(GETTING_VALUE());
-
-				int v = parse_number();
-				if (minus)
-					v *= -1;
-
-				value->value.u_int = v;
-				value->type = VALUE_NUMBER;
+		e = &entries[i];
 
-				add_value(parent, value);
-				minus = 0;
+		if (e->flags & JSON_TAPE_F_INPUT)
+			goto out;
 
-				Debug("Got value %d\n", VALUE_CAST(value, int));
+		if (0 == depth && (i > 0 || (VALUE_OBJECT != e->type && VALUE_ARRAY != e->type)))
+			goto out;
 
-				TOGGLE_STATE();
-
-				break;
-
-			case TOK_COMMA:
+		switch(e->type)
+		{
+			case TAPE_KEY:
+				if (VALUE_OBJECT != entries[open[depth-1]].type)
+					goto out;
+				/* fall through */
 
+			case VALUE_STRING:
+				if (e->u.off >= strings_len
+				|| e->len >= strings_len - e->u.off
+				|| strings[e->u.off + e->len])
+					goto out;
 				break;
 
-			case TOK_DQUOTE:
+			case VALUE_OBJECT:
+			case VALUE_ARRAY:
+				if (e->u.match <= i || e->u.match >= nr
+				|| (depth > 0 && e->u.match >= entries[open[depth-1]].u.match))
+					goto out;
 
-				if (GETTING_VALUE())
+				if (depth == nr_alloc)
 				{
-					value->value.u_string = parse_string();
-					value->type = VALUE_STRING;
+					nr_alloc = GROW_CAPACITY(nr_alloc);
 
-					Debug("Got value %s\n", VALUE_CAST(value, char *));
+					p = realloc(open, nr_alloc * sizeof(size_t));
+					if (NULL == p)
+					{
+						free(open);
+						return -1;
+					}
 
-					add_value(parent, value);
+					open = p;
 				}
-				else
-				{
-					value = new_value();
-					value->name = parse_value_name();
 
-					Debug("Got name %s\n", VALUE_CAST(value, char *));
-				}
+				open[depth++] = i;
+				break;
 
-				TOGGLE_STATE();
+			case TAPE_OBJECT_END:
+			case TAPE_ARRAY_END:
+				if (0 == depth
+				|| e->u.match != open[depth-1]
+				|| entries[e->u.match].u.match != i
+				|| entries[e->u.match].type != (TAPE_OBJECT_END == e->type ? VALUE_OBJECT : VALUE_ARRAY))
+					goto out;
 
+				--depth;
 				break;
 
-			case TOK_LBRACE:
+			case VALUE_NUMBER:
+			case VALUE_DOUBLE:
+			case VALUE_BOOLEAN:
+			case VALUE_NULL:
+				break;
 
-				node = new_node();
-				assert(node);
+			default:
+				goto out;
+		}
+	}
 
-				value->value.u_object = node;
-				value->type = VALUE_OBJECT;
+	if (0 == depth)
+		r = 0;
 
-				add_value(parent, value);
-			/*
-			 * The values we will be parsing after this will belong
-			 * to the newly-created node. So push the parent onto
-			 * the stack and then the new node becomes the parent.
-			 */
-				P_PUSH(parent);
-				parent = node;
+out:
+	free(open);
 
-				break;
+	if (r < 0)
+		errno = EINVAL;
 
-			case TOK_RBRACE:
+	return r;
+}
 
-				parent = P_POP();
-				break;
+/**
+ * Map the snapshot at PATH and use it as a tape in place.
+ * The tape is read-only and JSON_tape_free() unmaps it.
+ * The whole tape is checked once on the way in, so a bad
+ * file costs one pass over it. Returns %NULL, with errno set
+ * to EINVAL if the file isn't a well-formed snapshot this
+ * machine can read.
+ */
+json_tape_t *
+JSON_load_binary(const char *path)
+{
+	json_snapshot_header_t *hdr;
+	json_tape_t *tp;
+	struct stat st;
+	void *map;
+	int fd;
+
+	assert(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-			case TOK_LBRACK:
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
 
-				Debug("Parsing JSON array\n");
+	if ((size_t)st.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
 
-				value->value.u_array = parse_array();
-				value->type = VALUE_ARRAY;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-				add_value(parent, value);
+	if (MAP_FAILED == map)
+		return NULL;
 
-				break;
+	hdr = map;
 
-			case TOK_CHARSEQ:
-		/*
-		 * If we are about to parse a value and we didn't find a DQUOTE,
-		 * then it must be null, or true/false.
-		 */
-				__str = parse_string_nodquotes();
-				if (!strcmp(__str, "true"))
-				{
-					value->value.u_boolean = TRUE;
-					value->type = VALUE_BOOLEAN;
-				}
-				else
-				if (!strcmp(__str, "false"))
-				{
-					value->value.u_boolean = FALSE;
-					value->type = VALUE_BOOLEAN;
-				}
-				else
-				if (!strcmp(__str, "null"))
-				{
-					value->value.u_string = NULL;
-					value->type = VALUE_NULL;
-				}
-				
-				free(__str);
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))
+	|| SNAPSHOT_VERSION != hdr->version
+	|| sizeof(json_tape_entry_t) != hdr->entry_size
+	|| SNAPSHOT_ORDER != hdr->order
+	|| hdr->nr_entries > ((size_t)st.st_size - sizeof(*hdr)) / sizeof(json_tape_entry_t)
+	|| sizeof(*hdr) + hdr->nr_entries * sizeof(json_tape_entry_t) + hdr->strings_len != (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
 
-			default:
-				break;
-		}
+	if (snapshot_check((json_tape_entry_t *)(hdr + 1), hdr->nr_entries,
+		(char *)((json_tape_entry_t *)(hdr + 1) + hdr->nr_entries), hdr->strings_len) < 0)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
 
-		advance();
+	tp = calloc(1, sizeof(json_tape_t));
+	if (NULL == tp)
+	{
+		munmap(map, st.st_size);
+		return NULL;
 	}
 
-	return json;
+	tp->entries = (json_tape_entry_t *)(hdr + 1);
+	tp->nr_entries = hdr->nr_entries;
+	tp->strings = (char *)(tp->entries + tp->nr_entries);
+	tp->strings_len = hdr->strings_len;
+	tp->map = map;
+	tp->map_len = st.st_size;
+
+	return tp;
 }
 
+/*
+ * Built with -DJSON_NO_MAIN, for linking into programs of
+ * their own such as json_bench.c, this is left out.
+ */
+#ifndef JSON_NO_MAIN
 int
 main(void)
 {
@@ -733,3 +9608,4 @@ main(void)
 
 	return 0;
 }
+#endif /* !defined JSON_NO_MAIN */
@@ -1,10 +1,613 @@
 #ifndef __JSON_h__
 #define __JSON_h__ 1
 
+#include <stddef.h>
+
+enum
+{
+	VALUE_STRING = 0,
+	VALUE_NULL,
+	VALUE_BOOLEAN,
+	VALUE_NUMBER,
+	VALUE_FLOAT,
+	VALUE_DOUBLE,
+	VALUE_ARRAY,
+	VALUE_OBJECT
+};
+
+typedef union JSON_UValue json_uvalue_t;
+typedef struct JSON_Value json_value_t;
+
+/*
+ * An object's members or an array's elements, in order;
+ * elements have no names. NR_VALUES is an array's length.
+ *
+ * INDEX, once built, is an open-addressed hash table of
+ * INDEX_SIZE slots (a power of two) holding the position
+ * in VALUES, plus one, of each member; 0 is an empty slot.
+ * The first NR_INDEXED values are in it.
+ */
+typedef struct JSON_Node
+{
+	char *name;
+	json_value_t **values;
+	int nr_values;
+	int nr_alloc;
+	int *index;
+	int index_size;
+	int nr_indexed;
+} json_node_t;
+
+/*
+ * VALUE_NUMBER is an integer, held in U_LONG, or in U_ULONG
+ * if JSON_F_UNSIGNED is set because it's too big for a long
+ * long. Anything with a fraction or an exponent, or too big
+ * for either, is a VALUE_DOUBLE. With JSON_OPT_LAZY_NUMBERS
+ * a number is only its text in U_STRING and LEN, flagged by
+ * JSON_F_NUMBER_RAW, until it is read with JSON_integer() or
+ * JSON_double(); the type is then what the text looks like.
+ */
+union JSON_UValue
+{
+	char *u_string;
+	json_node_t *u_array;
+	int u_int;
+	long long u_long;
+	unsigned long long u_ulong;
+	char u_boolean;
+	float u_float;
+	double u_double;
+	json_node_t *u_object;
+};
+
+/*
+ * NAME and, for strings, U_STRING come with their lengths.
+ * In zero-copy mode they are views into the input that may
+ * still hold escape sequences, marked by the flags below.
+ * NAME_HASH is the hash of the decoded name, or 0 if that
+ * hasn't been worked out yet.
+ */
+#define JSON_F_NAME_ESCAPED	0x1
+#define JSON_F_STRING_ESCAPED	0x2
+#define JSON_F_UNSIGNED		0x4
+#define JSON_F_NUMBER_RAW	0x8
+
+struct JSON_Value
+{
+	int type;
+	int flags;
+	unsigned int name_hash;
+	char *name;
+	size_t name_len;
+	size_t len;
+	json_uvalue_t value;
+};
+
+/*
+ * Every node, value and string in a parsed document is
+ * carved out of a chain of large chunks owned by the
+ * document. Freeing the document is then a walk of the
+ * chunk list rather than of the tree.
+ */
+typedef struct JSON_Chunk
+{
+	struct JSON_Chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+} json_chunk_t;
+
+/*
+ * Where a document's memory comes from. The hooks behave
+ * as malloc(), realloc() and free() do, and are passed USER;
+ * ALLOC and REALLOC may refuse with %NULL (a per-request
+ * pool that has had enough, say), which fails the parse
+ * cleanly. All three are given, or none: an allocator left
+ * zeroed is the C library's. What JSON_dump(),
+ * JSON_apply_patch() and JSON_diff() need for themselves
+ * comes from the document's allocator as well; only a
+ * growable json_sink_t's buffer is always the C library's.
+ */
+typedef struct JSON_Allocator
+{
+	void *(*alloc)(void *user, size_t size);
+	void *(*realloc)(void *user, void *p, size_t size);
+	void (*free)(void *user, void *p);
+	void *user;
+} json_allocator_t;
+
+/*
+ * BYTES is what the arena has had from MEM, in NR_ALLOCS
+ * chunks, and not yet given back.
+ */
+typedef struct JSON_Arena
+{
+	json_chunk_t *head;
+	size_t next_size;
+	size_t bytes;
+	size_t nr_allocs;
+	json_allocator_t mem;
+} json_arena_t;
+
+/*
+ * Options for JSON_parse_opt(). Without JSON_OPT_STRICT
+ * commas and colons are taken as read and strings are not
+ * looked inside; with it they must be where RFC 8259 puts
+ * them, strings must be UTF-8 with no control characters
+ * and only JSON's escapes, and numbers have no leading 0s.
+ * JSON_OPT_IN_PLACE decodes names and strings inside the
+ * input itself, which must be writable, and terminates each
+ * where its closing quote was: the document's strings are
+ * then C strings and none of them is copied.
+ */
+#define JSON_OPT_ZERO_COPY	0x1
+#define JSON_OPT_INTERN		0x2
+#define JSON_OPT_LAZY_NUMBERS	0x4
+#define JSON_OPT_STRICT		0x8
+#define JSON_OPT_IN_PLACE	0x10
+
+/*
+ * A set of unique member names. With JSON_OPT_INTERN every
+ * name in a document is stored once, in the document's own
+ * table (KEYS), and equal names are the same pointer. A
+ * table made with JSON_intern_new() can instead be given to
+ * a parser and shared by all the documents it parses.
+ */
+typedef struct JSON_Intern json_intern_t;
+
+/*
+ * ROOT is the top-level object or array, as TYPE says. MAP
+ * is a file mapping and BUF an input buffer that the
+ * document's strings point into and that go with it.
+ */
 typedef struct JSON_Struct
 {
 	json_node_t *root;
+	int type;
 	int nr_nodes;
+	int flags;
+	json_arena_t arena;
+	json_intern_t *keys;
+	void *map;
+	size_t map_len;
+	char *buf;
 } json_t;
 
+typedef struct JSON_Parser json_parser_t;
+
+/*
+ * What a parse did, counted when json.c is built with
+ * -DJSON_STATS. NR_STRINGS takes in keys, NR_ESCAPED those of
+ * them with escapes in; NR_NODES is objects and arrays, and
+ * NR_REALLOCS the times a value array, the frames, the carry
+ * buffer or a tape had to grow once it had some room. CYCLES
+ * are per phase, in ticks of the processor's cycle counter
+ * (nanoseconds where it has none): finding the structural
+ * bytes, checking and storing strings, converting numbers,
+ * and whatever the handler does with each event, which for
+ * JSON_parse_ctx() is building the tree. What CYCLES_TOTAL
+ * has left over is the grammar itself. Only the first and
+ * the total are timed throughout; the others are estimated
+ * from a sample of the tokens.
+ */
+enum
+{
+	JSON_PHASE_SCAN = 0,
+	JSON_PHASE_STRING,
+	JSON_PHASE_NUMBER,
+	JSON_PHASE_BUILD,
+	JSON_NR_PHASES
+};
+
+typedef struct JSON_Stats
+{
+	size_t nr_tokens;
+	size_t bytes_scanned;
+	size_t nr_strings;
+	size_t nr_escaped;
+	size_t nr_numbers;
+	size_t nr_nodes;
+	size_t nr_reallocs;
+	int max_depth;
+	unsigned long long cycles[JSON_NR_PHASES];
+	unsigned long long cycles_total;
+} json_stats_t;
+
+json_parser_t *JSON_parser_new(void);
+void JSON_parser_free(json_parser_t *ctx);
+void JSON_parser_set_intern(json_parser_t *ctx, json_intern_t *tab);
+void JSON_parser_set_max_depth(json_parser_t *ctx, int depth);
+void JSON_parser_set_allocator(json_parser_t *ctx, const json_allocator_t *mem);
+int JSON_parser_stats(json_parser_t *ctx, json_stats_t *st);
+
+json_intern_t *JSON_intern_new(void);
+void JSON_intern_free(json_intern_t *tab);
+const char *JSON_intern(json_intern_t *tab, const char *s, size_t len);
+
+json_t *JSON_parse(char *json_data);
+json_t *JSON_parse_n(const char *buf, size_t len);
+json_t *JSON_parse_ctx(json_parser_t *ctx, const char *buf, size_t len, int flags);
+json_t *JSON_parse_opt(char *json_data, int flags);
+json_t *JSON_parse_hint(char *json_data, int flags, int nr_hint);
+json_t *JSON_parse_in_place(char *buf, size_t len, int flags);
+json_t *JSON_parse_file(const char *path, int flags);
+json_t *JSON_parse_parallel(const char *buf, size_t len, int flags, int nr_threads);
+int JSON_batch_parse(const char **bufs, const size_t *lens, int n, json_t **out, int flags, int nr_threads);
+void JSON_free(json_t *json);
+
+/*
+ * What a document is costing: BYTES in NR_ALLOCS blocks from
+ * its allocator, of which USED are taken up by the document
+ * itself and the rest is room the arena has yet to use. A
+ * file mapping is not counted.
+ */
+typedef struct JSON_Mem_Stats
+{
+	size_t bytes;
+	size_t used;
+	size_t nr_allocs;
+} json_mem_stats_t;
+
+void JSON_mem_stats(json_t *json, json_mem_stats_t *st);
+
+int JSON_node_reserve(json_t *json, json_node_t *node, int nr);
+json_value_t *JSON_get(json_t *json, json_node_t *node, const char *key, size_t len);
+int JSON_array_length(json_value_t *v);
+json_value_t *JSON_array_get(json_value_t *v, int i);
+
+/*
+ * The flat alternative to the tree: every value is one
+ * fixed-size entry in a single array, in document order.
+ * Containers are a begin entry and an end entry whose
+ * MATCH fields point at each other, so a whole subtree is
+ * stepped over in one go; LEN of a begin entry is the
+ * number of members/elements. Object members are a TAPE_KEY
+ * entry followed by the value's entries. Strings are offsets
+ * into the tape's string pool (or into the input, see
+ * JSON_TAPE_F_INPUT), so the tape is position-independent.
+ * MEM is the allocator the tape was built with.
+ */
+enum
+{
+	TAPE_KEY = VALUE_OBJECT + 1,
+	TAPE_OBJECT_END,
+	TAPE_ARRAY_END
+};
+
+#define JSON_TAPE_F_INPUT	0x1
+#define JSON_TAPE_F_UNSIGNED	0x2
+
+typedef struct JSON_Tape_Entry
+{
+	unsigned char type;
+	unsigned char flags;
+	unsigned short __pad;
+	unsigned int len;
+	union
+	{
+		size_t off;
+		size_t match;
+		long long i;
+		unsigned long long u;
+		double d;
+		int b;
+	} u;
+} json_tape_entry_t;
+
+typedef struct JSON_Tape
+{
+	json_tape_entry_t *entries;
+	size_t nr_entries;
+	size_t nr_alloc;
+	char *strings;
+	size_t strings_len;
+	size_t strings_alloc;
+	const char *input;
+	void *map;
+	size_t map_len;
+	json_allocator_t mem;
+} json_tape_t;
+
+#define TAPE_ENTRY(t,i) (&(t)->entries[(i)])
+
+json_tape_t *JSON_parse_tape(char *json_data, int flags);
+json_tape_t *JSON_parse_tape_ctx(json_parser_t *ctx, const char *buf, size_t len, int flags);
+void JSON_tape_free(json_tape_t *tape);
+size_t JSON_tape_next(json_tape_t *tape, size_t i);
+const char *JSON_tape_string(json_tape_t *tape, size_t i, size_t *len);
+
+/*
+ * Snapshots: a tape written out as it is in memory, to be
+ * mapped back in and used where it lies. MAP is then the
+ * mapping, which is read-only.
+ */
+int JSON_save_binary(json_t *json, int fd);
+int JSON_save_tape_binary(json_tape_t *tape, int fd);
+json_tape_t *JSON_load_binary(const char *path);
+
+/*
+ * A number as the parser found it. TYPE is VALUE_NUMBER or
+ * VALUE_DOUBLE and FLAGS may have JSON_F_UNSIGNED, just as
+ * for a json_value_t.
+ */
+typedef struct JSON_Number
+{
+	int type;
+	int flags;
+	union
+	{
+		long long i;
+		unsigned long long u;
+		double d;
+	} u;
+} json_number_t;
+
+/*
+ * Newline-delimited JSON, one document to a line
+ */
+enum
+{
+	JSON_MANY_ERROR = -1,
+	JSON_MANY_DONE = 0,
+	JSON_MANY_OK = 1
+};
+
+void JSON_many_begin(json_parser_t *ctx, const char *buf, size_t len, int flags);
+int JSON_parse_many(json_parser_t *ctx, json_t **docp);
+json_t *JSON_many_keep(json_parser_t *ctx);
+
+/*
+ * Event-driven parsing that builds no tree. Every callback
+ * returns 0 to carry on, anything else to stop the parse.
+ * KEY and string callbacks get a view into the input that
+ * still holds any escape sequences if ESCAPED is set.
+ * A number comes as its text in the input as well as NUM.
+ */
+typedef struct JSON_Handler
+{
+	int (*on_object_begin)(void *user);
+	int (*on_object_end)(void *user);
+	int (*on_array_begin)(void *user);
+	int (*on_array_end)(void *user);
+	int (*on_key)(void *user, const char *s, size_t len, int escaped);
+	int (*on_string)(void *user, const char *s, size_t len, int escaped);
+	int (*on_number)(void *user, const char *s, size_t len, const json_number_t *num);
+	int (*on_bool)(void *user, int b);
+	int (*on_null)(void *user);
+} json_handler_t;
+
+enum
+{
+	JSON_SAX_ERROR = -1,
+	JSON_SAX_OK = 0,
+	JSON_SAX_ABORTED = 1
+};
+
+int JSON_parse_sax(const char *buf, size_t len, const json_handler_t *h, void *user);
+int JSON_parse_sax_ctx(json_parser_t *ctx, const char *buf, size_t len, const json_handler_t *h, void *user);
+size_t JSON_unescape(char *dst, const char *src, size_t len);
+
+/*
+ * What JSON_validate() found wrong, and the offset in the
+ * input of where it went wrong.
+ */
+enum
+{
+	JSON_ERR_NONE = 0,
+	JSON_ERR_SYNTAX,
+	JSON_ERR_EOF,
+	JSON_ERR_TRAILING,
+	JSON_ERR_STRING,
+	JSON_ERR_UTF8,
+	JSON_ERR_NUMBER,
+	JSON_ERR_DEPTH
+};
+
+typedef struct JSON_Error
+{
+	int code;
+	size_t offset;
+} json_error_t;
+
+int JSON_validate(const char *buf, size_t len, json_error_t *err);
+
+/*
+ * A value found by JSON_ondemand_find(): TYPE and FLAGS as
+ * for a json_value_t, and its text in the input. Numbers are
+ * converted into NUM and booleans into B.
+ */
+typedef struct JSON_Item
+{
+	int type;
+	int flags;
+	const char *s;
+	size_t len;
+	json_number_t num;
+	int b;
+} json_item_t;
+
+enum
+{
+	JSON_FIND_ERROR = -1,
+	JSON_FIND_MISSING = 0,
+	JSON_FIND_OK = 1
+};
+
+int JSON_ondemand_find(const char *buf, size_t len, const char *path, json_item_t *item);
+
+/*
+ * Compiled queries, JSON Pointers with "*" for any member or
+ * element, run together over a parsed document or over raw
+ * input. Each match is for one of the iterator's queries, by
+ * its position: over a document it is a VALUE, and over raw
+ * input an ITEM as JSON_ondemand_find() would give.
+ */
+#define JSON_QUERY_MAX 64
+
+typedef struct JSON_Query json_query_t;
+typedef struct JSON_Query_Iter json_query_iter_t;
+
+typedef struct JSON_Match
+{
+	int query;
+	json_value_t *value;
+	json_item_t item;
+} json_match_t;
+
+enum
+{
+	JSON_QUERY_ERROR = -1,
+	JSON_QUERY_DONE = 0,
+	JSON_QUERY_MATCH = 1
+};
+
+json_query_t *JSON_query_compile(const char *pointer);
+void JSON_query_free(json_query_t *q);
+json_query_iter_t *JSON_query_iter_new(json_query_t *const *queries, int nr);
+void JSON_query_iter_free(json_query_iter_t *it);
+void JSON_query_start(json_query_iter_t *it, json_t *json);
+void JSON_query_start_raw(json_query_iter_t *it, const char *buf, size_t len);
+int JSON_query_next(json_query_iter_t *it, json_match_t *m);
+
+/*
+ * Decoding flat objects of a known shape straight into a C
+ * struct. Each field is a member's name, its TYPE (one of
+ * VALUE_STRING, VALUE_NUMBER, VALUE_DOUBLE, VALUE_BOOLEAN),
+ * and the OFFSET and SIZE of where it goes: a char array
+ * that gets the decoded, NUL-terminated string, a long long,
+ * a double, or an int. A document of any other shape is
+ * parsed the ordinary way instead.
+ */
+typedef struct JSON_Field
+{
+	const char *name;
+	int type;
+	size_t offset;
+	size_t size;
+} json_field_t;
+
+typedef struct JSON_Schema json_schema_t;
+
+enum
+{
+	JSON_SCHEMA_ERROR = -1,
+	JSON_SCHEMA_FALLBACK = 0,
+	JSON_SCHEMA_OK = 1
+};
+
+json_schema_t *JSON_schema_new(const json_field_t *fields, int nr);
+void JSON_schema_free(json_schema_t *sc);
+int JSON_parse_schema(const json_schema_t *sc, const char *buf, size_t len, void *rec, json_t **docp);
+
+/*
+ * The struct and its fields can be had from one list, an
+ * X-macro taking X and the struct's name and giving
+ * X(st, member, type, dim) for each member; DIM is the
+ * array bound of a string and empty otherwise:
+ *
+ *	#define POINT(X, st) \
+ *		X(st, name, VALUE_STRING, [32]) \
+ *		X(st, x, VALUE_DOUBLE, ) \
+ *		X(st, y, VALUE_DOUBLE, )
+ *
+ *	JSON_RECORD(point_t, POINT);
+ *
+ * declares point_t and point_t_fields[], ready for
+ * JSON_schema_new(point_t_fields, JSON_NR_FIELDS(point_t)).
+ */
+#define JSON_CTYPE_VALUE_STRING char
+#define JSON_CTYPE_VALUE_NUMBER long long
+#define JSON_CTYPE_VALUE_DOUBLE double
+#define JSON_CTYPE_VALUE_BOOLEAN int
+
+#define JSON_MEMBER(st, m, t, dim) JSON_CTYPE_##t m dim;
+#define JSON_FIELD(st, m, t, dim) { #m, t, offsetof(st, m), sizeof(((st *)0)->m) },
+
+#define JSON_RECORD(st, FIELDS) \
+	typedef struct st { FIELDS(JSON_MEMBER, st) } st; \
+	static const json_field_t st##_fields[] = { FIELDS(JSON_FIELD, st) }
+
+#define JSON_NR_FIELDS(st) ((int)(sizeof(st##_fields) / sizeof(st##_fields[0])))
+
+/*
+ * Incremental parsing of a document that arrives in pieces
+ */
+enum
+{
+	JSON_STREAM_ERROR = -1,
+	JSON_STREAM_MORE = 0,
+	JSON_STREAM_DONE = 1
+};
+
+int JSON_stream_begin(json_parser_t *ctx, int flags);
+int JSON_stream_feed(json_parser_t *ctx, const char *chunk, size_t len);
+json_t *JSON_stream_end(json_parser_t *ctx);
+
+/*
+ * Where JSON_dump() writes to. With no FLUSH this is a
+ * growable buffer: BUF is malloc()ed or %NULL to begin with,
+ * is realloc()ed as needed and is left NUL-terminated, LEN
+ * bytes long; the caller frees it. With FLUSH, BUF is any
+ * buffer of SIZE bytes, handed to FLUSH with USER whenever
+ * it fills up and once more at the end. FLUSH returns 0 on
+ * success.
+ */
+typedef struct JSON_Sink
+{
+	char *buf;
+	size_t len;
+	size_t size;
+	int (*flush)(void *user, const char *s, size_t len);
+	void *user;
+} json_sink_t;
+
+#define JSON_DUMP_PRETTY	0x1
+
+int JSON_dump(json_t *json, json_sink_t *sink, int flags);
+int JSON_dump_tape(json_tape_t *tape, json_sink_t *sink, int flags);
+
+const char *JSON_name(json_t *json, json_value_t *v, size_t *len);
+const char *JSON_string(json_t *json, json_value_t *v, size_t *len);
+long long JSON_integer(json_t *json, json_value_t *v);
+double JSON_double(json_t *json, json_value_t *v);
+const char *JSON_number_text(json_t *json, json_value_t *v, size_t *len);
+
+/*
+ * Changing a document in place. New values are made in the
+ * document they are for, out of its arena, and are owned by
+ * it from then on, as is anything taken out of it.
+ */
+json_value_t *JSON_value_new(json_t *json, int type);
+json_value_t *JSON_value_string(json_t *json, const char *s, size_t len);
+json_value_t *JSON_value_integer(json_t *json, long long i);
+json_value_t *JSON_value_double(json_t *json, double d);
+json_value_t *JSON_value_bool(json_t *json, int b);
+json_value_t *JSON_value_copy(json_t *json, json_t *from, json_value_t *v);
+int JSON_node_insert(json_t *json, json_node_t *node, int i, json_value_t *v);
+json_value_t *JSON_node_replace(json_t *json, json_node_t *node, int i, json_value_t *v);
+json_value_t *JSON_node_remove(json_t *json, json_node_t *node, int i);
+int JSON_object_set(json_t *json, json_node_t *node, const char *key, size_t len, json_value_t *v);
+json_value_t *JSON_object_remove(json_t *json, json_node_t *node, const char *key, size_t len);
+
+/*
+ * Patches: RFC 6902 JSON Patch, or with JSON_PATCH_MERGE an
+ * RFC 7386 merge patch, applied to a document all or nothing.
+ * A document is always an object or an array, so a merge
+ * patch whose root is neither (null, "x", 1, ...) would make
+ * it something it can't be: that is JSON_PATCH_FAILED, and
+ * the document is left as it was.
+ * JSON_diff() writes the JSON Patch between two documents.
+ */
+enum
+{
+	JSON_PATCH_ERROR = -1,
+	JSON_PATCH_OK = 0,
+	JSON_PATCH_FAILED = 1
+};
+
+#define JSON_PATCH_MERGE	0x1
+
+int JSON_apply_patch(json_t *json, const char *patch, size_t len, int flags);
+int JSON_diff(json_t *a, json_t *b, json_sink_t *sink);
+
 #endif /* !defined __JSON_h__ */
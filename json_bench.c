@@ -0,0 +1,799 @@
+/*
+ * Benchmarks for the parser, phase by phase: JSON_parse,
+ * a full traversal of the tree, JSON_dump and JSON_free are
+ * each timed on their own, so a regression in one can't
+ * hide behind the others.
+ *
+ *	cc -O2 -DJSON_NO_MAIN json.c json_bench.c -o json_bench -lm -pthread
+ *
+ *	json_bench [-i ITERATIONS] [-o OPTIONS] [-j] [-S] [FILE...]
+ *
+ * Each FILE is a corpus (twitter.json, canada.json,
+ * citm_catalog.json, ...); one whose name ends in .ndjson or
+ * .jsonl is taken to be a document per line. Unless -S is
+ * given, three synthetic corpora are added: a wide object,
+ * deeply nested containers, and a run of small NDJSON records.
+ * OPTIONS is a comma-separated list of zero-copy, intern, lazy
+ * and strict, the JSON_OPT_* options to parse with.
+ *
+ * One line is printed for each corpus and phase, tab-separated
+ * under a header line or, with -j, as a JSON object per line:
+ * MB/s of input, ns per value, allocations per document as
+ * seen through the allocator hooks, the peak bytes allocated
+ * and the peak RSS of the process during the phase. Times are
+ * the best of ITERATIONS runs. For the dump, the allocations
+ * are JSON_dump()'s own, its stack for deep documents; the
+ * output buffer is ours, kept from one document to the next,
+ * and grows through realloc() unseen by the hooks.
+ */
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "json.h"
+
+#define ITERATIONS_DEFAULT 10
+#define WIDE_MEMBERS 200000
+#define DEEP_LEVELS 20000
+#define NDJSON_RECORDS 50000
+
+enum
+{
+	PHASE_PARSE = 0,
+	PHASE_TRAVERSE,
+	PHASE_DUMP,
+	PHASE_FREE,
+	NR_PHASES
+};
+
+static const char *phase_names[NR_PHASES] =
+{
+	"parse",
+	"traverse",
+	"dump",
+	"free"
+};
+
+/*
+ * A corpus is one or more documents, all held in BUF.
+ */
+typedef struct Bench_Corpus
+{
+	const char *name;
+	char *buf;
+	size_t len;
+	const char **docs;
+	size_t *lens;
+	int nr_docs;
+} bench_corpus_t;
+
+typedef struct Bench_Result
+{
+	double best_ns;
+	long allocs;
+	size_t peak_bytes;
+	long peak_rss_kb;
+} bench_result_t;
+
+/*
+ * The allocator the parser is given: malloc() with a count
+ * of blocks and a high-water mark of the bytes outstanding.
+ * Each block carries its size in front of it.
+ */
+typedef struct Bench_Mem
+{
+	long nr_allocs;
+	size_t live;
+	size_t peak;
+} bench_mem_t;
+
+#define MEM_HEADER 16
+
+static void *
+bench_alloc(void *user, size_t size)
+{
+	bench_mem_t *m = user;
+	char *p = malloc(MEM_HEADER + size);
+
+	if (NULL == p)
+		return NULL;
+
+	*(size_t *)p = size;
+	++m->nr_allocs;
+	m->live += size;
+
+	if (m->live > m->peak)
+		m->peak = m->live;
+
+	return p + MEM_HEADER;
+}
+
+static void *
+bench_realloc(void *user, void *old, size_t size)
+{
+	bench_mem_t *m = user;
+	char *p;
+	size_t old_size;
+
+	if (NULL == old)
+		return bench_alloc(user, size);
+
+	p = (char *)old - MEM_HEADER;
+	old_size = *(size_t *)p;
+
+	p = realloc(p, MEM_HEADER + size);
+	if (NULL == p)
+		return NULL;
+
+	*(size_t *)p = size;
+	++m->nr_allocs;
+	m->live += size - old_size;
+
+	if (m->live > m->peak)
+		m->peak = m->live;
+
+	return p + MEM_HEADER;
+}
+
+static void
+bench_free(void *user, void *old)
+{
+	bench_mem_t *m = user;
+	char *p;
+
+	if (NULL == old)
+		return;
+
+	p = (char *)old - MEM_HEADER;
+	m->live -= *(size_t *)p;
+	free(p);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Peak RSS of a phase on its own. Linux lets the high-water
+ * mark be reset through clear_refs; elsewhere, or if that
+ * isn't allowed, all we have is the peak of the process.
+ */
+static void
+rss_reset(void)
+{
+	FILE *fp = fopen("/proc/self/clear_refs", "w");
+
+	if (NULL == fp)
+		return;
+
+	fputs("5", fp);
+	fclose(fp);
+}
+
+static long
+rss_peak_kb(void)
+{
+	struct rusage ru;
+	char line[256];
+	long kb = -1;
+	FILE *fp = fopen("/proc/self/status", "r");
+
+	if (NULL != fp)
+	{
+		while (NULL != fgets(line, sizeof(line), fp))
+		{
+			if (1 == sscanf(line, "VmHWM: %ld", &kb))
+				break;
+		}
+
+		fclose(fp);
+	}
+
+	if (kb < 0 && 0 == getrusage(RUSAGE_SELF, &ru))
+		kb = ru.ru_maxrss;
+
+	return kb;
+}
+
+/*
+ * Visit every value in the document the way a consumer
+ * would: each name and string read out, each number
+ * converted. Nesting is kept on a stack of our own.
+ */
+typedef struct Bench_Frame
+{
+	json_node_t *n;
+	int i;
+} bench_frame_t;
+
+static bench_frame_t *walk_frames;
+static int walk_alloc;
+
+static size_t
+traverse(json_t *json, unsigned long long *sum)
+{
+	json_value_t *v;
+	json_node_t *child;
+	const char *s;
+	size_t values = 0;
+	size_t len;
+	int depth = 0;
+
+	walk_frames[0].n = json->root;
+	walk_frames[0].i = 0;
+
+	while (depth >= 0)
+	{
+		bench_frame_t *f = &walk_frames[depth];
+
+		if (f->i == f->n->nr_values)
+		{
+			--depth;
+			continue;
+		}
+
+		v = f->n->values[f->i++];
+		++values;
+
+		if (NULL != v->name && NULL != (s = JSON_name(json, v, &len)))
+			*sum += len + (unsigned char)s[0];
+
+		switch(v->type)
+		{
+			case VALUE_STRING:
+
+				s = JSON_string(json, v, &len);
+				if (NULL != s)
+					*sum += len;
+
+				break;
+
+			case VALUE_NUMBER:
+
+				*sum += (unsigned long long)JSON_integer(json, v);
+				break;
+
+			case VALUE_DOUBLE:
+
+				*sum += (unsigned long long)(long long)JSON_double(json, v);
+				break;
+
+			case VALUE_BOOLEAN:
+
+				*sum += v->value.u_boolean;
+				break;
+
+			case VALUE_ARRAY:
+			case VALUE_OBJECT:
+
+				child = VALUE_ARRAY == v->type ? v->value.u_array : v->value.u_object;
+
+				if (depth + 1 == walk_alloc)
+				{
+					walk_alloc *= 2;
+					walk_frames = realloc(walk_frames, walk_alloc * sizeof(bench_frame_t));
+					assert(walk_frames);
+				}
+
+				++depth;
+				walk_frames[depth].n = child;
+				walk_frames[depth].i = 0;
+
+				break;
+
+			default:
+
+				break;
+		}
+	}
+
+	return values;
+}
+
+/*
+ * Cut BUF up into one document per non-blank line.
+ */
+static void
+corpus_split_lines(bench_corpus_t *c)
+{
+	char *p = c->buf;
+	char *e = c->buf + c->len;
+	char *nl;
+	int alloc = 1024;
+
+	c->docs = malloc(alloc * sizeof(char *));
+	c->lens = malloc(alloc * sizeof(size_t));
+	assert(c->docs && c->lens);
+
+	while (p < e)
+	{
+		nl = memchr(p, '\n', e - p);
+		if (NULL == nl)
+			nl = e;
+
+		if (nl > p)
+		{
+			if (c->nr_docs == alloc)
+			{
+				alloc *= 2;
+				c->docs = realloc(c->docs, alloc * sizeof(char *));
+				c->lens = realloc(c->lens, alloc * sizeof(size_t));
+				assert(c->docs && c->lens);
+			}
+
+			c->docs[c->nr_docs] = p;
+			c->lens[c->nr_docs] = nl - p;
+			++c->nr_docs;
+		}
+
+		p = nl + 1;
+	}
+}
+
+static void
+corpus_single(bench_corpus_t *c)
+{
+	c->docs = malloc(sizeof(char *));
+	c->lens = malloc(sizeof(size_t));
+	assert(c->docs && c->lens);
+
+	c->docs[0] = c->buf;
+	c->lens[0] = c->len;
+	c->nr_docs = 1;
+}
+
+static int
+ends_with(const char *s, const char *suffix)
+{
+	size_t n = strlen(s);
+	size_t k = strlen(suffix);
+
+	return n >= k && 0 == strcmp(s + n - k, suffix);
+}
+
+static int
+corpus_load(bench_corpus_t *c, const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	long n;
+
+	memset(c, 0, sizeof(*c));
+
+	if (NULL == fp)
+		return -1;
+
+	if (0 != fseek(fp, 0, SEEK_END) || (n = ftell(fp)) < 0)
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	rewind(fp);
+
+	c->buf = malloc(n + 1);
+	assert(c->buf);
+
+	c->len = fread(c->buf, 1, n, fp);
+	c->buf[c->len] = 0;
+	fclose(fp);
+
+	c->name = path;
+
+	if (ends_with(path, ".ndjson") || ends_with(path, ".jsonl"))
+		corpus_split_lines(c);
+	else
+		corpus_single(c);
+
+	return 0;
+}
+
+/*
+ * A growing buffer for the synthetic corpora.
+ */
+typedef struct Bench_Text
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+} bench_text_t;
+
+static void
+text_printf(bench_text_t *t, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;)
+	{
+		va_start(args, fmt);
+		n = vsnprintf(t->buf + t->len, t->alloc - t->len, fmt, args);
+		va_end(args);
+
+		assert(n >= 0);
+
+		if ((size_t)n < t->alloc - t->len)
+			break;
+
+		t->alloc = t->alloc ? t->alloc * 2 : 4096;
+		while (t->alloc - t->len <= (size_t)n)
+			t->alloc *= 2;
+
+		t->buf = realloc(t->buf, t->alloc);
+		assert(t->buf);
+	}
+
+	t->len += n;
+}
+
+/*
+ * An ID to record map, the shape that makes objects wide.
+ */
+static void
+synth_wide(bench_corpus_t *c)
+{
+	bench_text_t t = { NULL, 0, 0 };
+	int i;
+
+	text_printf(&t, "{");
+
+	for (i = 0; i < WIDE_MEMBERS; ++i)
+	{
+		text_printf(&t, "%s\"id%07d\":{\"n\":%d,\"x\":%d.%03d,\"s\":\"v%d\"}",
+			i ? "," : "", i, i, i % 1000, i % 997, i);
+	}
+
+	text_printf(&t, "}");
+
+	memset(c, 0, sizeof(*c));
+	c->name = "synthetic-wide";
+	c->buf = t.buf;
+	c->len = t.len;
+	corpus_single(c);
+}
+
+/*
+ * Arrays and objects nested in turn, with a few scalars
+ * at each level.
+ */
+static void
+synth_deep(bench_corpus_t *c)
+{
+	bench_text_t t = { NULL, 0, 0 };
+	int i;
+
+	for (i = 0; i < DEEP_LEVELS; ++i)
+		text_printf(&t, i & 1 ? "{\"k\":%d,\"d\":" : "[%d,", i);
+
+	text_printf(&t, "null");
+
+	for (i = DEEP_LEVELS - 1; i >= 0; --i)
+		text_printf(&t, i & 1 ? "}" : "]");
+
+	memset(c, 0, sizeof(*c));
+	c->name = "synthetic-deep";
+	c->buf = t.buf;
+	c->len = t.len;
+	corpus_single(c);
+}
+
+static void
+synth_ndjson(bench_corpus_t *c)
+{
+	bench_text_t t = { NULL, 0, 0 };
+	int i;
+
+	for (i = 0; i < NDJSON_RECORDS; ++i)
+	{
+		text_printf(&t, "{\"ts\":%d,\"level\":\"%s\",\"msg\":\"request %d done\\n\","
+			"\"ms\":%d.%02d,\"ok\":%s,\"tags\":[\"a\",\"b%d\"]}\n",
+			1700000000 + i, i % 10 ? "info" : "warn", i,
+			i % 500, i % 100, i % 7 ? "true" : "false", i % 13);
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->name = "synthetic-ndjson";
+	c->buf = t.buf;
+	c->len = t.len;
+	corpus_split_lines(c);
+}
+
+static void
+corpus_free(bench_corpus_t *c)
+{
+	free(c->buf);
+	free(c->docs);
+	free(c->lens);
+}
+
+static int
+parse_options(const char *s)
+{
+	static const struct
+	{
+		const char *name;
+		int flag;
+	} opts[] =
+	{
+		{ "zero-copy", JSON_OPT_ZERO_COPY },
+		{ "intern", JSON_OPT_INTERN },
+		{ "lazy", JSON_OPT_LAZY_NUMBERS },
+		{ "strict", JSON_OPT_STRICT }
+	};
+	int flags = 0;
+	size_t n;
+	size_t i;
+
+	while (*s)
+	{
+		n = strcspn(s, ",");
+
+		for (i = 0; i < sizeof(opts) / sizeof(opts[0]); ++i)
+		{
+			if (strlen(opts[i].name) == n && 0 == strncmp(s, opts[i].name, n))
+				break;
+		}
+
+		if (i == sizeof(opts) / sizeof(opts[0]))
+		{
+			fprintf(stderr, "unknown option \"%.*s\"\n", (int)n, s);
+			exit(EXIT_FAILURE);
+		}
+
+		flags |= opts[i].flag;
+		s += n;
+
+		if (',' == *s)
+			++s;
+	}
+
+	return flags;
+}
+
+/*
+ * Run every phase over the whole corpus ITERATIONS times.
+ * Returns the number of values in it, or -1 if a document
+ * didn't parse.
+ */
+static long
+bench_corpus(bench_corpus_t *c, int flags, int iterations, bench_result_t *res)
+{
+	json_allocator_t alloc = { bench_alloc, bench_realloc, bench_free, NULL };
+	json_parser_t *ctx = JSON_parser_new();
+	json_sink_t sink = { NULL, 0, 0, NULL, NULL };
+	json_t **docs = calloc(c->nr_docs, sizeof(json_t *));
+	bench_mem_t mem;
+	unsigned long long sum = 0;
+	long values = 0;
+	double t;
+	int it;
+	int p;
+	int i;
+
+	assert(ctx && docs);
+
+	alloc.user = &mem;
+	JSON_parser_set_allocator(ctx, &alloc);
+	JSON_parser_set_max_depth(ctx, DEEP_LEVELS * 2);
+
+	for (p = 0; p < NR_PHASES; ++p)
+		res[p].best_ns = -1;
+
+	for (it = 0; it < iterations; ++it)
+	{
+		for (p = 0; p < NR_PHASES; ++p)
+		{
+			memset(&mem, 0, sizeof(mem));
+			rss_reset();
+			t = now_ns();
+
+			for (i = 0; i < c->nr_docs; ++i)
+			{
+				switch(p)
+				{
+					case PHASE_PARSE:
+
+						docs[i] = JSON_parse_ctx(ctx, c->docs[i], c->lens[i], flags);
+						if (NULL == docs[i])
+						{
+							fprintf(stderr, "%s: document %d doesn't parse\n", c->name, i);
+							values = -1;
+							goto out;
+						}
+
+						break;
+
+					case PHASE_TRAVERSE:
+
+						if (0 == it)
+							values += traverse(docs[i], &sum);
+						else
+							traverse(docs[i], &sum);
+
+						break;
+
+					case PHASE_DUMP:
+
+						sink.len = 0;
+						JSON_dump(docs[i], &sink, 0);
+						break;
+
+					case PHASE_FREE:
+
+						JSON_free(docs[i]);
+						docs[i] = NULL;
+						break;
+				}
+			}
+
+			t = now_ns() - t;
+
+			if (res[p].best_ns < 0 || t < res[p].best_ns)
+				res[p].best_ns = t;
+
+			res[p].allocs = mem.nr_allocs;
+			res[p].peak_bytes = mem.peak;
+			res[p].peak_rss_kb = rss_peak_kb();
+		}
+	}
+
+/*
+ * Keep the traversal from being optimised away.
+ */
+	if (1 == sum)
+		fputc('\n', stderr);
+
+out:
+	for (i = 0; i < c->nr_docs; ++i)
+	{
+		if (NULL != docs[i])
+			JSON_free(docs[i]);
+	}
+
+	free(docs);
+	free(sink.buf);
+	JSON_parser_free(ctx);
+
+	return values;
+}
+
+static void
+report(bench_corpus_t *c, const char *mode, long values, bench_result_t *res, int as_json)
+{
+	double mbs;
+	double nspv;
+	double apd;
+	int p;
+
+	for (p = 0; p < NR_PHASES; ++p)
+	{
+		mbs = res[p].best_ns > 0 ? c->len / (res[p].best_ns / 1e9) / 1e6 : 0;
+		nspv = values > 0 ? res[p].best_ns / values : 0;
+		apd = (double)res[p].allocs / c->nr_docs;
+
+		if (as_json)
+		{
+			printf("{\"corpus\":\"%s\",\"mode\":\"%s\",\"phase\":\"%s\",\"bytes\":%zu,"
+				"\"docs\":%d,\"values\":%ld,\"ns\":%.0f,\"mb_per_s\":%.1f,"
+				"\"ns_per_value\":%.2f,\"allocs_per_doc\":%.2f,\"peak_bytes\":%zu,"
+				"\"peak_rss_kb\":%ld}\n",
+				c->name, mode, phase_names[p], c->len, c->nr_docs, values,
+				res[p].best_ns, mbs, nspv, apd, res[p].peak_bytes, res[p].peak_rss_kb);
+		}
+		else
+		{
+			printf("%s\t%s\t%s\t%zu\t%d\t%ld\t%.0f\t%.1f\t%.2f\t%.2f\t%zu\t%ld\n",
+				c->name, mode, phase_names[p], c->len, c->nr_docs, values,
+				res[p].best_ns, mbs, nspv, apd, res[p].peak_bytes, res[p].peak_rss_kb);
+		}
+	}
+
+	fflush(stdout);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [-o zero-copy,intern,lazy,strict] [-j] [-S] [file...]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench_result_t res[NR_PHASES];
+	bench_corpus_t c;
+	const char *mode = "default";
+	int iterations = ITERATIONS_DEFAULT;
+	int synthetic = 1;
+	int as_json = 0;
+	int flags = 0;
+	int status = EXIT_SUCCESS;
+	long values;
+	int i;
+
+	for (i = 1; i < argc && '-' == argv[i][0]; ++i)
+	{
+		if (0 == strcmp(argv[i], "-i") && i + 1 < argc)
+		{
+			iterations = atoi(argv[++i]);
+			if (iterations < 1)
+				usage(argv[0]);
+		}
+		else
+		if (0 == strcmp(argv[i], "-o") && i + 1 < argc)
+		{
+			mode = argv[++i];
+			flags = parse_options(mode);
+		}
+		else
+		if (0 == strcmp(argv[i], "-j"))
+		{
+			as_json = 1;
+		}
+		else
+		if (0 == strcmp(argv[i], "-S"))
+		{
+			synthetic = 0;
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+	}
+
+	walk_alloc = 64;
+	walk_frames = malloc(walk_alloc * sizeof(bench_frame_t));
+	assert(walk_frames);
+
+	if (!as_json)
+		printf("corpus\tmode\tphase\tbytes\tdocs\tvalues\tns\tmb_per_s\tns_per_value\tallocs_per_doc\tpeak_bytes\tpeak_rss_kb\n");
+
+	for (; i < argc; ++i)
+	{
+		if (corpus_load(&c, argv[i]) < 0)
+		{
+			perror(argv[i]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		values = bench_corpus(&c, flags, iterations, res);
+		if (values < 0)
+			status = EXIT_FAILURE;
+		else
+			report(&c, mode, values, res, as_json);
+
+		corpus_free(&c);
+	}
+
+	if (synthetic)
+	{
+		void (*synth[])(bench_corpus_t *) = { synth_wide, synth_deep, synth_ndjson };
+
+		for (i = 0; i < (int)(sizeof(synth) / sizeof(synth[0])); ++i)
+		{
+			synth[i](&c);
+
+			values = bench_corpus(&c, flags, iterations, res);
+			if (values < 0)
+				status = EXIT_FAILURE;
+			else
+				report(&c, mode, values, res, as_json);
+
+			corpus_free(&c);
+		}
+	}
+
+	free(walk_frames);
+
+	return status;
+}
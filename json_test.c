@@ -0,0 +1,1432 @@
+/*
+ * Conformance and differential tests for the parser.
+ *
+ *	cc -O2 -DJSON_NO_MAIN -DPARALLEL_MIN_LEN=64 json.c json_test.c -o json_test -lm -pthread
+ *
+ *	json_test [SEED]
+ *
+ * JSON_validate() is run over inputs RFC 8259 accepts and
+ * ones it doesn't, each with the error and offset expected.
+ * Then every document of a corpus, part fixed and part made
+ * up from SEED, is parsed with JSON_parse_ctx() and written
+ * out with JSON_dump(), and that has to be what comes out of
+ * every other way in: fed to the stream parser in chunks of
+ * all sizes, split across threads (PARALLEL_MIN_LEN is made
+ * small so that even small documents are), as lines of
+ * NDJSON, parsed in place, as a tape, and as a snapshot
+ * saved and loaded again. Then the odd corners: NDJSON lines
+ * with more after the record, snapshots with one entry made
+ * wrong, a tape built while the allocator refuses, and a wide
+ * object's index as members are moved about. Last come
+ * patches: applied, undone when they fail, and made by
+ * JSON_diff(). Each failure is printed, and the exit status
+ * is the number of them.
+ */
+#include <errno.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "json.h"
+
+#define NR_RANDOM 200
+#define DEPTH_RANDOM 5
+
+static int nr_failed;
+static int nr_checked;
+
+static void
+check(int ok, int line, const char *fmt, ...)
+{
+	va_list args;
+
+	++nr_checked;
+
+	if (ok)
+		return;
+
+	++nr_failed;
+
+	fprintf(stderr, "json_test.c:%d: ", line);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+/*
+ * OK is worked out before the message's arguments are, so
+ * that they show what it left behind.
+ */
+#define CHECK(ok, ...) \
+	do \
+	{ \
+		int ok_ = (ok); \
+		check(ok_, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+/*
+ * A document written out minified into a malloc()ed
+ * string, or %NULL if there is no document.
+ */
+static char *
+dump(json_t *json)
+{
+	json_sink_t sk = { 0 };
+
+	if (NULL == json || JSON_dump(json, &sk, 0) < 0)
+	{
+		free(sk.buf);
+		return NULL;
+	}
+
+	return sk.buf;
+}
+
+static char *
+dump_tape(json_tape_t *tape)
+{
+	json_sink_t sk = { 0 };
+
+	if (NULL == tape || JSON_dump_tape(tape, &sk, 0) < 0)
+	{
+		free(sk.buf);
+		return NULL;
+	}
+
+	return sk.buf;
+}
+
+static int
+same(const char *a, const char *b)
+{
+	return NULL != a && NULL != b && !strcmp(a, b);
+}
+
+/*
+ * Validation. OFFSET is where the error is, or the length
+ * of the input for one that is valid.
+ */
+typedef struct Validate_Case
+{
+	const char *s;
+	int code;
+	size_t offset;
+} validate_case_t;
+
+static const validate_case_t validate_cases[] =
+{
+	{ "{}", JSON_ERR_NONE, 2 },
+	{ "[]", JSON_ERR_NONE, 2 },
+	{ " [ 1 , 2 ] ", JSON_ERR_NONE, 11 },
+	{ "{\"a\":{\"b\":[null,true,false]}}", JSON_ERR_NONE, 29 },
+	{ "[0,-0,1.5,-1e5,1E+5,1e-5]", JSON_ERR_NONE, 25 },
+	{ "[\"\\n\\t\\\"\\\\\\/\\u00e9\\ud834\\udd1e\"]", JSON_ERR_NONE, 32 },
+	{ "[\"h\xc3\xa9\xe2\x82\xac\xf0\x9d\x84\x9e\"]", JSON_ERR_NONE, 14 },
+
+/*
+ * RFC 8259 lets the whole document be a scalar.
+ */
+	{ "42", JSON_ERR_NONE, 2 },
+	{ "-0.5e3", JSON_ERR_NONE, 6 },
+	{ "\"abc\"", JSON_ERR_NONE, 5 },
+	{ "null", JSON_ERR_NONE, 4 },
+	{ " true ", JSON_ERR_NONE, 6 },
+	{ "false\n", JSON_ERR_NONE, 6 },
+
+	{ "", JSON_ERR_EOF, 0 },
+	{ "  ", JSON_ERR_EOF, 2 },
+	{ "[", JSON_ERR_EOF, 1 },
+	{ "\"abc", JSON_ERR_EOF, 4 },
+	{ "[1,]", JSON_ERR_SYNTAX, 3 },
+	{ "{\"a\":1,}", JSON_ERR_SYNTAX, 7 },
+	{ "[1 2]", JSON_ERR_SYNTAX, 3 },
+	{ "{\"a\" 1}", JSON_ERR_SYNTAX, 5 },
+	{ "{\"a\"::1}", JSON_ERR_SYNTAX, 5 },
+	{ "[\"a\":1]", JSON_ERR_SYNTAX, 4 },
+	{ "nul", JSON_ERR_SYNTAX, 0 },
+	{ "[tru]", JSON_ERR_SYNTAX, 1 },
+	{ "[01]", JSON_ERR_NUMBER, 1 },
+	{ "[1e]", JSON_ERR_NUMBER, 3 },
+	{ "[-]", JSON_ERR_NUMBER, 2 },
+	{ "01", JSON_ERR_NUMBER, 0 },
+	{ "[\"\\x\"]", JSON_ERR_STRING, 2 },
+	{ "[\"\x01\"]", JSON_ERR_STRING, 2 },
+	{ "[\"\xc3\"]", JSON_ERR_UTF8, 2 },
+	{ "[\"\xc0\x80\"]", JSON_ERR_UTF8, 2 },
+	{ "[\"\xed\xa0\x80\"]", JSON_ERR_UTF8, 2 },
+	{ "[\"\xf4\x90\x80\x80\"]", JSON_ERR_UTF8, 2 },
+	{ "[\"\xff\"]", JSON_ERR_UTF8, 2 },
+	{ "[1] x", JSON_ERR_TRAILING, 4 },
+	{ "{}{", JSON_ERR_TRAILING, 2 },
+	{ "42 43", JSON_ERR_TRAILING, 3 },
+	{ "\"a\" x", JSON_ERR_TRAILING, 4 },
+};
+
+static void
+test_validate(void)
+{
+	const validate_case_t *c;
+	json_error_t err;
+	char deep[2 * 1025];
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(validate_cases) / sizeof(validate_cases[0]); ++i)
+	{
+		c = &validate_cases[i];
+		r = JSON_validate(c->s, strlen(c->s), &err);
+
+		CHECK(r == (JSON_ERR_NONE == c->code ? 0 : -1) && err.code == c->code && err.offset == c->offset,
+			"validate \"%s\": got %d, code %d at %zu; want code %d at %zu",
+			c->s, r, err.code, err.offset, c->code, c->offset);
+	}
+
+/*
+ * As deep as the default limit allows, and one more.
+ */
+	memset(deep, '[', 1024);
+	memset(deep + 1024, ']', 1024);
+	CHECK(0 == JSON_validate(deep, 2048, &err), "validate 1024 deep: code %d", err.code);
+
+	memset(deep, '[', 1025);
+	memset(deep + 1025, ']', 1025);
+	CHECK(-1 == JSON_validate(deep, 2050, &err) && JSON_ERR_DEPTH == err.code,
+		"validate 1025 deep: code %d", err.code);
+}
+
+/*
+ * The corpus. Random documents come from a xorshift
+ * generator, so a SEED always gives the same ones.
+ */
+static const char *fixed_docs[] =
+{
+	"{}",
+	"[]",
+	"{\"a\":[1,2,{\"b\":null}],\"c\":\"x\\u00e9y\",\"d\":-0.5e3,\"e\":true}",
+	"[0,-1,1.25,\"\\n\\t\\\"\\\\\\/\",18446744073709551615,123456789012345678901234567890]",
+	"{\"k\":\"h\xc3\xa9llo \xf0\x9d\x84\x9e \xe2\x82\xac\",\"l\":[[],{}],\"\\u0041\":\"\\ud834\\udd1e\"}",
+	"[[[[[[[[[[[[[[[[[[[[\"deep\"]]]]]]]]]]]]]]]]]]]]",
+	"[1e300,-9.3e18,1e19,-1e15,999999999999999.0,5e-324]",
+	" { \"spaced\" : [ 1 , 2 , 3 ] , \"out\" : { } } ",
+};
+
+static unsigned long long rng_state;
+
+static unsigned int
+rng(unsigned int n)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return (unsigned int)(rng_state % n);
+}
+
+typedef struct Buf
+{
+	char *s;
+	size_t len;
+	size_t size;
+} buf_t;
+
+static void
+put(buf_t *b, const char *s, size_t len)
+{
+	if (b->len + len + 1 > b->size)
+	{
+		b->size = (b->len + len + 1) * 2;
+		b->s = realloc(b->s, b->size);
+		if (NULL == b->s)
+			abort();
+	}
+
+	memcpy(b->s + b->len, s, len);
+	b->len += len;
+	b->s[b->len] = 0;
+}
+
+static void
+puts_buf(buf_t *b, const char *s)
+{
+	put(b, s, strlen(s));
+}
+
+static void
+gen_space(buf_t *b)
+{
+	static const char *spaces[] = { "", "", "", " ", "\n", "\t ", "\r\n" };
+
+	puts_buf(b, spaces[rng(sizeof(spaces) / sizeof(spaces[0]))]);
+}
+
+static void
+gen_string(buf_t *b)
+{
+	static const char *pieces[] =
+	{
+		"a", "b", "key", "x y", "\\n", "\\\"", "\\\\", "\\/", "\\u00e9", "\\u20ac",
+		"\\ud834\\udd1e", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9d\x84\x9e", "~", "0"
+	};
+	int n = rng(6);
+
+	puts_buf(b, "\"");
+	while (n-- > 0)
+		puts_buf(b, pieces[rng(sizeof(pieces) / sizeof(pieces[0]))]);
+	puts_buf(b, "\"");
+}
+
+static void
+gen_value(buf_t *b, int depth)
+{
+	static const char *scalars[] =
+	{
+		"0", "-0", "7", "-42", "3.25", "-1.5e-3", "2E+10", "9223372036854775807",
+		"18446744073709551615", "1e400", "true", "false", "null"
+	};
+	int n;
+	int i;
+
+	gen_space(b);
+
+	switch(depth > 0 ? rng(5) : rng(2))
+	{
+		case 0:
+			puts_buf(b, scalars[rng(sizeof(scalars) / sizeof(scalars[0]))]);
+			break;
+
+		case 1:
+			gen_string(b);
+			break;
+
+		case 2:
+		case 3:
+			n = rng(6);
+			puts_buf(b, "[");
+			for (i = 0; i < n; ++i)
+			{
+				if (i > 0)
+					puts_buf(b, ",");
+				gen_value(b, depth - 1);
+			}
+			gen_space(b);
+			puts_buf(b, "]");
+			break;
+
+		default:
+			/*
+			 * Only near the top, now and then, one wide
+			 * enough to be indexed.
+			 */
+			n = depth < DEPTH_RANDOM - 1 || rng(3) ? rng(6) : rng(80);
+			puts_buf(b, "{");
+			for (i = 0; i < n; ++i)
+			{
+				char key[16];
+
+				if (i > 0)
+					puts_buf(b, ",");
+				gen_space(b);
+				snprintf(key, sizeof(key), "\"k%d\"", i);
+				puts_buf(b, key);
+				gen_space(b);
+				puts_buf(b, ":");
+				gen_value(b, depth - 1);
+			}
+			gen_space(b);
+			puts_buf(b, "}");
+			break;
+	}
+
+	gen_space(b);
+}
+
+/*
+ * A random document: always an object or an array,
+ * since that is all a tree can have at the root.
+ */
+static char *
+gen_doc(void)
+{
+	buf_t b = { 0 };
+	int n = 1 + rng(8);
+	int i;
+
+	puts_buf(&b, rng(2) ? "[" : "{");
+
+	for (i = 0; i < n; ++i)
+	{
+		char key[16];
+
+		if (i > 0)
+			puts_buf(&b, ",");
+
+		if ('{' == b.s[0])
+		{
+			snprintf(key, sizeof(key), "\"m%d\":", i);
+			puts_buf(&b, key);
+		}
+
+		gen_value(&b, DEPTH_RANDOM);
+	}
+
+	puts_buf(&b, '{' == b.s[0] ? "}" : "]");
+
+	return b.s;
+}
+
+static const int diff_flags[] =
+{
+	0,
+	JSON_OPT_ZERO_COPY,
+	JSON_OPT_INTERN,
+	JSON_OPT_LAZY_NUMBERS,
+	JSON_OPT_STRICT,
+	JSON_OPT_ZERO_COPY | JSON_OPT_LAZY_NUMBERS,
+};
+
+#define NR_DIFF_FLAGS ((int)(sizeof(diff_flags) / sizeof(diff_flags[0])))
+
+static char *
+parse_dump(json_parser_t *ctx, const char *s, size_t len, int flags)
+{
+	json_t *json = JSON_parse_ctx(ctx, s, len, flags);
+	char *out = dump(json);
+
+	if (NULL != json)
+		JSON_free(json);
+
+	return out;
+}
+
+/*
+ * Feed S to the stream parser CHUNK bytes at a time.
+ */
+static char *
+stream_dump(json_parser_t *ctx, const char *s, size_t len, int flags, size_t chunk)
+{
+	json_t *json;
+	size_t off;
+	size_t n;
+	int r = JSON_STREAM_MORE;
+	char *out;
+
+	if (JSON_stream_begin(ctx, flags) < 0)
+		return NULL;
+
+	for (off = 0; off < len && JSON_STREAM_MORE == r; off += n)
+	{
+		n = len - off < chunk ? len - off : chunk;
+		r = JSON_stream_feed(ctx, s + off, n);
+	}
+
+	json = JSON_stream_end(ctx);
+	if (JSON_STREAM_ERROR == r)
+	{
+		if (NULL != json)
+			JSON_free(json);
+
+		return NULL;
+	}
+
+	out = dump(json);
+	if (NULL != json)
+		JSON_free(json);
+
+	return out;
+}
+
+static void
+test_one(json_parser_t *ctx, const char *s, int flags)
+{
+	static const size_t chunks[] = { 1, 2, 3, 7, 16, 64, 1 << 20 };
+	size_t len = strlen(s);
+	char *ref;
+	char *ref_copy;
+	char *ref_tape;
+	char *out;
+	char *copy;
+	char path[] = "/tmp/json_test.XXXXXX";
+	json_tape_t *tape;
+	json_t *json;
+	size_t i;
+	int fd;
+
+	ref = parse_dump(ctx, s, len, flags);
+	CHECK(NULL != ref, "JSON_parse_ctx failed, flags %#x: %s", flags, s);
+	if (NULL == ref)
+		return;
+
+/*
+ * What is copied out of the input rather than pointed
+ * into it: the stream parser and in-place parsing.
+ */
+	ref_copy = parse_dump(ctx, s, len, flags & ~JSON_OPT_ZERO_COPY);
+	ref_tape = parse_dump(ctx, s, len, flags & ~(JSON_OPT_ZERO_COPY | JSON_OPT_LAZY_NUMBERS));
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i)
+	{
+		out = stream_dump(ctx, s, len, flags, chunks[i]);
+		CHECK(same(out, ref_copy), "stream in %zu-byte chunks, flags %#x: %s\n\tgot  %s\n\twant %s",
+			chunks[i], flags, s, out, ref_copy);
+		free(out);
+	}
+
+	for (i = 2; i <= 4; i += 2)
+	{
+		json = JSON_parse_parallel(s, len, flags, (int)i);
+		out = dump(json);
+		CHECK(same(out, ref), "parallel on %zu threads, flags %#x: %s\n\tgot  %s\n\twant %s",
+			i, flags, s, out, ref);
+		free(out);
+		if (NULL != json)
+			JSON_free(json);
+	}
+
+	copy = malloc(len + 1);
+	memcpy(copy, s, len + 1);
+	json = JSON_parse_in_place(copy, len, (flags & ~JSON_OPT_ZERO_COPY) | JSON_OPT_IN_PLACE);
+	out = dump(json);
+	CHECK(same(out, ref_copy), "in place, flags %#x: %s\n\tgot  %s\n\twant %s", flags, s, out, ref_copy);
+	free(out);
+	if (NULL != json)
+		JSON_free(json);
+
+/*
+ * A tape decodes any escaped string into its pool and
+ * converts every number, and so does a snapshot.
+ */
+	tape = JSON_parse_tape_ctx(ctx, s, len, flags);
+	out = dump_tape(tape);
+	CHECK(same(out, ref_tape), "tape, flags %#x: %s\n\tgot  %s\n\twant %s", flags, s, out, ref_tape);
+	free(out);
+	if (NULL != tape)
+		JSON_tape_free(tape);
+
+	if (!(flags & JSON_OPT_LAZY_NUMBERS))
+	{
+		json = JSON_parse_ctx(ctx, s, len, flags);
+		fd = mkstemp(path);
+
+		CHECK(fd >= 0 && 0 == JSON_save_binary(json, fd), "save snapshot: %s", s);
+		tape = JSON_load_binary(path);
+		out = dump_tape(tape);
+		CHECK(same(out, ref_tape), "snapshot, flags %#x: %s\n\tgot  %s\n\twant %s", flags, s, out, ref_tape);
+
+		free(out);
+		if (NULL != tape)
+			JSON_tape_free(tape);
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(path);
+		}
+		JSON_free(json);
+	}
+
+	free(ref);
+	free(ref_copy);
+	free(ref_tape);
+}
+
+/*
+ * Numbers far longer than any double needs, which are cut
+ * short before strtod() sees them when they are converted
+ * lazily: each must come out as strtod() makes the whole of
+ * it. 2^53 + 1 then a 1 digits away is just over halfway, so
+ * has to round up.
+ */
+static void
+test_long_numbers(void)
+{
+	json_parser_t *ctx = JSON_parser_new();
+	json_t *json;
+	buf_t d = { 0 };
+	char digit[2] = { 0 };
+	double got;
+	double want;
+	int point;
+	int i;
+	int k;
+	int n;
+
+	rng_state = 11;
+
+	for (i = 0; i < 200; ++i)
+	{
+		d.len = 0;
+		puts_buf(&d, "[");
+
+		if (0 == i)
+		{
+			puts_buf(&d, "9007199254740993.");
+			for (k = 0; k < 1000; ++k)
+				puts_buf(&d, "0");
+			puts_buf(&d, "1");
+		}
+		else
+		{
+			if (rng(2))
+				puts_buf(&d, "-");
+
+		/*
+		 * 0.000ddd, or ddd.ddd, or ddd, the digits
+		 * mostly 0 so that there are runs of them.
+		 */
+			n = 1 + rng(2000);
+			point = rng(3) ? (int)rng(n) : -1;
+
+			if (0 == point)
+			{
+				puts_buf(&d, "0.");
+				for (k = rng(400); k > 0; --k)
+					puts_buf(&d, "0");
+			}
+
+			for (k = 0; k < n; ++k)
+			{
+				if (k > 0 && k == point)
+					puts_buf(&d, ".");
+
+				digit[0] = 0 == k ? '1' + rng(9) : rng(3) ? '0' : '0' + rng(10);
+				puts_buf(&d, digit);
+			}
+
+			if (rng(2))
+			{
+				puts_buf(&d, rng(2) ? "e-" : "E+");
+				for (k = 1 + rng(4); k > 0; --k)
+				{
+					digit[0] = '0' + rng(10);
+					puts_buf(&d, digit);
+				}
+			}
+		}
+
+		puts_buf(&d, "]");
+
+		json = JSON_parse_ctx(ctx, d.s, d.len, JSON_OPT_LAZY_NUMBERS);
+		want = strtod(d.s + 1, NULL);
+		got = NULL != json ? JSON_double(json, json->root->values[0]) : -1;
+
+		CHECK(NULL != json && (got == want || (got != got && want != want)),
+			"long number %d: got %.17g, want %.17g", i, got, want);
+
+		if (NULL != json)
+			JSON_free(json);
+	}
+
+	free(d.s);
+	JSON_parser_free(ctx);
+}
+
+/*
+ * A program that has set a locale with a decimal comma still
+ * reads and writes JSON's numbers. The environment's locale
+ * is tried first, then a few common ones; if none has a
+ * comma there is nothing to see here.
+ */
+static void
+test_locale(void)
+{
+	static const char *locales[] = { "", "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "ru_RU.UTF-8" };
+	static const char *doc = "[1.5,0.1000000000000000055511151231257827,2.5e-300]";
+	json_sink_t sk = { 0 };
+	json_t *json;
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(locales) / sizeof(locales[0]); ++i)
+	{
+		if (NULL != setlocale(LC_NUMERIC, locales[i]) && !strcmp(localeconv()->decimal_point, ","))
+			break;
+	}
+
+	if (i == sizeof(locales) / sizeof(locales[0]))
+	{
+		setlocale(LC_NUMERIC, "C");
+		return;
+	}
+
+	json = JSON_parse_n(doc, strlen(doc));
+	CHECK(NULL != json
+		&& 1.5 == JSON_double(json, json->root->values[0])
+		&& 0.1 == JSON_double(json, json->root->values[1])
+		&& 2.5e-300 == JSON_double(json, json->root->values[2]),
+		"numbers in locale %s", setlocale(LC_NUMERIC, NULL));
+
+	if (NULL != json)
+	{
+		r = JSON_dump(json, &sk, 0);
+		CHECK(0 == r && !strcmp(sk.buf, "[1.5,0.1,2.5e-300]"),
+			"dump in locale %s: %s", setlocale(LC_NUMERIC, NULL), sk.buf);
+
+		JSON_free(json);
+	}
+
+	free(sk.buf);
+	setlocale(LC_NUMERIC, "C");
+}
+
+/*
+ * All of the corpus as NDJSON, one document to a line with
+ * blank lines between some of them: each record has to be
+ * what the document is on its own.
+ */
+static void
+test_ndjson(json_parser_t *ctx, char **docs, int nr, int flags)
+{
+	json_parser_t *many = JSON_parser_new();
+	buf_t b = { 0 };
+	json_t *json;
+	char **refs = calloc(nr, sizeof(char *));
+	char *out;
+	int i;
+	int r;
+
+	for (i = 0; i < nr; ++i)
+	{
+		refs[i] = parse_dump(ctx, docs[i], strlen(docs[i]), flags);
+
+	/*
+	 * A line can't have a newline in it, so each
+	 * goes in as it comes out, minified.
+	 */
+		puts_buf(&b, refs[i]);
+		puts_buf(&b, i % 3 ? "\n" : " \r\n\n");
+	}
+
+	JSON_many_begin(many, b.s, b.len, flags);
+
+	for (i = 0; ; ++i)
+	{
+		r = JSON_parse_many(many, &json);
+		if (JSON_MANY_OK != r)
+			break;
+
+		out = dump(json);
+		CHECK(i < nr && same(out, refs[i]), "NDJSON record %d, flags %#x\n\tgot  %s\n\twant %s",
+			i, flags, out, i < nr ? refs[i] : "(none)");
+		free(out);
+	}
+
+	CHECK(JSON_MANY_DONE == r && i == nr, "NDJSON, flags %#x: %d of %d records, then %d", flags, i, nr, r);
+
+	for (i = 0; i < nr; ++i)
+		free(refs[i]);
+	free(refs);
+	free(b.s);
+	JSON_parser_free(many);
+}
+
+/*
+ * Lines with more than blanks after the record: each of
+ * those is an error, strict or not, and the next line
+ * still parses.
+ */
+static const char many_lines[] =
+	"{\"a\":1} garbage\n"
+	"{\"b\":2} \t\r\n"
+	"{\"c\":3}]\n"
+	"[4] [5]\n"
+	"{\"d\":{}}\n";
+
+static const int many_results[] =
+{
+	JSON_MANY_ERROR, JSON_MANY_OK, JSON_MANY_ERROR, JSON_MANY_ERROR, JSON_MANY_OK, JSON_MANY_DONE
+};
+
+static void
+test_many_trailing(void)
+{
+	json_parser_t *many = JSON_parser_new();
+	json_t *json;
+	size_t i;
+	int strict;
+	int r;
+
+	for (strict = 0; strict < 2; ++strict)
+	{
+		JSON_many_begin(many, many_lines, sizeof(many_lines) - 1, strict ? JSON_OPT_STRICT : 0);
+
+		for (i = 0; i < sizeof(many_results) / sizeof(many_results[0]); ++i)
+		{
+			r = JSON_parse_many(many, &json);
+			CHECK(r == many_results[i], "NDJSON line %zu, strict %d: got %d, want %d",
+				i + 1, strict, r, many_results[i]);
+		}
+	}
+
+	JSON_parser_free(many);
+}
+
+static void
+test_differential(unsigned long long seed)
+{
+	int nr_fixed = (int)(sizeof(fixed_docs) / sizeof(fixed_docs[0]));
+	int nr = nr_fixed + NR_RANDOM;
+	char **docs = calloc(nr, sizeof(char *));
+	json_parser_t *ctx = JSON_parser_new();
+	int i;
+	int f;
+
+	rng_state = seed;
+
+	for (i = 0; i < nr; ++i)
+		docs[i] = i < nr_fixed ? strdup(fixed_docs[i]) : gen_doc();
+
+	for (f = 0; f < NR_DIFF_FLAGS; ++f)
+	{
+		for (i = 0; i < nr; ++i)
+			test_one(ctx, docs[i], diff_flags[f]);
+
+		test_ndjson(ctx, docs, nr, diff_flags[f]);
+	}
+
+	for (i = 0; i < nr; ++i)
+		free(docs[i]);
+	free(docs);
+	JSON_parser_free(ctx);
+}
+
+/*
+ * A snapshot with one thing wrong with it, entry by entry:
+ * each must be turned away with EINVAL rather than mapped.
+ * The entries of {"ab":[1,"cd"]} are the object, the key,
+ * the array, 1, "cd", and the two ends. FIELD_NONE takes
+ * every entry away, leaving a well-made header over nothing.
+ */
+typedef struct Corrupt_Case
+{
+	int entry;
+	int field;
+	unsigned long long value;
+} corrupt_case_t;
+
+enum
+{
+	FIELD_TYPE,
+	FIELD_FLAGS,
+	FIELD_LEN,
+	FIELD_U,
+	FIELD_NONE
+};
+
+static const corrupt_case_t corrupt_cases[] =
+{
+	{ 1, FIELD_U, 1ULL << 40 },
+	{ 4, FIELD_U, 2 },
+	{ 4, FIELD_LEN, 1000 },
+	{ 4, FIELD_LEN, 1 },
+	{ 1, FIELD_FLAGS, JSON_TAPE_F_INPUT },
+	{ 0, FIELD_U, 5 },
+	{ 2, FIELD_U, 6 },
+	{ 2, FIELD_U, 1 },
+	{ 5, FIELD_U, 0 },
+	{ 6, FIELD_TYPE, TAPE_ARRAY_END },
+	{ 3, FIELD_TYPE, TAPE_KEY },
+	{ 3, FIELD_TYPE, 99 },
+	{ 0, FIELD_TYPE, VALUE_NULL },
+	{ 0, FIELD_NONE, 0 },
+};
+
+static int
+write_file(char *path, const void *buf, size_t len)
+{
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, buf, len) != (ssize_t)len)
+	{
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void
+test_snapshot_corrupt(void)
+{
+	const char *doc = "{\"ab\":[1,\"cd\"]}";
+	const corrupt_case_t *c;
+	json_tape_entry_t *e;
+	json_tape_t empty = { 0 };
+	json_tape_t *tape;
+	json_t *json;
+	char path[] = "/tmp/json_test.XXXXXX";
+	char *buf;
+	size_t entries;
+	size_t len;
+	size_t i;
+	int fd;
+
+	json = JSON_parse_n(doc, strlen(doc));
+	fd = mkstemp(path);
+	CHECK(fd >= 0 && 0 == JSON_save_binary(json, fd), "save snapshot: %s", doc);
+	JSON_free(json);
+	if (fd < 0)
+		return;
+	close(fd);
+
+	tape = JSON_load_binary(path);
+	unlink(path);
+	CHECK(NULL != tape && 7 == tape->nr_entries, "snapshot of %s", doc);
+	if (NULL == tape)
+		return;
+
+	len = tape->map_len;
+	entries = (char *)tape->entries - (char *)tape->map;
+	buf = malloc(len);
+
+	for (i = 0; i < sizeof(corrupt_cases) / sizeof(corrupt_cases[0]); ++i)
+	{
+		c = &corrupt_cases[i];
+
+		strcpy(path, "/tmp/json_test.XXXXXX");
+
+		if (FIELD_NONE == c->field)
+		{
+			fd = mkstemp(path);
+			CHECK(fd >= 0 && 0 == JSON_save_tape_binary(&empty, fd), "save empty snapshot");
+			if (fd < 0)
+				continue;
+			close(fd);
+
+			errno = 0;
+			CHECK(NULL == JSON_load_binary(path) && EINVAL == errno, "snapshot with no entries was loaded");
+			unlink(path);
+
+			continue;
+		}
+
+		memcpy(buf, tape->map, len);
+		e = (json_tape_entry_t *)(buf + entries) + c->entry;
+
+		switch(c->field)
+		{
+			case FIELD_TYPE:
+				e->type = c->value;
+				break;
+
+			case FIELD_FLAGS:
+				e->flags |= c->value;
+				break;
+
+			case FIELD_LEN:
+				e->len = c->value;
+				break;
+
+			default:
+				e->u.u = c->value;
+				break;
+		}
+
+		if (write_file(path, buf, len) < 0)
+		{
+			CHECK(0, "write %s", path);
+			continue;
+		}
+
+		errno = 0;
+		CHECK(NULL == JSON_load_binary(path) && EINVAL == errno,
+			"snapshot with entry %d field %d set to %#llx was loaded", c->entry, c->field, c->value);
+		unlink(path);
+	}
+
+	free(buf);
+	JSON_tape_free(tape);
+}
+
+/*
+ * An allocator that refuses after LEFT more calls (never,
+ * if LEFT is negative), to see a tape given up on cleanly
+ * at each of them in turn: a tape or %NULL, and nothing
+ * still held either way. It also refuses any one block
+ * bigger than MOST, unless that is 0.
+ */
+typedef struct Budget
+{
+	int left;
+	int held;
+	size_t most;
+} budget_t;
+
+static void *
+budget_alloc(void *user, size_t size)
+{
+	budget_t *b = user;
+	void *p;
+
+	if (0 == b->left || (b->most && size > b->most))
+		return NULL;
+
+	p = malloc(size);
+	if (NULL != p)
+	{
+		--b->left;
+		++b->held;
+	}
+
+	return p;
+}
+
+static void *
+budget_realloc(void *user, void *p, size_t size)
+{
+	budget_t *b = user;
+	void *q;
+
+	if (0 == b->left || (b->most && size > b->most))
+		return NULL;
+
+	q = realloc(p, size);
+	if (NULL != q)
+	{
+		--b->left;
+		b->held += NULL == p;
+	}
+
+	return q;
+}
+
+static void
+budget_free(void *user, void *p)
+{
+	budget_t *b = user;
+
+	if (NULL != p)
+		--b->held;
+
+	free(p);
+}
+
+static void
+test_tape_alloc(void)
+{
+	json_allocator_t mem = { budget_alloc, budget_realloc, budget_free, NULL };
+	json_parser_t *ctx = JSON_parser_new();
+	json_tape_t *tape = NULL;
+	buf_t d = { 0 };
+	budget_t b;
+	char *doc;
+	char *out;
+	char *ref;
+	int n;
+
+/*
+ * Enough entries and string that both have to grow.
+ */
+	puts_buf(&d, "[{\"key\":\"");
+	for (n = 0; n < 600; ++n)
+		puts_buf(&d, "x");
+	puts_buf(&d, "\"}");
+	for (n = 0; n < 400; ++n)
+		puts_buf(&d, ",1");
+	puts_buf(&d, "]");
+	doc = d.s;
+
+	tape = JSON_parse_tape_ctx(ctx, doc, strlen(doc), 0);
+	ref = dump_tape(tape);
+	JSON_tape_free(tape);
+
+	mem.user = &b;
+
+	for (tape = NULL, n = 0; NULL == tape && n < 1000; ++n)
+	{
+		b.left = n;
+		b.held = 0;
+		b.most = 0;
+
+		JSON_parser_set_allocator(ctx, &mem);
+		tape = JSON_parse_tape_ctx(ctx, doc, strlen(doc), JSON_OPT_STRICT);
+
+		if (NULL != tape)
+		{
+			out = dump_tape(tape);
+			CHECK(same(out, ref), "tape after %d allocations: %s\n\tgot  %s\n\twant %s", n, doc, out, ref);
+			free(out);
+			JSON_tape_free(tape);
+		}
+
+		JSON_parser_set_allocator(ctx, NULL);
+		CHECK(0 == b.held, "tape with %d allocations leaves %d held", n, b.held);
+	}
+
+	CHECK(n > 1, "tape built with %d allocations", n - 1);
+
+	free(ref);
+	free(doc);
+	JSON_parser_free(ctx);
+}
+
+/*
+ * The tape's first guess at its size is from the length
+ * of the input, and must not ask for more than a document
+ * that is mostly padding needs: no block here as big as
+ * half the input.
+ */
+static void
+test_tape_guess(void)
+{
+	json_allocator_t mem = { budget_alloc, budget_realloc, budget_free, NULL };
+	json_parser_t *ctx = JSON_parser_new();
+	json_tape_t *tape;
+	buf_t d = { 0 };
+	budget_t b;
+	char *out;
+	int n;
+
+	puts_buf(&d, "[\"x\",");
+	for (n = 0; n < 1 << 20; ++n)
+		puts_buf(&d, " ");
+	puts_buf(&d, "1]");
+
+	b.left = -1;
+	b.held = 0;
+	b.most = d.len / 2;
+	mem.user = &b;
+	JSON_parser_set_allocator(ctx, &mem);
+
+	tape = JSON_parse_tape_ctx(ctx, d.s, d.len, 0);
+	CHECK(NULL != tape, "tape of %zu bytes with no block over %zu", d.len, b.most);
+	if (NULL != tape)
+	{
+		out = dump_tape(tape);
+		CHECK(same(out, "[\"x\",1]"), "padded tape: %s", out);
+		free(out);
+		JSON_tape_free(tape);
+	}
+
+	JSON_parser_free(ctx);
+	CHECK(0 == b.held, "padded tape leaves %d held", b.held);
+
+	free(d.s);
+}
+
+/*
+ * Dumping, patching and diffing a deep document need a
+ * stack of their own, which comes from the document's
+ * allocator: refused, each fails cleanly, and given,
+ * nothing is left held afterwards.
+ */
+static void
+test_scratch_alloc(void)
+{
+	json_allocator_t mem = { budget_alloc, budget_realloc, budget_free, NULL };
+	json_parser_t *ctx = JSON_parser_new();
+	json_sink_t sk = { 0 };
+	const char *patch = "[{\"op\":\"test\",\"path\":\"\",\"value\":[]}]";
+	json_t *a;
+	json_t *b;
+	buf_t d = { 0 };
+	budget_t bg;
+	int held;
+	int i;
+
+	for (i = 0; i < 200; ++i)
+		puts_buf(&d, "[");
+	for (i = 0; i < 200; ++i)
+		puts_buf(&d, "]");
+
+	bg.left = -1;
+	bg.held = 0;
+	bg.most = 0;
+	mem.user = &bg;
+	JSON_parser_set_allocator(ctx, &mem);
+	JSON_parser_set_max_depth(ctx, 1000);
+
+	a = JSON_parse_ctx(ctx, d.s, d.len, 0);
+	b = JSON_parse_ctx(ctx, d.s, d.len, 0);
+	CHECK(NULL != a && NULL != b, "parse %zu deep", d.len / 2);
+	if (NULL == a || NULL == b)
+		goto out;
+
+	held = bg.held;
+	bg.left = 0;
+
+	CHECK(JSON_dump(a, &sk, 0) < 0, "dump with nothing to allocate");
+	sk.len = 0;
+	CHECK(JSON_diff(a, b, &sk) < 0, "diff with nothing to allocate");
+	CHECK(JSON_PATCH_ERROR == JSON_apply_patch(a, patch, strlen(patch), 0), "patch with nothing to allocate");
+	CHECK(bg.held == held, "refused scratch leaves %d held", bg.held - held);
+
+	bg.left = -1;
+	sk.len = 0;
+
+	CHECK(0 == JSON_dump(a, &sk, 0) && sk.len == d.len, "dump: %zu bytes", sk.len);
+	sk.len = 0;
+	CHECK(0 == JSON_diff(a, b, &sk) && !strcmp(sk.buf, "[]"), "diff: %s", sk.buf);
+	CHECK(JSON_PATCH_FAILED == JSON_apply_patch(a, patch, strlen(patch), 0), "patch");
+	CHECK(bg.held == held, "scratch leaves %d held", bg.held - held);
+
+out:
+	if (NULL != a)
+		JSON_free(a);
+	if (NULL != b)
+		JSON_free(b);
+	JSON_parser_free(ctx);
+
+	CHECK(0 == bg.held, "documents and parser leave %d held", bg.held);
+
+	free(sk.buf);
+	free(d.s);
+}
+
+/*
+ * Members moved about at random in a wide object with
+ * duplicate names, which keeps its index up to date as it
+ * goes: after each change every name has to be found where
+ * a scan from the front first finds it.
+ */
+#define NR_INDEX_NAMES 100
+#define NR_INDEX_OPS 3000
+
+static int
+first_named(json_t *json, json_node_t *node, const char *key, size_t len)
+{
+	const char *name;
+	size_t n;
+	int i;
+
+	for (i = 0; i < node->nr_values; ++i)
+	{
+		name = JSON_name(json, node->values[i], &n);
+		if (n == len && !memcmp(name, key, len))
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+test_index(void)
+{
+	static const int flags[] = { 0, JSON_OPT_INTERN, JSON_OPT_ZERO_COPY };
+	json_parser_t *ctx = JSON_parser_new();
+	json_value_t *held[64];
+	json_value_t *v;
+	json_node_t *node;
+	json_t *json;
+	buf_t d = { 0 };
+	char key[16];
+	size_t f;
+	int nr_held;
+	int bad;
+	int op;
+	int i;
+	int k;
+
+	puts_buf(&d, "{");
+	for (i = 0; i < 120; ++i)
+	{
+		snprintf(key, sizeof(key), "%s\"k%d\":%d", i ? "," : "", i % NR_INDEX_NAMES, i);
+		puts_buf(&d, key);
+	}
+	puts_buf(&d, "}");
+
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); ++f)
+	{
+		rng_state = 7;
+		json = JSON_parse_ctx(ctx, d.s, d.len, flags[f]);
+		if (NULL == json)
+		{
+			CHECK(0, "parse %s", d.s);
+			continue;
+		}
+
+		node = json->root;
+		nr_held = 0;
+
+		for (op = 0, bad = 0; op < NR_INDEX_OPS && !bad; ++op)
+		{
+		/*
+		 * Take out more than put in while there are
+		 * plenty, put back more while there are few.
+		 */
+			if (nr_held < 64 && node->nr_values > 12 && (0 == nr_held || rng(3)))
+			{
+				if (rng(4))
+					v = JSON_node_remove(json, node, rng(node->nr_values));
+				else
+				{
+					snprintf(key, sizeof(key), "k%u", rng(NR_INDEX_NAMES));
+					v = JSON_object_remove(json, node, key, strlen(key));
+				}
+
+				if (NULL != v)
+					held[nr_held++] = v;
+			}
+			else
+			{
+				k = rng(nr_held);
+				v = held[k];
+				held[k] = held[--nr_held];
+
+				if (JSON_node_insert(json, node, rng(node->nr_values + 1), v) < 0)
+				{
+					CHECK(0, "insert at op %d", op);
+					break;
+				}
+			}
+
+			for (k = 0; k < NR_INDEX_NAMES + 2; ++k)
+			{
+				snprintf(key, sizeof(key), "k%d", k);
+				i = first_named(json, node, key, strlen(key));
+				v = JSON_get(json, node, key, strlen(key));
+
+				if (v != (i < 0 ? NULL : node->values[i]))
+					++bad;
+			}
+		}
+
+		CHECK(0 == bad, "index after %d changes, flags %#x: %d names not where they are", op, flags[f], bad);
+		JSON_free(json);
+	}
+
+	free(d.s);
+	JSON_parser_free(ctx);
+}
+
+/*
+ * Patches: what the document is after each, or %NULL if it
+ * fails, in which case it must be just as it was before.
+ */
+typedef struct Patch_Case
+{
+	const char *doc;
+	const char *patch;
+	int flags;
+	int r;
+	const char *want;
+} patch_case_t;
+
+static const patch_case_t patch_cases[] =
+{
+	{ "{\"a\":{\"b\":[1,2,3]},\"c\":\"x\"}",
+		"[{\"op\":\"add\",\"path\":\"/a/b/1\",\"value\":{\"z\":null}},"
+		"{\"op\":\"remove\",\"path\":\"/c\"},"
+		"{\"op\":\"move\",\"from\":\"/a/b/0\",\"path\":\"/m\"},"
+		"{\"op\":\"test\",\"path\":\"/m\",\"value\":1.0},"
+		"{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/d\"},"
+		"{\"op\":\"replace\",\"path\":\"/a/b/0\",\"value\":0},"
+		"{\"op\":\"add\",\"path\":\"/a/b/-\",\"value\":\"e\"}]",
+		0, JSON_PATCH_OK,
+		"{\"a\":{\"b\":[0,2,3,\"e\"]},\"m\":1,\"d\":{\"b\":[{\"z\":null},2,3]}}" },
+	{ "{\"~/\":1}", "[{\"op\":\"replace\",\"path\":\"/~0~1\",\"value\":2}]", 0, JSON_PATCH_OK, "{\"~/\":2}" },
+	{ "[1]", "[{\"op\":\"add\",\"path\":\"\",\"value\":{\"r\":[]}}]", 0, JSON_PATCH_OK, "{\"r\":[]}" },
+
+/*
+ * Each of these fails part way through, after
+ * changes that have to be undone.
+ */
+	{ "{\"a\":[1,2,3],\"b\":{\"c\":4}}",
+		"[{\"op\":\"remove\",\"path\":\"/a/0\"},"
+		"{\"op\":\"move\",\"from\":\"/b/c\",\"path\":\"/a/0\"},"
+		"{\"op\":\"add\",\"path\":\"/b/d\",\"value\":[5]},"
+		"{\"op\":\"test\",\"path\":\"/a/0\",\"value\":5}]",
+		0, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":[1,2,3]}", "[{\"op\":\"replace\",\"path\":\"/a/-\",\"value\":0}]", 0, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":[1,2,3]}", "[{\"op\":\"add\",\"path\":\"/a/4\",\"value\":0}]", 0, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]", 0, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"\"}]", 0, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"/a\"},{\"op\":\"nope\",\"path\":\"/a\"}]", 0, JSON_PATCH_ERROR, NULL },
+	{ "{\"a\":1}", "{\"op\":\"remove\",\"path\":\"/a\"}", 0, JSON_PATCH_ERROR, NULL },
+
+	{ "{\"a\":{\"b\":1,\"c\":2},\"d\":[1]}", "{\"a\":{\"b\":null,\"e\":{\"f\":null,\"g\":3}},\"d\":{\"h\":4}}",
+		JSON_PATCH_MERGE, JSON_PATCH_OK, "{\"a\":{\"c\":2,\"e\":{\"g\":3}},\"d\":{\"h\":4}}" },
+	{ "{\"a\":1}", "[true]", JSON_PATCH_MERGE, JSON_PATCH_OK, "[true]" },
+	{ "[1]", "{\"a\":1}", JSON_PATCH_MERGE, JSON_PATCH_OK, "{\"a\":1}" },
+	{ "{\"a\":1}", "null", JSON_PATCH_MERGE, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":1}", " \"x\" ", JSON_PATCH_MERGE, JSON_PATCH_FAILED, NULL },
+	{ "[1]", "2", JSON_PATCH_MERGE, JSON_PATCH_FAILED, NULL },
+	{ "{\"a\":1}", "\"x\" 1", JSON_PATCH_MERGE, JSON_PATCH_ERROR, NULL },
+	{ "{\"a\":1}", "null", 0, JSON_PATCH_ERROR, NULL },
+};
+
+static void
+test_patch(void)
+{
+	const patch_case_t *c;
+	json_sink_t sk = { 0 };
+	json_t *a;
+	json_t *b;
+	char *before;
+	char *out;
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(patch_cases) / sizeof(patch_cases[0]); ++i)
+	{
+		c = &patch_cases[i];
+		a = JSON_parse_n(c->doc, strlen(c->doc));
+		before = dump(a);
+
+		r = JSON_apply_patch(a, c->patch, strlen(c->patch), c->flags);
+		out = dump(a);
+
+		CHECK(r == c->r && same(out, NULL != c->want ? c->want : before),
+			"patch %s to %s: got %d, %s", c->patch, c->doc, r, out);
+
+		free(out);
+		free(before);
+		JSON_free(a);
+	}
+
+/*
+ * A diff applied to the first document is the second,
+ * which diffing the two again shows.
+ */
+	for (i = 0; i + 1 < sizeof(fixed_docs) / sizeof(fixed_docs[0]); ++i)
+	{
+		a = JSON_parse_n(fixed_docs[i], strlen(fixed_docs[i]));
+		b = JSON_parse_n(fixed_docs[i+1], strlen(fixed_docs[i+1]));
+
+		sk.len = 0;
+		r = JSON_diff(a, b, &sk);
+		CHECK(0 == r && JSON_PATCH_OK == JSON_apply_patch(a, sk.buf, sk.len, 0),
+			"diff %s to %s: %s", fixed_docs[i], fixed_docs[i+1], sk.buf);
+
+		sk.len = 0;
+		CHECK(0 == JSON_diff(a, b, &sk) && !strcmp(sk.buf, "[]"),
+			"diff %s to %s leaves %s", fixed_docs[i], fixed_docs[i+1], sk.buf);
+
+		JSON_free(a);
+		JSON_free(b);
+	}
+
+	free(sk.buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+
+	if (0 == seed)
+		seed = 1;
+
+	test_validate();
+	test_differential(seed);
+	test_long_numbers();
+	test_locale();
+	test_many_trailing();
+	test_snapshot_corrupt();
+	test_tape_alloc();
+	test_tape_guess();
+	test_scratch_alloc();
+	test_index();
+	test_patch();
+
+	printf("%d of %d checks failed\n", nr_failed, nr_checked);
+
+	return nr_failed > 255 ? 255 : nr_failed;
+}